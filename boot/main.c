@@ -39,9 +39,10 @@
  **********************************************************************/
 
 #define SECTSIZE	512
+#define MAXSECTS	128		// Sectors to read per disk command
 #define ELFHDR		((elfhdr *) 0x10000) // scratch space
 
-void readsect(void*, uint32_t);
+void waitdisk(void);
 void readseg(uint32_t, uint32_t, uint32_t);
 
 void
@@ -80,7 +81,7 @@ bad:
 void
 readseg(uint32_t va, uint32_t count, uint32_t offset)
 {
-	uint32_t end_va;
+	uint32_t end_va, n;
 
 	va &= 0xFFFFFF;
 	end_va = va + count;
@@ -91,13 +92,32 @@ readseg(uint32_t va, uint32_t count, uint32_t offset)
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
-	// we load in increasing order.
+	// Read MAXSECTS sectors at a time with each disk command,
+	// so that big kernels with lots of initial files load quickly.
+	// We'll write more to memory than asked, but it doesn't matter --
+	// we load in increasing order.  kern/Makefrag pads the disk image
+	// so that we never read past its end.
 	while (va < end_va) {
-		readsect((uint8_t*) va, offset);
-		va += SECTSIZE;
-		offset++;
+		// wait for disk to be ready
+		waitdisk();
+
+		outb(0x1F2, MAXSECTS);	// count = MAXSECTS
+		outb(0x1F3, offset);
+		outb(0x1F4, offset >> 8);
+		outb(0x1F5, offset >> 16);
+		outb(0x1F6, (offset >> 24) | 0xE0);
+		outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
+		offset += MAXSECTS;
+
+		// the disk hands us the sectors one at a time
+		for (n = 0; n < MAXSECTS; n++) {
+			// wait for disk to be ready
+			waitdisk();
+
+			// read a sector
+			insl(0x1F0, (uint8_t*) va, SECTSIZE/4);
+			va += SECTSIZE;
+		}
 	}
 }
 
@@ -109,24 +129,4 @@ waitdisk(void)
 		/* do nothing */;
 }
 
-void
-readsect(void *dst, uint32_t offset)
-{
-	// wait for disk to be ready
-	waitdisk();
-
-	outb(0x1F2, 1);		// count = 1
-	outb(0x1F3, offset);
-	outb(0x1F4, offset >> 8);
-	outb(0x1F5, offset >> 16);
-	outb(0x1F6, (offset >> 24) | 0xE0);
-	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
-
-	// wait for disk to be ready
-	waitdisk();
-
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
-}
-
 #endif /* LAB >= 1 */
@@ -1,6 +1,7 @@
 /*
  * search ACPI tables
- * partial implementation, just for finding LAPIC and IOAPIC
+ * partial implementation, just for finding LAPIC and IOAPIC,
+ * and the NUMA topology of CPUs and memory
  */
 
 #include <inc/types.h>
@@ -109,6 +110,105 @@ madt_scan(struct acpi_madt *madt)
 	return ret;
 }
 
+#if LAB >= 9
+// The SRAT may come before or after the MADT that creates our cpu structs,
+// so we record each LAPIC's node here and apply them once all tables are in.
+static bool srat_found, slit_found;
+static uint8_t srat_apicnode[256];	// Node+1 of each LAPIC id, 0 if none
+
+// Return the node number for an ACPI proximity domain, or -1 if too big.
+static int
+srat_node(uint32_t domain)
+{
+	if (domain >= MEM_MAXNODES) {
+		warn("acpi: ignoring proximity domain %u", domain);
+		return -1;
+	}
+	if (domain >= mem_nnodes)
+		mem_nnodes = domain + 1;
+	return domain;
+}
+
+static void
+srat_scan(struct acpi_srat *srat)
+{
+	int32_t length = srat->header.length;
+	if (srat_found || memcmp(srat, "SRAT", 4) != 0
+			|| sum((uint8_t*)srat, length) != 0)
+		return;
+	srat_found = true;
+	length -= sizeof(struct acpi_srat);
+	uint8_t *p = srat->ent;
+	while (length > 0 && p[1] > 0) {
+		struct acpi_srat_lapic *l = (struct acpi_srat_lapic *)p;
+		struct acpi_srat_x2apic *x = (struct acpi_srat_x2apic *)p;
+		struct acpi_srat_mem *m = (struct acpi_srat_mem *)p;
+		int node;
+		switch (p[0]) {
+		case SRAT_LAPIC:
+			node = srat_node(l->domainlo | l->domainhi[0] << 8
+					| l->domainhi[1] << 16
+					| (uint32_t)l->domainhi[2] << 24);
+			if ((l->flag & SRAT_ENABLE) && node >= 0)
+				srat_apicnode[l->lapicid] = node + 1;
+			break;
+		case SRAT_X2APIC:
+			node = srat_node(x->domain);
+			if ((x->flag & SRAT_ENABLE) && node >= 0
+					&& x->x2apicid < 256)
+				srat_apicnode[x->x2apicid] = node + 1;
+			break;
+		case SRAT_MEM:
+			if ((m->flag & SRAT_ENABLE) && m->size > 0
+					&& (node = srat_node(m->domain)) >= 0)
+				mem_addnode(m->base, m->size, node);
+			break;
+		default:
+			break;
+		}
+		length -= p[1];
+		p += p[1];
+	}
+}
+
+static void
+slit_scan(struct acpi_slit *slit)
+{
+	if (slit_found || memcmp(slit, "SLIT", 4) != 0
+			|| sum((uint8_t*)slit, slit->header.length) != 0)
+		return;
+	slit_found = true;
+	int n = MIN(slit->ndomains, MEM_MAXNODES);
+	int i, j;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+			mem_nodedist[i][j] = slit->dist[i * slit->ndomains + j];
+}
+
+// Give each CPU its node and hand the memory topology to the allocator.
+static void
+numa_init(void)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (srat_apicnode[c->id] > 0)
+			c->node = srat_apicnode[c->id] - 1;
+	mem_initnodes();
+}
+#endif	// LAB >= 9
+
+// Scan one table the RSDT or XSDT points to,
+// returning true if it is the first valid MADT we've found.
+static bool
+sdt_scan(struct acpi_sdt_hdr *hdr, bool found)
+{
+#if LAB >= 9
+	srat_scan((struct acpi_srat *)hdr);
+	slit_scan((struct acpi_slit *)hdr);
+#endif
+	return !found && madt_scan((struct acpi_madt *)hdr);
+}
+
 static bool
 rsdt_scan(struct acpi_rsdt *rsdt)
 {
@@ -117,11 +217,11 @@ rsdt_scan(struct acpi_rsdt *rsdt)
 		return false;
 	uint32_t cnt = (length - sizeof(struct acpi_sdt_hdr)) / 4;
 	uint32_t i;
-	for (i = 0; i < cnt; i++) {
-		bool valid = madt_scan(mem_ptr(rsdt->ent[i]));
-		if (valid) return true;
-	}
-	return false;
+	bool valid = false;
+	for (i = 0; i < cnt; i++)
+		if (sdt_scan(mem_ptr(rsdt->ent[i]), valid))
+			valid = true;
+	return valid;
 }
 
 static bool
@@ -132,11 +232,11 @@ xsdt_scan(struct acpi2_xsdt *xsdt)
 		return false;
 	uint32_t cnt = (length - sizeof(struct acpi_sdt_hdr)) / 8;
 	uint32_t i;
-	for (i = 0; i < cnt; i++) {
-		bool valid = madt_scan(mem_ptr(xsdt->ent[i]));
-		if (valid) return true;
-	}
-	return false;
+	bool valid = false;
+	for (i = 0; i < cnt; i++)
+		if (sdt_scan(mem_ptr(xsdt->ent[i]), valid))
+			valid = true;
+	return valid;
 }
 
 void
@@ -174,11 +274,13 @@ acpi_init(void)
 			mem_phys(rsdp), mem_phys(rsdt), mem_phys(xsdt), 
 			rsdp->length, sizeof (struct acpi2_rsdp));
 #endif
-		if (rsdt_scan(rsdt))
-			return;
-		xsdt_scan(xsdt);
+		if (!rsdt_scan(rsdt))
+			xsdt_scan(xsdt);
 	} else {
 		return;
 	}
+#if LAB >= 9
+	numa_init();
+#endif
 }
 
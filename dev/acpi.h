@@ -1,6 +1,7 @@
 /*
  * ACPI definitions
- * partial implementation, just for finding LAPIC and IOAPIC
+ * partial implementation, just for finding LAPIC and IOAPIC,
+ * and the NUMA topology of CPUs and memory
  */
 
 #ifndef PIOS_DEV_ACPI_H
@@ -82,6 +83,61 @@ struct acpi_madt_ioapic {
 	uint32_t gsibase;		// 32bit global system interrupt base
 } gcc_packed;
 
+#if LAB >= 9
+struct acpi_srat {
+	struct acpi_sdt_hdr header;	// 'SRAT'
+	uint32_t reserved1;		// 1 for backward compatibility
+	uint64_t reserved2;
+	uint8_t ent[0];			// vary-length static resource affinities
+} gcc_packed;
+
+#define SRAT_LAPIC	0x00
+#define SRAT_MEM	0x01
+#define SRAT_X2APIC	0x02
+
+struct acpi_srat_lapic {
+	uint8_t type;			// SRAT_LAPIC
+	uint8_t length;
+	uint8_t domainlo;		// proximity domain bits 0-7
+	uint8_t lapicid;		// LAPIC id
+	uint32_t flag;
+	uint8_t sapiceid;
+	uint8_t domainhi[3];		// proximity domain bits 8-31
+	uint32_t clockdomain;
+} gcc_packed;
+
+struct acpi_srat_mem {
+	uint8_t type;			// SRAT_MEM
+	uint8_t length;
+	uint32_t domain;		// proximity domain
+	uint16_t reserved1;
+	uint64_t base;			// physical base address of range
+	uint64_t size;			// length of range in bytes
+	uint32_t reserved2;
+	uint32_t flag;
+	uint64_t reserved3;
+} gcc_packed;
+
+struct acpi_srat_x2apic {
+	uint8_t type;			// SRAT_X2APIC
+	uint8_t length;
+	uint16_t reserved1;
+	uint32_t domain;		// proximity domain
+	uint32_t x2apicid;		// x2APIC id
+	uint32_t flag;
+	uint32_t clockdomain;
+	uint32_t reserved2;
+} gcc_packed;
+
+#define SRAT_ENABLE	0x0001		// Entry is enabled (all types)
+
+struct acpi_slit {
+	struct acpi_sdt_hdr header;	// 'SLIT'
+	uint64_t ndomains;		// number of proximity domains
+	uint8_t dist[0];		// ndomains x ndomains relative distances
+} gcc_packed;
+#endif	// LAB >= 9
+
 void acpi_init(void);
 
 #endif // !PIOS_DEV_ACPI_H
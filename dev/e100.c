@@ -14,6 +14,7 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 
+#include <kern/cpu.h>
 #include <kern/mem.h>
 #include <kern/spinlock.h>
 #include <kern/net.h>
@@ -22,6 +23,7 @@
 #include <dev/ioapic.h>
 #include <dev/pci.h>
 #include <dev/e100.h>
+#include <dev/vnet.h>
 
 
 bool e100_present;
@@ -29,12 +31,15 @@ uint8_t e100_irq;
 
 #define E100_TX_SLOTS			64
 #define E100_RX_SLOTS			64
+#define E100_RX_SPARES			16	// Spare slots to swap into RX ring
+#define E100_TX_SMALL			128	// Bodies this small we just copy
 
 #define E100_NULL			0xffffffff
 #define E100_SIZE_MASK			0x3fff	// mask out status/control bits
 
 #define	E100_CSR_SCB_STATACK		0x01	// scb_statack (1 byte)
 #define	E100_CSR_SCB_COMMAND		0x02	// scb_command (1 byte)
+#define	E100_CSR_SCB_INTMASK		0x03	// scb_command high byte
 #define	E100_CSR_SCB_GENERAL		0x04	// scb_general (4 bytes)
 #define	E100_CSR_PORT			0x08	// port (4 bytes)
 #define E100_CSR_EEPROM			0x0e	// EEPROM control reg (1 byte)
@@ -47,6 +52,8 @@ uint8_t e100_irq;
 #define E100_SCB_COMMAND_RU_START	1
 #define E100_SCB_COMMAND_RU_RESUME	2
 
+#define E100_SCB_INTMASK_M		0x01	// mask all interrupts
+
 #define E100_SCB_STATACK_RNR		0x10
 #define E100_SCB_STATACK_CNA		0x20
 #define E100_SCB_STATACK_FR		0x40
@@ -114,11 +121,12 @@ struct e100_rbd {
 	volatile uint16_t rbd_pad1;
 };
 
+// Transmit slots use flexible mode: the first TBD covers the copied
+// packet header, and the second, if used, a body the card reads in place.
 struct e100_tx_slot {
 	struct e100_cb_tx tcb;	// Transmit command block
-	struct e100_tbd tbd;	// Transmit buffer descriptor
-	struct e100_tbd unused;	// Some cards require a second "Extended TBD"
-	char buf[NET_MAXPKT];	// Buffer
+	struct e100_tbd tbd[2];	// Transmit buffer descriptors
+	char buf[NET_MAXPKT];	// Buffer for header and any copied body
 };
 
 struct e100_rx_slot {
@@ -135,10 +143,15 @@ static struct {
 	int tx_tail;	// Next slot e100 should transmit and mark complete
 	char tx_idle;
 
-	struct e100_rx_slot rx[E100_RX_SLOTS];
+	struct e100_rx_slot *rx[E100_RX_SLOTS];	// Slots in the receive ring
 	int rx_head;	// Next slot e100 should receive into and mark complete
 	int rx_tail;	// Last slot e100 can use before it must suspend
 	char rx_idle;
+	struct e100_rx_slot *rx_spare[E100_RX_SPARES];	// Slots out of ring
+	int rx_nspare;
+	struct e100_rx_slot rx_pool[E100_RX_SLOTS + E100_RX_SPARES];
+
+	bool polling;	// Interrupts masked; CPUs poll us via e100_poll()
 
 	int eebits;
 	union {
@@ -210,22 +223,44 @@ int e100_tx(void *hdr, int hlen, void *body, int blen)
 	}
 
 	i = e100.tx_head % E100_TX_SLOTS;
+	struct e100_tx_slot *s = &e100.tx[i];
+
+	// Copy the packet header into the transmit buffer,
+	// along with the body if it's short or won't survive until
+	// the card reads it, being on our kernel stack or in net scratch space.
+	// Otherwise the card fetches the body right where it is,
+	// typically in a page frame being pulled by another node.
+	memcpy(s->buf, hdr, hlen);
+	int len = hlen;
+	if (net_txtransient(body) || blen <= E100_TX_SMALL || hlen + blen < 64) {
+		memcpy(s->buf + hlen, body, blen);
+		len += blen;
+		blen = 0;
+	}
 
-	// Copy the packet header and body into the transmit buffer
-	memcpy(e100.tx[i].buf, hdr, hlen);
-	memcpy(e100.tx[i].buf+hlen, body, blen);
-
-	// Compute the total packet length,
-	// accounting for Ethernet's 64-byte minimum.
+	// Account for Ethernet's 64-byte minimum packet length.
 	// XXX include the 4-byte trailing CRC.
-	int len = MAX(hlen + blen, 64);
+	if (blen == 0)
+		len = MAX(len, 64);
 
 	// Set up the transmit command block
-	e100.tx[i].tbd.tb_addr = mem_phys(e100.tx[i].buf);
-	e100.tx[i].tbd.tb_size = len;
-	e100.tx[i].tcb.cb_status = 0;
-	e100.tx[i].tcb.cb_command = E100_CB_COMMAND_XMIT
-		| E100_CB_COMMAND_SF | E100_CB_COMMAND_I | E100_CB_COMMAND_S;
+	s->tbd[0].tb_addr = mem_phys(s->buf);
+	s->tbd[0].tb_size = len;
+	s->tbd[1].tb_addr = blen > 0 ? mem_phys(body) : 0;
+	s->tbd[1].tb_size = blen;
+	s->tcb.tbd_number = blen > 0 ? 2 : 1;
+	s->tcb.cb_status = 0;
+	s->tcb.cb_command = E100_CB_COMMAND_XMIT
+		| E100_CB_COMMAND_SF | E100_CB_COMMAND_S;
+
+	// Let the card run on from the previous command into this one
+	// instead of suspending, so back-to-back packets go out in a burst
+	// and cost one CNA interrupt at the end rather than one each.
+	// If the card has already suspended, e100_tx_start() resumes it.
+	if (e100.tx_head > e100.tx_tail) {
+		int prev = (e100.tx_head - 1) % E100_TX_SLOTS;
+		e100.tx[prev].tcb.cb_command &= ~E100_CB_COMMAND_S;
+	}
 	e100.tx_head++;
 
 	e100_tx_start();
@@ -239,13 +274,13 @@ static void e100_rx_start(void)
 	assert(spinlock_holding(&e100.lock));
 
 	int i = e100.rx_head % E100_RX_SLOTS;
-	if (e100.rx[i].rfd.status & E100_RFA_STATUS_C)
+	if (e100.rx[i]->rfd.status & E100_RFA_STATUS_C)
 		return;		// We haven't finished processing this RFD.
 
 	if (e100.rx_idle) {
 		e100_scb_wait();
 		outl(e100.iobase + E100_CSR_SCB_GENERAL, 
-		     mem_phys(&e100.rx[i].rfd));
+		     mem_phys(&e100.rx[i]->rfd));
 		e100_scb_cmd(E100_SCB_COMMAND_RU_START);
 		e100.rx_idle = 0;
 	} else {
@@ -270,7 +305,6 @@ static void e100_intr_rx(void)
 {
 	assert(spinlock_holding(&e100.lock));
 
-	int *count;
 	int i;
 
 	// Dispatch newly-filled receive buffers
@@ -281,7 +315,8 @@ static void e100_intr_rx(void)
 	// on the RFD while the received packet is being processed.
 	while (1) {
 		i = e100.rx_head % E100_RX_SLOTS;
-		if (!(e100.rx[i].rfd.status & E100_RFA_STATUS_C))
+		struct e100_rx_slot *s = e100.rx[i];
+		if (!(s->rfd.status & E100_RFA_STATUS_C))
 			break;	// No more un-processed packets received
 
 		// "Claim" this RFD by moving e100.rx_head past it,
@@ -290,36 +325,62 @@ static void e100_intr_rx(void)
 		// while we have the e100.lock released below.
 		e100.rx_head++;
 
+		// If we can, swap a spare slot into the ring in place of
+		// this one, so the card can refill the ring position
+		// while we're still processing the packet we just got.
+		// We must relink the preceding RFD, which is safe only if
+		// the card can't reach it before the tail moves past it:
+		// i.e., if the preceding RFD is itself claimed.
+		// (If it's the tail's "suspend" RFD, the card may already
+		// have fetched its link to this slot.)
+		bool swapped = 0;
+		if (e100.rx_head - 1 > e100.rx_tail && e100.rx_nspare > 0) {
+			struct e100_rx_slot *n =
+				e100.rx_spare[--e100.rx_nspare];
+			n->rfd.control = E100_RFA_CONTROL_S;
+			n->rfd.status = 0;
+			n->rfd.actual = 0;
+			n->rfd.link_addr = s->rfd.link_addr;
+			int prev = (i + E100_RX_SLOTS - 1) % E100_RX_SLOTS;
+			e100.rx[prev]->rfd.link_addr = mem_phys(&n->rfd);
+			e100.rx[i] = n;
+			swapped = 1;
+		}
+
 		// Dispatch the received packet to our network stack.
-		if (e100.rx[i].rfd.status & E100_RFA_STATUS_OK) {
+		if (s->rfd.status & E100_RFA_STATUS_OK) {
 			spinlock_release(&e100.lock);
-			int len = e100.rx[i].rfd.actual & E100_SIZE_MASK;
-			net_rx(e100.rx[i].buf, len);
+			int len = s->rfd.actual & E100_SIZE_MASK;
+			net_rx(s->buf, len);
 			spinlock_acquire(&e100.lock);
 		} else
-			warn("e100: packet receive error: %x",
-				e100.rx[i].rfd.status);
-		assert(e100.rx[i].rfd.status & E100_RFA_STATUS_C);
+			warn("e100: packet receive error: %x", s->rfd.status);
+		assert(s->rfd.status & E100_RFA_STATUS_C);
+
+		if (swapped) {	// Slot just goes back in the spare pool
+			e100.rx_spare[e100.rx_nspare++] = s;
+			continue;
+		}
 
 		// Un-claim this RFD and get it ready to be filled again.
 		// Different RFDs might be un-claimed out of order
 		// due to concurrency among the CPUs.
 		// Mark all RFDs "suspend" until tail catches up.
-		e100.rx[i].rfd.control = E100_RFA_CONTROL_S;
-		e100.rx[i].rfd.status = 0;
-		e100.rx[i].rfd.actual = 0;
+		s->rfd.control = E100_RFA_CONTROL_S;
+		s->rfd.status = 0;
+		s->rfd.actual = 0;
 	}
 
 	// Now move the tail forward to the first uncompleted RFD,
 	// clearing unnecessary "suspend" bits as we go.
 	while (e100.rx_tail < e100.rx_head) {
 		i = e100.rx_tail % E100_RX_SLOTS;
-		if (e100.rx[i].rfd.status & E100_RFA_STATUS_C)
+		if (e100.rx[i]->rfd.status & E100_RFA_STATUS_C)
 			break;	// This RFD still being processed by some CPU
 
-		assert(e100.rx[i].rfd.control == E100_RFA_CONTROL_S);
+		assert(e100.rx[i]->rfd.control == E100_RFA_CONTROL_S);
 		i = (e100.rx_tail - 1) % E100_RX_SLOTS;
-		e100.rx[i].rfd.control = 0;	// Prev RFD need not suspend
+		e100.rx[i]->rfd.control = 0;	// Prev RFD need not suspend
 		e100.rx_tail++;
 	}
 }
@@ -357,6 +418,37 @@ void e100_intr(void)
 	spinlock_release(&e100.lock);
 }
 
+// Switch between interrupt-driven and polled operation.
+// While polling, the card's interrupts stay masked
+// and idle CPUs (and the timer tick) call e100_poll() instead,
+// so a stream of page pull replies doesn't interrupt us per packet.
+void e100_setpoll(bool poll)
+{
+	spinlock_acquire(&e100.lock);
+	if (poll != e100.polling) {
+		e100.polling = poll;
+		outb(e100.iobase + E100_CSR_SCB_INTMASK,
+			poll ? E100_SCB_INTMASK_M : 0);
+	}
+	spinlock_release(&e100.lock);
+
+	if (!poll)
+		e100_poll();	// catch anything that came in while masked
+}
+
+// Do whatever e100_intr() would, if it looks like there's anything to do.
+// The check is unlocked, so that idle CPUs don't fight over e100.lock.
+void e100_poll(void)
+{
+	int i = e100.rx_head % E100_RX_SLOTS;
+	int t = e100.tx_tail % E100_TX_SLOTS;
+	if (!(e100.rx[i]->rfd.status & E100_RFA_STATUS_C) && !e100.rx_idle
+			&& (e100.tx_head == e100.tx_tail
+			    || !(e100.tx[t].tcb.cb_status & E100_CB_STATUS_C)))
+		return;
+	e100_intr();
+}
+
 // Clock a serial opcode/address bit out to the EEPROM.
 int e100_eebit(bool bit)
 {
@@ -429,16 +521,20 @@ int e100_attach(struct pci_func *pcif)
 		e100.tx[i].tcb.tx_threshold = 4;
 	}
 
-	// Setup RX DMA ring for RU
+	// Setup RX DMA ring for RU, and the spare slots
+	for (i = 0; i < E100_RX_SLOTS + E100_RX_SPARES; i++) {
+		memset(&e100.rx_pool[i], 0, sizeof(e100.rx_pool[i]));
+		e100.rx_pool[i].rfd.size = NET_MAXPKT;
+		if (i >= E100_RX_SLOTS)
+			e100.rx_spare[e100.rx_nspare++] = &e100.rx_pool[i];
+		else
+			e100.rx[i] = &e100.rx_pool[i];
+	}
 	for (i = 0; i < E100_RX_SLOTS; i++) {
 		next = (i + 1) % E100_RX_SLOTS;
-		memset(&e100.rx[i], 0, sizeof(e100.rx[i]));
-		e100.rx[i].rfd.control = 0;
-		e100.rx[i].rfd.status = 0;
-		e100.rx[i].rfd.size = NET_MAXPKT;
-		e100.rx[i].rfd.link_addr = mem_phys(&e100.rx[next].rfd);
+		e100.rx[i]->rfd.link_addr = mem_phys(&e100.rx[next]->rfd);
 	}
-	e100.rx[E100_RX_SLOTS-1].rfd.control = E100_RFA_CONTROL_S;
+	e100.rx[E100_RX_SLOTS-1]->rfd.control = E100_RFA_CONTROL_S;
 
 	// Determine the EEPROM's size (number of address bits)
 	outb(e100.iobase + E100_CSR_EEPROM, E100_EECS);	// activate
@@ -459,7 +555,8 @@ int e100_attach(struct pci_func *pcif)
 	for (i = 0; i < 6; i++)
 		cprintf("%c%02x", i ? ':' : ' ', e100.mac[i]);
 	cprintf("\n");
-	memcpy(net_mac, e100.mac, 6);
+	if (!vnet_present)	// virtio card takes precedence
+		memcpy(net_mac, e100.mac, 6);
 
 	// Enable network card interrupts
 	pic_enable(e100_irq);
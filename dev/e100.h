@@ -20,6 +20,8 @@ extern uint8_t e100_irq;
 int  e100_attach(struct pci_func *pcif);
 int  e100_tx(void *hdr, int hlen, void *body, int blen);
 void e100_intr(void);
+void e100_setpoll(bool poll);
+void e100_poll(void);
 
 #endif	// PIOS_KERN_E100_H
 #endif  // LAB >= 5
@@ -1,9 +1,20 @@
-#if LAB >= 99
+#if LAB >= 9
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * IDE driver for the second disk on the primary channel,
+ * which the kernel pages memory out to (see kern/swap.c).
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  *
+ * Transfers use PCI bus-master DMA when the controller supports it,
+ * moving up to IDE_MAXSECS sectors per command straight to or from memory,
+ * and fall back on programmed I/O otherwise.
+ * Requests wait in a FIFO queue of up to IDE_QLEN entries
+ * while the disk works on the one at its head;
+ * the disk's interrupt completes that one and starts the next.
+ * Since the kernel itself runs with interrupts disabled,
+ * kernel code waiting on a request polls for completions,
+ * running the same code as ide_intr().
+ *
  * Copyright (C) 1997 Massachusetts Institute of Technology
  * See section "MIT License" in the file LICENSES for licensing terms.
  *
@@ -15,130 +26,318 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
 #include <inc/trap.h>
+#include <inc/vm.h>
 
+#include <kern/cpu.h>
+#include <kern/mem.h>
 #include <kern/spinlock.h>
-#include <kern/mp.h>
-#include <kern/io.h>
 
 #include <dev/ide.h>
+#include <dev/pci.h>
 #include <dev/pic.h>
 #include <dev/ioapic.h>
 
 #define IDE_BSY		0x80
 #define IDE_DRDY	0x40
 #define IDE_DF		0x20
+#define IDE_DRQ		0x08
 #define IDE_ERR		0x01
 
+#define IDE_TIMEOUT	1000000	// Status polls before giving up on the disk
+
+// Bus master IDE registers for the primary channel,
+// at offsets from the I/O base in the controller's PCI BAR 4.
+#define BM_CMD		0	// Command register
+#define BM_CMD_START	0x01	//   Start bus mastering
+#define BM_CMD_READ	0x08	//   Transfer from disk to memory
+#define BM_STAT		2	// Status register
+#define BM_STAT_ERR	0x02	//   DMA error (write 1 to clear)
+#define BM_STAT_IRQ	0x04	//   Disk has interrupted (write 1 to clear)
+#define BM_PRDT		4	// Physical address of the PRD table
+
+// Physical region descriptor: one contiguous piece of a DMA transfer,
+// which must not cross a 64KB boundary.
+typedef struct ide_prd {
+	uint32_t	addr;		// Physical address of the region
+	uint16_t	size;		// Size in bytes, 0 meaning 64KB
+	uint16_t	flags;		// IDE_PRD_EOT on the last region
+} ide_prd;
+#define IDE_PRD_EOT	0x8000
+
+// PRD entries one request can need
+#define IDE_NPRD	(IDE_MAXSECS * IDE_SECSIZE / 65536 + 1)
+
 static int diskno = 1;
 
-static spinlock idelock;
-static bool pending;		// read/write I/O operation in progress
-static bool write;		// pending operation is a write
-static int secno;		// sector number of pending operation
-static bool done;		// pending operation has completed
+uint32_t ide_nsecs;
+
+static uint16_t ide_bmbase;		// Bus master I/O base, 0 if none
+
+static spinlock idelock;		// Protects the queue and the controller
+static iderq *ide_head, *ide_tail;	// Request queue; head is in progress
+static int ide_nq;			// Number of requests in the queue
+static ide_prd ide_prdt[IDE_NPRD] gcc_aligned(64); // PRD table for DMA
+
 
-static int
-ide_wait()
+// Wait for the disk to finish its current command,
+// returning true if it did so without error.
+static bool
+ide_ready(void)
 {
-	int r;
-	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+	int r, x;
+	for (x = 0; x < IDE_TIMEOUT; x++) {
+		r = inb(0x1F7);
+		if (r == 0xff)
+			return 0;	// floating bus: no drive at all
+		if ((r & (IDE_BSY|IDE_DRDY)) == IDE_DRDY)
+			return (r & (IDE_DF|IDE_ERR)) == 0;
 		pause();
-	return (r & (IDE_DF|IDE_ERR)) == 0;
+	}
+	return 0;
+}
+
+// Called by the PCI code when it finds an IDE controller.
+int
+ide_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+
+	// BAR 4 holds the bus master registers, if the controller has any;
+	// the first 8 ports are for the primary channel.
+	ide_bmbase = pcif->reg_base[4];
+	return 1;
 }
 
 void
 ide_init(void)
 {
-	int r, x;
+	if (!cpu_onboot())
+		return;
 
 	spinlock_init(&idelock);
 
-	// Enable the IDE interrupt
-	pic_enable(IRQ_IDE);
-	ioapic_enable(IRQ_IDE);
+	// Poll during identification: set nIEN in the control register.
+	outb(0x3F6, 0x02);
 
-	// wait for Device 0 to be ready
-	ide_wait();
+	// Select Device 1 and ask it to identify itself.
+	outb(0x1F6, 0xE0 | ((diskno & 1)<<4));
+	if (!ide_ready()) {
+		warn("ide_init: disk %d not present", diskno);
+		return;
+	}
+	outb(0x1F7, 0xEC);	// CMD 0xEC means identify device
+	if (inb(0x1F7) == 0 || !ide_ready() || !(inb(0x1F7) & IDE_DRQ)) {
+		warn("ide_init: disk %d not ATA", diskno);
+		return;
+	}
+	uint16_t id[IDE_SECSIZE/2];
+	insl(0x1F0, id, IDE_SECSIZE/4);
 
-	// switch to Device 1
-	outb(0x1F6, 0xE0 | (1<<4));
+	// Words 60-61 hold the number of LBA28-addressable sectors,
+	// and bit 8 of word 49 says whether the disk can do DMA.
+	ide_nsecs = id[60] | (uint32_t)id[61] << 16;
+	if (!(id[49] & 0x100))
+		ide_bmbase = 0;
+	cprintf("ide: disk %d has %d MB, using %s\n", diskno,
+		(int)(ide_nsecs / (1024*1024/IDE_SECSIZE)),
+		ide_bmbase ? "DMA" : "PIO");
 
-	// check for Device 1 to be ready for a while
-	for (x = 0; 
-           x < 1000 && ((r = inb(0x1F7)) & (IDE_BSY|IDE_DF|IDE_ERR)) != 0; 
-           x++)
-		pause();
-	if (x == 1000)
-		panic("Disk 1 not present!");
+	// Enable the IDE interrupt to signal completions.
+	outb(0x3F6, 0);
+	pic_enable(IRQ_IDE);
+	ioapic_enable(IRQ_IDE);
+}
 
-	// switch back to Device 0
-	outb(0x1F6, 0xE0 | (0<<4));
+// Return the physical address of a kernel buffer, or 0 if DMA can't reach it.
+// The kernel image runs at its own physical address;
+// everything else is in the direct map of physical memory at VM_KERNLO.
+static uint32_t
+ide_dmaaddr(const void *va, size_t len)
+{
+	uintptr_t pa = (uintptr_t)va >= VM_KERNLO ? mem_phys(va)
+						: (uintptr_t)va;
+	if ((pa & 1) || pa + len > 0x100000000ULL)
+		return 0;	// PRDs hold 32-bit, word-aligned addresses
+	return pa;
 }
 
-// Output to disk device: initiate a sector read or write.
-void ide_output(const struct iodisk *io)
+// Issue a command for nsecs sectors starting at secno.
+static void
+ide_cmd(uint32_t secno, size_t nsecs, int cmd)
 {
-	spinlock_acquire(&idelock);
-	if(pending)
-		panic("overlapped disk I/O not supported");
-
-	ide_wait();
-
-	outb(0x3f6, 0);		// generate interrupt
-	outb(0x1f2, 1);		// number of sectors
-	outb(0x1f3, io->secno & 0xff);
-	outb(0x1f4, (io->secno >> 8) & 0xff);
-	outb(0x1f5, (io->secno >> 16) & 0xff);
-	outb(0x1f6, 0xe0 | ((diskno & 1)<<4) | ((io->secno>>24) & 0x0F));
-
-	if (io->write) {
-		outb(0x1f7, 0x30);	// CMD 0x30 means write sector
-		outsl(0x1f0, io->data, IODISK_SECSIZE/4);
-	} else {
-		outb(0x1f7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F2, nsecs & 0xff);	// number of sectors (0 means 256)
+	outb(0x1F3, secno & 0xff);
+	outb(0x1F4, (secno >> 8) & 0xff);
+	outb(0x1F5, (secno >> 16) & 0xff);
+	outb(0x1F6, 0xE0 | ((diskno & 1)<<4) | ((secno>>24) & 0x0F));
+	outb(0x1F7, cmd);
+}
+
+// Do the whole transfer for rq with programmed I/O,
+// returning true on success.
+static bool
+ide_pio(iderq *rq)
+{
+	uint8_t *buf = rq->buf;
+	int n;
+	ide_cmd(rq->secno, rq->nsecs, rq->write ? 0x30 : 0x20);
+	for (n = 0; n < rq->nsecs; n++, buf += IDE_SECSIZE) {
+		if (!ide_ready())
+			return 0;
+		if (rq->write)
+			outsl(0x1F0, buf, IDE_SECSIZE/4);
+		else
+			insl(0x1F0, buf, IDE_SECSIZE/4);
 	}
+	return !rq->write || ide_ready();  // wait for a write to land
+}
 
-	pending = 1;
-	write = io->write;
-	secno = io->secno;
-	done = 0;
-	spinlock_release(&idelock);
+// Take the request at the head of the queue off, marking it done.
+static void
+ide_finish(bool ok)
+{
+	iderq *rq = ide_head;
+	ide_head = rq->next;
+	if (ide_head == NULL)
+		ide_tail = NULL;
+	ide_nq--;
+	rq->ok = ok;
+	rq->done = 1;
 }
 
-// Input from disk device: collect the results of a read or write.
-bool ide_input(struct iodisk *io)
+// Start the disk on the request at the head of the queue, if any.
+// A request DMA can't handle we complete on the spot with programmed I/O.
+static void
+ide_issue(void)
 {
-	spinlock_acquire(&idelock);
-	if (!pending || !done) {
-		spinlock_release(&idelock);
-		return 0;	// no results ready to return
+	iderq *rq;
+	uint32_t pa = 0;
+	while ((rq = ide_head) != NULL) {
+		pa = ide_dmaaddr(rq->buf, rq->nsecs * IDE_SECSIZE);
+		if (!ide_ready())
+			ide_finish(0);
+		else if (ide_bmbase == 0 || pa == 0)
+			ide_finish(ide_pio(rq));
+		else
+			break;
 	}
+	if (rq == NULL)
+		return;
 
-	// Fill in the iodisk struct with the completion information
-	io->type = IO_DISK;
-	io->write = write;
-	io->secno = secno;
+	// Describe the buffer to the controller in PRDs.
+	size_t len = rq->nsecs * IDE_SECSIZE;
+	int i;
+	for (i = 0; len > 0; i++) {
+		assert(i < IDE_NPRD);
+		uint32_t n = MIN(len, 65536 - (pa & 0xffff));
+		ide_prdt[i].addr = pa;
+		ide_prdt[i].size = n;		// 64KB wraps to 0, as it should
+		ide_prdt[i].flags = 0;
+		pa += n;
+		len -= n;
+	}
+	ide_prdt[i-1].flags = IDE_PRD_EOT;
 
-	// If it was a read operation, pull in the sector data
-	if (!write && ide_wait())
-		insl(0x1f0, io->data, IODISK_SECSIZE/4);
-	pending = done = 0;
+	uint8_t dir = rq->write ? 0 : BM_CMD_READ;
+	outl(ide_bmbase + BM_PRDT, ide_dmaaddr(ide_prdt, sizeof(ide_prdt)));
+	outb(ide_bmbase + BM_CMD, dir);
+	outb(ide_bmbase + BM_STAT, inb(ide_bmbase + BM_STAT)
+				| BM_STAT_ERR | BM_STAT_IRQ);
+	ide_cmd(rq->secno, rq->nsecs, rq->write ? 0xCA : 0xC8); // DMA cmds
+	outb(ide_bmbase + BM_CMD, dir | BM_CMD_START);
+}
 
-	spinlock_release(&idelock);
-	return 1;
+// If the disk has finished the request at the head of the queue,
+// complete it and start the next one.  Called with idelock held.
+static void
+ide_complete(void)
+{
+	if (ide_head == NULL)
+		return;
+	uint8_t bst = inb(ide_bmbase + BM_STAT);
+	if (!(bst & BM_STAT_IRQ))
+		return;			// still working on it
+
+	outb(ide_bmbase + BM_CMD, 0);	// stop bus mastering
+	uint8_t st = inb(0x1F7);	// acknowledges the disk's interrupt
+	outb(ide_bmbase + BM_STAT, bst);	// clears the IRQ and ERR bits
+	ide_finish(!(bst & BM_STAT_ERR) && !(st & (IDE_DF|IDE_ERR)));
+	ide_issue();
 }
 
 void
 ide_intr(void)
 {
 	spinlock_acquire(&idelock);
-	if (pending)
-		done = 1;
+	ide_complete();		// may have been done already by a poller
+	spinlock_release(&idelock);
+}
+
+// Queue a disk transfer request, and start it if the disk is idle.
+// The caller must leave rq and its buffer alone until rq->done.
+void
+ide_submit(iderq *rq)
+{
+	assert(rq->nsecs > 0 && rq->nsecs <= IDE_MAXSECS);
+	rq->next = NULL;
+	rq->done = 0;
+	if (ide_nsecs == 0 || rq->secno + rq->nsecs > ide_nsecs) {
+		rq->ok = 0;
+		rq->done = 1;
+		return;
+	}
+
+	spinlock_acquire(&idelock);
+	while (ide_nq >= IDE_QLEN) {	// wait for room in the queue
+		ide_complete();
+		pause();
+	}
+	if (ide_tail)
+		ide_tail->next = rq;
 	else
-		warn("Suprious IDE interrupt\n");
+		ide_head = rq;
+	ide_tail = rq;
+	if (ide_nq++ == 0)
+		ide_issue();
 	spinlock_release(&idelock);
+}
 
-	io_check();	// see if the user process is waiting for input
+// Wait for a submitted request to complete.
+void
+ide_await(iderq *rq)
+{
+	while (1) {
+		spinlock_acquire(&idelock);
+		ide_complete();
+		bool done = rq->done;
+		spinlock_release(&idelock);
+		if (done)
+			return;
+		pause();
+	}
+}
+
+// Read nsecs sectors starting at secno into dst,
+// returning true on success.
+bool
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	iderq rq = { .secno = secno, .nsecs = nsecs, .write = 0, .buf = dst };
+	ide_submit(&rq);
+	ide_await(&rq);
+	return rq.ok;
+}
+
+// Write nsecs sectors from src starting at sector secno,
+// returning true on success.
+bool
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	iderq rq = { .secno = secno, .nsecs = nsecs, .write = 1,
+			.buf = (void*)src };
+	ide_submit(&rq);
+	ide_await(&rq);
+	return rq.ok;
 }
 
-#endif	/* LAB >= 4 */
+#endif	// LAB >= 9
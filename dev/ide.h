@@ -1,4 +1,4 @@
-#if LAB >= 99
+#if LAB >= 9
 /*
  * IDE disk device driver definitions.
  *
@@ -17,12 +17,35 @@
 
 #include <inc/types.h>
 
-struct iodisk;
 
+#define IDE_SECSIZE	512		// Bytes per disk sector
+#define IDE_MAXSECS	256		// Most sectors one command can transfer
+#define IDE_QLEN	8		// Most requests outstanding at once
+
+// A disk transfer request, queued with ide_submit().
+// The buffer must be physically contiguous kernel memory:
+// either a block from the page allocator or part of the kernel image.
+typedef struct iderq {
+	uint32_t	secno;		// First sector to transfer
+	uint16_t	nsecs;		// Number of sectors, 1..IDE_MAXSECS
+	bool		write;		// True to write to disk, false to read
+	bool		ok;		// Set on completion: no errors
+	volatile bool	done;		// Set by the driver on completion
+	void		*buf;		// Kernel buffer to transfer to/from
+	struct iderq	*next;		// Next request in the driver's queue
+} iderq;
+
+struct pci_func;
+
+extern uint32_t ide_nsecs;		// Size of disk 1 in sectors, 0 if none
+
+int ide_attach(struct pci_func *pcif);
 void ide_init(void);
 void ide_intr(void);
-void ide_output(const struct iodisk *io);
-bool ide_input(struct iodisk *io);
+void ide_submit(iderq *rq);
+void ide_await(iderq *rq);
+bool ide_read(uint32_t secno, void *dst, size_t nsecs);
+bool ide_write(uint32_t secno, const void *src, size_t nsecs);
 
 #endif // !PIOS_DEV_IDE_H
-#endif // LAB >= 4
+#endif // LAB >= 9
@@ -16,6 +16,7 @@
 #include <inc/assert.h>
 
 #include <kern/mem.h>
+#include <kern/cpu.h>
 #include <kern/mp.h>
 
 #include <dev/ioapic.h>
@@ -71,7 +72,7 @@ ioapic_init(void)
 {
 	int i, id, maxintr;
 
-	if(!ismp)
+	if(!ismp || !cpu_onboot())	// the I/O APIC is shared by all CPUs
 		return;
 
 	if (ioapic == NULL)
@@ -48,6 +48,15 @@ lapic_init()
 	lapicw(TIMER, PERIODIC | T_LTIMER);
 
 #if LAB >= 9
+	// All the local APIC timers run at the same bus frequency,
+	// so the other CPUs reuse the boot CPU's calibration
+	// instead of each waiting on the shared PIT.
+	static uint32_t boot_ticr;
+	if (!cpu_onboot() && boot_ticr != 0) {
+		lapicw(TICR, boot_ticr);
+		goto calibrated;
+	}
+
 	// First initialize TICR to the maximum value for calibration.
 	lapicw(TICR, ~(uint32_t)0); 
 
@@ -66,6 +75,9 @@ lapic_init()
 	cprintf("CPU%d: %llu.%09lluHz\n", cpu_cur()->id,
 		lhz / 1000000000, lhz % 1000000000);
 	lapicw(TICR, ltot);
+	if (cpu_onboot())
+		boot_ticr = ltot;
+calibrated:
 #else
 	// If we cared more about precise timekeeping,
 	// we would calibrate TICR with another time source such as the PIT.
@@ -17,6 +17,10 @@
 
 #include <dev/pci.h>
 #include <dev/e100.h>
+#include <dev/vnet.h>
+#if LAB >= 9
+#include <dev/ide.h>
+#endif
 
 
 // Flag to do "lspci" at bootup
@@ -38,12 +42,16 @@ struct pci_driver {
 
 struct pci_driver pci_attach_class[] = {
 	{ PCI_CLASS_BRIDGE, PCI_SUBCLASS_BRIDGE_PCI, &pci_bridge_attach },
+#if LAB >= 9
+	{ PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_MASS_STORAGE_IDE, &ide_attach },
+#endif
 	{ 0, 0, 0 },
 };
 
 struct pci_driver pci_attach_vendor[] = {
 #if LAB >= 5		// was SOL >= 5
 	{ 0x8086, 0x1209, &e100_attach },
+	{ 0x1af4, 0x1000, &vnet_attach },
 #endif
 	{ 0, 0, 0 },
 };
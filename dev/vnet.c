@@ -0,0 +1,425 @@
+#if LAB >= 5
+/*
+ * Virtio network device driver, for QEMU's virtio-net-pci device.
+ * Uses the legacy virtio PCI interface via I/O ports.
+ * Supports one queue pair per CPU (up to VNET_MAXPAIRS),
+ * frames up to VNET_MAXMTU so that a whole page fits in one packet,
+ * and scatter-gather transmit that sends packet bodies
+ * straight from the page frames holding them.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/spinlock.h>
+#include <kern/net.h>
+
+#include <dev/pic.h>
+#include <dev/ioapic.h>
+#include <dev/pci.h>
+#include <dev/vnet.h>
+
+
+bool vnet_present;
+uint8_t vnet_irq;
+int vnet_maxpkt;
+
+// Legacy virtio PCI registers, in I/O space BAR 0
+#define VIRTIO_PCI_HOST_FEATURES	0x00	// (4 bytes)
+#define VIRTIO_PCI_GUEST_FEATURES	0x04	// (4 bytes)
+#define VIRTIO_PCI_QUEUE_PFN		0x08	// (4 bytes)
+#define VIRTIO_PCI_QUEUE_NUM		0x0c	// (2 bytes)
+#define VIRTIO_PCI_QUEUE_SEL		0x0e	// (2 bytes)
+#define VIRTIO_PCI_QUEUE_NOTIFY		0x10	// (2 bytes)
+#define VIRTIO_PCI_STATUS		0x12	// (1 byte)
+#define VIRTIO_PCI_ISR			0x13	// (1 byte) reading acks intr
+#define VIRTIO_PCI_CONFIG		0x14	// Device config (no MSI-X)
+
+#define VIRTIO_STATUS_ACK		0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+#define VIRTIO_ISR_QUEUE		0x01	// Some virtqueue has news
+
+// Network device feature bits
+#define VIRTIO_NET_F_MTU		(1 << 3)	// Reports max MTU
+#define VIRTIO_NET_F_MAC		(1 << 5)	// Has a MAC address
+#define VIRTIO_NET_F_CTRL_VQ		(1 << 17)	// Has control queue
+#define VIRTIO_NET_F_MQ			(1 << 22)	// Multiple queue pairs
+
+// Network device config space
+#define VIRTIO_NET_CFG_MAC		0	// (6 bytes)
+#define VIRTIO_NET_CFG_MAXPAIRS		8	// (2 bytes)
+#define VIRTIO_NET_CFG_MTU		10	// (2 bytes)
+
+// Control queue commands
+#define VIRTIO_NET_CTRL_MQ		4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+#define VIRTIO_NET_OK			0
+
+#define VRING_DESC_F_NEXT		1	// Chained via 'next'
+#define VRING_DESC_F_WRITE		2	// Device writes this buffer
+#define VRING_AVAIL_F_NO_INTERRUPT	1	// Don't interrupt when used
+
+#define VNET_MAXPAIRS	4		// Max queue pairs, one per CPU
+#define VNET_QSIZEMAX	256		// Largest virtqueue we can lay out
+#define VNET_RXBUFS	32		// Receive buffers posted per queue
+#define VNET_TXSLOTS	32		// Packets in flight per transmit queue
+#define VNET_MAXMTU	9000		// Largest MTU we'll accept
+#define VNET_HDRLEN	10		// struct virtio_net_hdr, all zero
+#define VNET_RXBUFSIZE	9024		// VNET_HDRLEN + VNET_MAXMTU + 14, rounded
+#define VNET_TXCOPY	(PAGESIZE + 256) // Max bytes copied per tx packet
+#define VNET_TXSMALL	128		// Bodies this small we just copy
+
+
+struct vring_desc {
+	uint64_t	addr;		// Physical address of buffer
+	uint32_t	len;
+	uint16_t	flags;
+	uint16_t	next;
+};
+
+struct vring_avail {
+	uint16_t	flags;
+	uint16_t	idx;
+	uint16_t	ring[0];
+};
+
+struct vring_used {
+	uint16_t	flags;
+	uint16_t	idx;
+	struct vring_used_elem {
+		uint32_t	id;	// Head of the used descriptor chain
+		uint32_t	len;	// Bytes the device wrote
+	} ring[0];
+};
+
+// A virtqueue, laid out in its 'mem' area as legacy virtio requires.
+struct vnet_queue {
+	spinlock	lock;
+	int		index;		// Virtqueue number on the device
+	int		size;		// Descriptors in the ring, set by device
+	volatile struct vring_desc *desc;
+	volatile struct vring_avail *avail;
+	volatile struct vring_used *used;
+	uint16_t	usedidx;	// Next used ring entry to look at
+	uint8_t		mem[3*PAGESIZE] gcc_aligned(PAGESIZE);
+};
+
+// Transmit slot i uses descriptors 2i (for the copied part of the packet)
+// and 2i+1 (for a body sent straight from memory).
+struct vnet_txslot {
+	bool		busy;		// Given to device and not back yet
+	char		buf[VNET_TXCOPY]; // virtio_net_hdr + copied packet
+};
+
+static struct {
+	uint32_t iobase;
+	int npairs;		// Queue pairs in use
+
+	struct vnet_queue rxq[VNET_MAXPAIRS];
+	char rxbuf[VNET_MAXPAIRS][VNET_RXBUFS][VNET_RXBUFSIZE];
+
+	struct vnet_queue txq[VNET_MAXPAIRS];
+	struct vnet_txslot tx[VNET_MAXPAIRS][VNET_TXSLOTS];
+
+	struct vnet_queue ctlq;
+	uint8_t ctlbuf[8];
+} vnet;
+
+
+// Find out how big the device wants virtqueue 'index' to be,
+// lay it out in q->mem, and tell the device where it is.
+static bool
+vnet_qinit(struct vnet_queue *q, int index)
+{
+	spinlock_init(&q->lock);
+	q->index = index;
+	outw(vnet.iobase + VIRTIO_PCI_QUEUE_SEL, index);
+	q->size = inw(vnet.iobase + VIRTIO_PCI_QUEUE_NUM);
+	if (q->size == 0 || q->size > VNET_QSIZEMAX) {
+		warn("vnet: queue %d has unusable size %d", index, q->size);
+		return 0;
+	}
+
+	memset(q->mem, 0, sizeof(q->mem));
+	q->desc = (void*)q->mem;
+	q->avail = (void*)&q->mem[16 * q->size];
+	q->used = (void*)&q->mem[ROUNDUP(16*q->size + 6 + 2*q->size,
+					PAGESIZE)];
+	q->usedidx = 0;
+	outl(vnet.iobase + VIRTIO_PCI_QUEUE_PFN, mem_phys(q->mem) / PAGESIZE);
+	return 1;
+}
+
+// Make the descriptor chain starting at 'head' available to the device.
+static void
+vnet_qpush(struct vnet_queue *q, int head)
+{
+	q->avail->ring[q->avail->idx % q->size] = head;
+	__sync_synchronize();	// Ring entry must be visible before index
+	q->avail->idx++;
+}
+
+static void
+vnet_qnotify(struct vnet_queue *q)
+{
+	__sync_synchronize();
+	outw(vnet.iobase + VIRTIO_PCI_QUEUE_NOTIFY, q->index);
+}
+
+// Take back transmit slots the device has finished sending.
+static void
+vnet_txreclaim(struct vnet_queue *q, struct vnet_txslot *tx)
+{
+	assert(spinlock_holding(&q->lock));
+
+	while (q->usedidx != q->used->idx) {
+		int head = q->used->ring[q->usedidx % q->size].id;
+		assert(head < 2*VNET_TXSLOTS && tx[head/2].busy);
+		tx[head/2].busy = 0;
+		q->usedidx++;
+	}
+}
+
+// Send a packet on the current CPU's transmit queue.
+// The header (and a short or stack-resident body) gets copied,
+// but the body is otherwise handed to the device right where it is,
+// typically in a page frame being pulled by another node.
+// Such pages are shared copy-on-write, so they don't change under us.
+int vnet_tx(void *hdr, int hlen, void *body, int blen)
+{
+	assert(hlen + blen <= vnet_maxpkt);
+	assert(VNET_HDRLEN + hlen <= VNET_TXCOPY);
+
+	int qn = cpu_cur()->id % vnet.npairs;
+	struct vnet_queue *q = &vnet.txq[qn];
+	struct vnet_txslot *tx = vnet.tx[qn];
+
+	spinlock_acquire(&q->lock);
+
+	vnet_txreclaim(q, tx);
+	int s;
+	for (s = 0; s < VNET_TXSLOTS && tx[s].busy; s++)
+		;
+	if (s == VNET_TXSLOTS) {
+		warn("vnet_tx: no transmit buffers");
+		spinlock_release(&q->lock);
+		return 0;
+	}
+
+	memset(tx[s].buf, 0, VNET_HDRLEN);	// No checksum or GSO offload
+	memcpy(tx[s].buf + VNET_HDRLEN, hdr, hlen);
+	int clen = VNET_HDRLEN + hlen;
+
+	// A body on our kernel stack or in net scratch space
+	// won't survive until the device reads it.
+	if (blen > 0 && (net_txtransient(body) || blen <= VNET_TXSMALL)) {
+		assert(clen + blen <= VNET_TXCOPY);
+		memcpy(tx[s].buf + clen, body, blen);
+		clen += blen;
+		blen = 0;
+	}
+
+	volatile struct vring_desc *d = &q->desc[2*s];
+	d[0].addr = mem_phys(tx[s].buf);
+	d[0].len = clen;
+	d[0].flags = blen > 0 ? VRING_DESC_F_NEXT : 0;
+	d[0].next = 2*s + 1;
+	if (blen > 0) {
+		d[1].addr = mem_phys(body);
+		d[1].len = blen;
+		d[1].flags = 0;
+	}
+	tx[s].busy = 1;
+	vnet_qpush(q, 2*s);
+	vnet_qnotify(q);
+
+	spinlock_release(&q->lock);
+	return 1;
+}
+
+// Dispatch packets the device has received into receive queue q,
+// then hand their buffers back to the device.
+static void
+vnet_rx(struct vnet_queue *q, char (*bufs)[VNET_RXBUFSIZE])
+{
+	spinlock_acquire(&q->lock);
+
+	bool pushed = 0;
+	while (q->usedidx != q->used->idx) {
+		int id = q->used->ring[q->usedidx % q->size].id;
+		int len = q->used->ring[q->usedidx % q->size].len;
+		q->usedidx++;
+
+		// The network stack might transmit during this upcall,
+		// so release the queue lock while it's running.
+		spinlock_release(&q->lock);
+		if (id < VNET_RXBUFS && len > VNET_HDRLEN
+				&& len <= VNET_RXBUFSIZE)
+			net_rx(bufs[id] + VNET_HDRLEN, len - VNET_HDRLEN);
+		else
+			warn("vnet: bad receive buffer %d len %d", id, len);
+		spinlock_acquire(&q->lock);
+
+		if (id < VNET_RXBUFS) {
+			vnet_qpush(q, id);
+			pushed = 1;
+		}
+	}
+	if (pushed)
+		vnet_qnotify(q);
+
+	spinlock_release(&q->lock);
+}
+
+void vnet_intr(void)
+{
+	int isr = inb(vnet.iobase + VIRTIO_PCI_ISR);	// acks the interrupt
+	if (!(isr & VIRTIO_ISR_QUEUE))
+		return;
+
+	int i;
+	for (i = 0; i < vnet.npairs; i++)
+		vnet_rx(&vnet.rxq[i], vnet.rxbuf[i]);
+}
+
+// Issue a command with a 16-bit argument on the control queue,
+// and wait for the device to acknowledge it.
+static bool
+vnet_ctl(uint8_t class, uint8_t cmd, uint16_t val)
+{
+	struct vnet_queue *q = &vnet.ctlq;
+	uint8_t *b = vnet.ctlbuf;
+	b[0] = class;
+	b[1] = cmd;
+	memcpy(&b[2], &val, 2);
+	b[4] = ~VIRTIO_NET_OK;
+
+	q->desc[0].addr = mem_phys(&b[0]);
+	q->desc[0].len = 2;
+	q->desc[0].flags = VRING_DESC_F_NEXT;
+	q->desc[0].next = 1;
+	q->desc[1].addr = mem_phys(&b[2]);
+	q->desc[1].len = 2;
+	q->desc[1].flags = VRING_DESC_F_NEXT;
+	q->desc[1].next = 2;
+	q->desc[2].addr = mem_phys(&b[4]);
+	q->desc[2].len = 1;
+	q->desc[2].flags = VRING_DESC_F_WRITE;
+	vnet_qpush(q, 0);
+	vnet_qnotify(q);
+
+	int i;
+	for (i = 0; i < 1000000 && q->usedidx == q->used->idx; i++)
+		pause();
+	if (q->usedidx == q->used->idx)
+		return 0;
+	q->usedidx++;
+	return b[4] == VIRTIO_NET_OK;
+}
+
+int vnet_attach(struct pci_func *pcif)
+{
+	int i, j;
+
+	pci_func_enable(pcif);
+
+	vnet_irq = pcif->irq_line;
+	vnet.iobase = pcif->reg_base[0];
+	uint32_t io = vnet.iobase;
+
+	// Reset the device and tell it we know how to drive it
+	outb(io + VIRTIO_PCI_STATUS, 0);
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+	// Negotiate features
+	uint32_t feat = inl(io + VIRTIO_PCI_HOST_FEATURES);
+	feat &= VIRTIO_NET_F_MAC | VIRTIO_NET_F_MTU
+		| VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+	if (!(feat & VIRTIO_NET_F_CTRL_VQ))
+		feat &= ~VIRTIO_NET_F_MQ;
+	outl(io + VIRTIO_PCI_GUEST_FEATURES, feat);
+	if (!(feat & VIRTIO_NET_F_MAC)) {
+		warn("vnet: device has no MAC address");
+		goto fail;
+	}
+
+	uint8_t mac[6];
+	for (i = 0; i < 6; i++)
+		mac[i] = inb(io + VIRTIO_PCI_CONFIG + VIRTIO_NET_CFG_MAC + i);
+	int mtu = 1500;
+	if (feat & VIRTIO_NET_F_MTU)
+		mtu = MIN(inw(io + VIRTIO_PCI_CONFIG + VIRTIO_NET_CFG_MTU),
+				VNET_MAXMTU);
+	vnet_maxpkt = mtu + 14;
+
+	// Use a queue pair per CPU, as far as the device lets us.
+	int maxpairs = 1;
+	if (feat & VIRTIO_NET_F_MQ)
+		maxpairs = inw(io + VIRTIO_PCI_CONFIG
+				+ VIRTIO_NET_CFG_MAXPAIRS);
+	int ncpu = 0;
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		ncpu++;
+	vnet.npairs = MAX(1, MIN(MIN(maxpairs, ncpu), VNET_MAXPAIRS));
+
+	// Set up receive queue 2i and transmit queue 2i+1 of each pair
+	for (i = 0; i < vnet.npairs; i++) {
+		struct vnet_queue *q = &vnet.rxq[i];
+		if (!vnet_qinit(q, 2*i) || q->size < VNET_RXBUFS)
+			goto fail;
+		for (j = 0; j < VNET_RXBUFS; j++) {
+			q->desc[j].addr = mem_phys(vnet.rxbuf[i][j]);
+			q->desc[j].len = VNET_RXBUFSIZE;
+			q->desc[j].flags = VRING_DESC_F_WRITE;
+			vnet_qpush(q, j);
+		}
+
+		q = &vnet.txq[i];
+		if (!vnet_qinit(q, 2*i + 1) || q->size < 2*VNET_TXSLOTS)
+			goto fail;
+		q->avail->flags = VRING_AVAIL_F_NO_INTERRUPT; // reclaim lazily
+	}
+	if ((feat & VIRTIO_NET_F_CTRL_VQ) && !vnet_qinit(&vnet.ctlq, 2*maxpairs))
+		goto fail;
+
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER
+					| VIRTIO_STATUS_DRIVER_OK);
+
+	if (vnet.npairs > 1 && !vnet_ctl(VIRTIO_NET_CTRL_MQ,
+				VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, vnet.npairs)) {
+		warn("vnet: couldn't enable %d queue pairs", vnet.npairs);
+		vnet.npairs = 1;
+	}
+
+	cprintf("vnet: MAC address");
+	for (i = 0; i < 6; i++)
+		cprintf("%c%02x", i ? ':' : ' ', mac[i]);
+	cprintf(", MTU %d, %d queue pairs\n", mtu, vnet.npairs);
+	memcpy(net_mac, mac, 6);
+
+	// Enable interrupts and start receiving packets
+	pic_enable(vnet_irq);
+	ioapic_enable(vnet_irq);
+	for (i = 0; i < vnet.npairs; i++)
+		vnet_qnotify(&vnet.rxq[i]);
+
+	vnet_present = 1;
+	return 1;
+
+fail:
+	outb(io + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	return 0;
+}
+
+#endif  // LAB >= 5
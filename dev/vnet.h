@@ -0,0 +1,22 @@
+#if LAB >= 5
+/*
+ * Virtio network device driver definitions.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_VNET_H
+#define PIOS_DEV_VNET_H
+
+struct pci_func;
+
+extern bool vnet_present;
+extern uint8_t vnet_irq;
+extern int vnet_maxpkt;		// Largest frame negotiated with the device
+
+int  vnet_attach(struct pci_func *pcif);
+int  vnet_tx(void *hdr, int hlen, void *body, int blen);
+void vnet_intr(void);
+
+#endif	// PIOS_DEV_VNET_H
+#endif  // LAB >= 5
@@ -15,6 +15,13 @@
 
 void bench_fork(unsigned char child, void *(*fun)(void *), void *arg);
 void bench_join(unsigned char child);
+
+// Fork tree: start many children as a tree of processes,
+// each of which forks its own subtree in parallel with the others.
+// Uses child numbers 0 through BENCH_TREEFANOUT-1 in each process.
+#define BENCH_TREEFANOUT	2
+void bench_forktree(int nchildren, void *(*fun)(void *), void **args);
+void bench_jointree(int nchildren);
 unsigned long long bench_time(void);
 
 #endif	// PIOS_INC_BENCH_H
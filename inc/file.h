@@ -17,10 +17,10 @@
 /*
  * In PIOS, file I/O is implemented mostly in user space,
  * with files kept within each process's own address space
- * in the virtual address range 2GB-3GB (0x80000000-0xc0000000).
- * Each file's contents occupies a 4MB area of this address region
+ * in the virtual address range VM_FILELO-VM_FILEHI (see inc/vm.h).
+ * Each file's contents occupies one fixed, contiguous area of this region
  * (regardless of the file's actual size), for up to 256 files total.
- * The first 4MB region, for "file 0", is reserved for a process state area.
+ * The first area, for "file 0", is reserved for a process state area.
  *
  * Output streams such as the display are represented by append-mode files,
  * for which data appended by child processes gets merged together
@@ -52,23 +52,43 @@
 #endif
 
 // Each process contains its own copy of all file system state,
-// which resides between virtual addresses 0x80000000 and 0xc0000000
-// (see the VM_FILELO and VM_FILEHI symbols in inc/vm.h).
-// This 1GB virtual address space region is divided into 256 4MB areas.
-// The first 4MB area, from FILESVA to FILESVA+PTSIZE,
+// which resides between virtual addresses VM_FILELO and VM_FILEHI.
+#if LAB >= 9
+// This 16TB virtual address space region is divided into 256 64GB areas.
+#else
+// This virtual address space region is divided into 256 4MB areas.
+#endif
+// The first area, from FILESVA to FILESVA+PTSIZE,
 // contains the file system and process metadata,
 // whose format is defined by the 'filestate' structure below
 // and the various sub-structures it incorporates and builds upon.
-// The remaining 255 4MB areas each hold the content of one file,
+// The remaining 255 areas each hold the content of one file,
 // indexed by an "inode number" from 1 through 255.
 // Thus, this file system can have at most 255 files in existence at once,
-// each having a maximum size of PTSIZE bytes (4MB).
+// each having a maximum size of FILE_MAXSIZE bytes.
+// Unused parts of a file's area cost nothing but page table entries.
 
 #define FILE_INODES	OPEN_MAX		// Max number of files or "inodes"
-#define	FILE_MAXSIZE	(1<<22)		// Max size of a single file - 4MB
+#if LAB >= 9
+#define FILE_MAXSHIFT	36		// Max size of a single file - 64GB
+#else
+#define FILE_MAXSHIFT	22		// Max size of a single file - 4MB
+#endif
+#define	FILE_MAXSIZE	((size_t)1 << FILE_MAXSHIFT)
 
 #define FILESVA	VM_FILELO		// Virtual address of file state area
-#define FILEDATA(ino)	((void*)FILESVA + ((ino) << 22)) // File data per inode
+#define FILEDATA(ino)	((void*)FILESVA + ((size_t)(ino) << FILE_MAXSHIFT))
+#if LAB >= 9
+#define FILE_DIRHASH	FILE_INODES	// Chains in the directory entry index
+#define FILE_PIPESIZE	(1<<16)		// Max data buffered in a pipe - 64KB
+
+// Scratch areas reconcile() uses while it has a child's state mapped.
+// The child's filestate goes at VM_SCRATCHLO (for waitpid)
+// or at FILE_PIPESCRATCH (for pipe_sched), and the pages of one of the
+// child's files go at FILE_SCRATCH, at the same offsets as in the file.
+#define FILE_PIPESCRATCH ((void*)VM_SCRATCHLO + PTSIZE)
+#define FILE_SCRATCH	((void*)VM_SCRATCHLO + FILE_MAXSIZE)
+#endif
 
 struct stat;
 
@@ -119,6 +139,20 @@ typedef struct fileinode {		// Per-file state - like an "inode"
 	int	rino;			// Parent's inode this corresponds to
 	int	rver;			// Version at last reconcile w/ parent
 	size_t	rlen;			// Size when last reconciled w/ parent
+#if LAB >= 9
+
+	// Pipe state, for S_IFIFO inodes only (see lib/pipe.c).
+	// A pipe's data is a byte stream kept in a ring buffer
+	// in the inode's data area, indexed by stream offset mod FILE_MAXSIZE:
+	// 'size' is the stream offset of the next byte to be written,
+	// and 'rdofs' that of the oldest byte not yet consumed by a reader.
+	// Each process counts the pipe's ends held by itself and its children
+	// and learns from its parent how many are held anywhere else.
+	size_t	rdofs;			// Stream offset of oldest unread byte
+	int	nrd, nwr;		// Read/write ends we and children hold
+	int	rnrd, rnwr;		// nrd/nwr when last reconciled w/ parent
+	int	xrd, xwr;		// Read/write ends held outside our tree
+#endif
 } fileinode;
 
 
@@ -128,6 +162,13 @@ typedef struct fileinode {		// Per-file state - like an "inode"
 // on top of PIOS's minimalistic GET/PUT/RET process management API.
 typedef struct procinfo {
 	int	state;			// Current state of this child process
+#if LAB >= 9
+	bool	combiner;		// Slot also holds a pthread combining proc
+	uint32_t rseq;			// Our dirtyseq when last reconciled
+	bool	piped;			// Child may hold ends of our pipes
+	uint8_t	p2c[FILE_INODES];	// Child's inode for each of ours,
+					// or 0 for fork()'s 1-to-1 mapping
+#endif
 } procinfo;
 
 // Values for procinfo.state
@@ -150,6 +191,22 @@ typedef struct filestate {
 	int		thself;		// This thread's number, 0 if master
 	void *		thstat;		// Thread exit status - pthread_exit()
 	int		barriers[PROC_CHILDREN];  // pthread barriers
+
+	// Index of allocated inodes keyed by (directory inode, name),
+	// so that path lookups needn't scan the whole inode table.
+	// The kernel leaves it zeroed (not built) in the root process;
+	// user space builds it on first use and keeps it up to date.
+	bool		dirhashed;	// dirhash and dirnext below are valid
+	int		dirhash[FILE_DIRHASH];	// First inode in each chain
+	int		dirnext[FILE_INODES];	// Next inode in same chain
+
+	// Dirty-inode tracking, so reconcile() can skip unchanged files.
+	// 'dirty' marks inodes changed since our parent last reconciled us;
+	// 'inoseq' orders our changes so we can tell which inodes
+	// each of our children hasn't seen since its procinfo.rseq.
+	uint32_t	dirty[FILE_INODES/32];	// Bitmap of changed inodes
+	uint32_t	dirtyseq;	// Counts changes to our inodes
+	uint32_t	inoseq[FILE_INODES];	// dirtyseq at last change
 #endif
 } filestate;
 
@@ -196,6 +253,11 @@ extern filestate *const files;		// always = FILES
 
 int fileino_alloc(void);
 int fileino_create(filestate *st, int dino, const char *name);
+#if LAB >= 9
+int fileino_lookup(filestate *fs, int dino, const char *name, int len);
+void fileino_hashin(filestate *fs, int ino);
+void fileino_dirty(int ino);
+#endif
 ssize_t fileino_read(int ino, off_t ofs, void *buf,
 			size_t eltsize, size_t count);
 ssize_t fileino_write(int ino, off_t ofs, const void *buf,
@@ -203,6 +265,22 @@ ssize_t fileino_write(int ino, off_t ofs, const void *buf,
 int fileino_stat(int ino, struct stat *statbuf);
 int fileino_truncate(int ino, off_t newsize);
 int fileino_flush(int ino);
+#if LAB >= 9
+
+bool pipe_sched(pid_t except);
+bool pipe_full(void);
+void pipe_fork(pid_t pid);
+void pipe_forked(filestate *cfs);
+void pipe_ref(filedesc *fd, int delta);
+void pipe_reap(filestate *cfiles);
+void pipe_exit(void);
+ssize_t pipe_read(int ino, void *buf, size_t eltsize, size_t count);
+ssize_t pipe_write(int ino, const void *buf, size_t eltsize, size_t count);
+void pipe_pages(bool put, int cmd, pid_t pid, void *sbase, void *dbase,
+		size_t lo, size_t hi);
+void pipe_copy(void *dbase, size_t dofs, const void *sbase, size_t sofs,
+		size_t len);
+#endif
 
 filedesc *filedesc_alloc(void);
 filedesc *filedesc_open(filedesc *fd, const char *path, int flags, mode_t mode);
@@ -58,7 +58,7 @@ typedef	double			double_t;
 typedef	float			float_t;
 
 // Unix API compatibility types
-typedef int			off_t;		// file offsets and lengths
+typedef int64_t			off_t;		// file offsets and lengths
 typedef int			pid_t;		// process IDs
 typedef int			ino_t;		// file inode numbers
 typedef int			mode_t;		// file mode flags
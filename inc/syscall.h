@@ -23,6 +23,7 @@
 #if LAB >= 9
 #define SYS_TIME	0x00000004	// Get time since kernel boot
 #define SYS_NCPU	0x00000005	// Set max number of running CPUs
+#define SYS_MEMNODE	0x00000006	// Set NUMA node to allocate pages on
 #endif
 
 #define SYS_START	0x00000010	// Put: start child running
@@ -185,6 +186,21 @@ sys_ncpu(int newlimit)
 		  "a" (SYS_NCPU),
 		  "c" (newlimit));
 }
+
+// Make the pages we fault in from now on come from NUMA node 'node',
+// or from the node of the CPU we're running on if 'node' is -1.
+// Returns the number of NUMA nodes in the machine.
+static int gcc_inline
+sys_memnode(int node)
+{
+	int nnodes;
+	asm volatile("int %1"
+		: "=a" (nnodes)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_MEMNODE),
+		  "c" (node));
+	return nnodes;
+}
 #endif	// SOL >= 4
 
 #endif /* !__ASSEMBLER__ */
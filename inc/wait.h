@@ -66,6 +66,7 @@ pid_t	waitpid(pid_t pid, int *status, int options);	// trad. in sys/wait.h
 int	execl(const char *path, const char *arg0, ...);
 int	execv(const char *path, char *const argv[]);
 #if LAB >= 9
+pid_t	spawnv(const char *path, char *const argv[]);	// cf. posix_spawn
 void	_exit(int status) gcc_noreturn;
 uid_t	getuid(void);
 gid_t	getgid(void);
@@ -372,9 +372,9 @@ cpuid(uint32_t idx, cpuinfo *info)
 static gcc_inline uint64_t
 rdtsc(void)
 {
-        uint64_t tsc;
-        asm volatile("rdtsc" : "=A" (tsc));
-        return tsc;
+        uint32_t lo, hi;
+        asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+        return (uint64_t) hi << 32 | lo;
 }
 
 // Enable external device interrupts.
@@ -256,6 +256,14 @@ cpu_alloc(void)
 	return c;
 }
 
+// Where each AP finds its kernel stack and page map as it starts up,
+// indexed by local APIC ID, since all the APs start at once.
+// boot/bootother.S reads this table by its physical address.
+static struct cpu_bootinfo {
+	void		*rsp;		// Top of the AP's kernel stack
+	uint64_t	cr3;		// Physical address of its page map
+} cpu_bootinfo[256];
+
 void
 cpu_bootothers(void)
 {
@@ -265,22 +273,26 @@ cpu_bootothers(void)
 		return;
 	}
 
-	// Write bootstrap code to unused memory at 0x1000 (start of 2nd page).
+	// Tell the bootstrap code at 0x1000 (start of 2nd page)
+	// where to find the table above and where to jump once in long mode.
+	*(uint64_t*)lowcode_bootinfo = mem_phys(cpu_bootinfo);
+	*(void**)lowcode_entry = init;
+
+	// Start all the other CPUs together, each on its own stack,
+	// rather than waiting for each to boot before starting the next.
 	cpu *c;
 	for(c = &cpu_boot; c; c = c->next){
 		if(c == cpu_cur())  // We''ve started already.
 			continue;
-
-		// Fill in %rsp, %rip, location of page table and start code on cpu.
-		*(void**)(lowcode_start-8) = c->kstackhi;
-		*(void**)(lowcode_start-16) = init;
-		*(void**)(lowcode_start-24) = pmap_bootpmap;
+		cpu_bootinfo[c->id].rsp = c->kstackhi;
+		cpu_bootinfo[c->id].cr3 = mem_phys(pmap_bootpmap);
 		lapic_startcpu(c->id, *(uint32_t*)lowcode_bootother_vec);
-
-		// Wait for cpu to get through bootstrap.
-		while(c->booted == 0)
-			;
 	}
+
+	// Wait for them all to get through bootstrap.
+	for(c = &cpu_boot; c; c = c->next)
+		while(c != cpu_cur() && c->booted == 0)
+			pause();
 }
 #endif	// LAB >= 2
 
@@ -69,6 +69,9 @@ typedef struct cpu {
 #if LAB >= 9
 	// CPU number for this CPU, assigned sequentially from 0.
 	uint8_t		num;
+
+	// NUMA node (ACPI proximity domain) this CPU belongs to.
+	uint8_t		node;
 #endif
 
 	// Flag used in cpu.c to serialize bootstrap of all CPUs
@@ -22,6 +22,9 @@
 #include <kern/file.h>
 #include <kern/init.h>
 #include <kern/cons.h>
+#if LAB >= 9
+#include <kern/swap.h>
+#endif
 
 
 // Build a table of files to include in the initial file system.
@@ -113,32 +116,52 @@ file_initroot(proc *root)
 #if SOL >= 4
 	int i;
 	int ino = FILEINO_GENERAL;
+#if LAB >= 9
+	size_t nmapped = 0, ncopied = 0;
+#endif
 	for (i = 0; i < ninitfiles; i++) {
-		int filesize = initfiles[i][2] - initfiles[i][1];
+		size_t filesize = initfiles[i][2] - initfiles[i][1];
+		assert(filesize <= FILE_MAXSIZE);
+		assert(ino < FILE_INODES);
 		strcpy(files->fi[ino].de.d_name, initfiles[i][0]);
 		files->fi[ino].dino = FILEINO_ROOTDIR;
 		files->fi[ino].mode = S_IFREG;
 		files->fi[ino].size = filesize;
+#if LAB >= 9
+
+		// Map the file's whole pages copy-on-write
+		// straight from the kernel image's page frames,
+		// and copy only the partial last page,
+		// whose frame may hold other kernel data.
+		uintptr_t va = (uintptr_t)FILEDATA(ino);
+		size_t nwhole = PGOFF(initfiles[i][1]) == 0
+				? ROUNDDOWN(filesize, PAGESIZE) : 0;
+		size_t ofs;
+		for (ofs = 0; ofs < nwhole; ofs += PAGESIZE)
+			if (!pmap_insert(root->pml4,
+					mem_ptr2pi(initfiles[i][1] + ofs),
+					va + ofs, SYS_RW | PTE_A | PTE_U))
+				panic("file_initroot: no memory for page tables");
+		pmap_setperm(root->pml4, va + nwhole,
+					ROUNDUP(filesize, PAGESIZE) - nwhole,
+					SYS_READ | SYS_WRITE);
+		memcpy((void*)va + nwhole, initfiles[i][1] + nwhole,
+			filesize - nwhole);
+		nmapped += nwhole;
+		ncopied += filesize - nwhole;
+#else
 		pmap_setperm(root->pml4, (uintptr_t)FILEDATA(ino),
 					ROUNDUP(filesize, PAGESIZE),
 					SYS_READ | SYS_WRITE);
 		memcpy(FILEDATA(ino), initfiles[i][1], filesize);
+#endif
 		ino++;
+	}
 #if LAB >= 9
-
-		// XXX hack: allow initial files to be bigger than 4MB,
-		// by reserving the other inodes for nonexistent files.
-		int ninos = ROUNDUP(filesize, PDSIZE(1)) / PDSIZE(1);
-		while (--ninos > 0) {
-			files->fi[ino].dino = FILEINO_ROOTDIR;
-			sprintf(files->fi[ino].de.d_name, ".%s_%d",
-				initfiles[i][0], ino);
-			files->fi[ino].mode = 0;	// "deleted" file
-			ino++;
-		}
-		assert(ino <= FILE_INODES);
+	cprintf("file_initroot: %d initial files, "
+		"%lldK mapped copy-on-write, %lldK copied\n", ninitfiles,
+		(long long)nmapped / 1024, (long long)ncopied / 1024);
 #endif
-	}
 #else
 	// Lab 4: your file system initialization code here.
 	warn("file_initroot: file system initialization not done\n");
@@ -185,6 +208,15 @@ file_io(trapframe *tf)
 	// Has the root process exited?
 	if (files->exited) {
 		cprintf("root process exited with status %d\n", files->status);
+#if LAB >= 9
+		if (swap_stat.passes > 0)
+			cprintf("swap: %lld pages out, %lld in, %lld zero pages "
+				"dropped; %lld PTEs scanned in %lld passes, "
+				"%lld freed nothing\n",
+				swap_stat.out, swap_stat.in, swap_stat.zeroed,
+				swap_stat.scanned, swap_stat.passes,
+				swap_stat.failed);
+#endif
 		done();
 	}
 
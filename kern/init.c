@@ -9,6 +9,7 @@
  */
 
 #include <inc/stdio.h>
+#include <inc/stdarg.h>
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/cdefs.h>
@@ -36,6 +37,9 @@
 #if LAB >= 5
 #include <kern/net.h>
 #endif	// LAB >= 5
+#if LAB >= 9
+#include <kern/swap.h>
+#endif
 
 #if LAB >= 2
 #include <dev/pic.h>
@@ -50,6 +54,7 @@
 #include <dev/pci.h>
 #endif	// LAB >= 5
 #if LAB >= 9
+#include <dev/ide.h>
 #include <dev/pmc.h>
 #include <dev/timer.h>
 #endif
@@ -58,6 +63,31 @@
 // User-mode stack for user(), below, to run on.
 static char gcc_aligned(16) user_stack[PAGESIZE];
 
+#if LAB >= 9
+#ifdef INIT_CHECK
+bool init_check = 1;
+#else
+bool init_check;
+#endif
+
+// Boot-time breakdown: the TSC at each init_cprintf() checkpoint
+// with a plain message on the boot CPU, reported before the root runs.
+#define INIT_MAXPHASES	32
+static struct {
+	const char	*name;
+	uint64_t	tsc;
+} init_phases[INIT_MAXPHASES];
+static int init_nphases;
+static uint64_t init_tsc0;		// TSC when init() started
+static uint64_t init_pit0, init_pittsc0; // PIT ticks and TSC at timer_init()
+static uint64_t init_tschz;		// TSC frequency measured against PIT
+
+static void init_phase(const char *fmt, ...);
+#undef init_cprintf
+#define init_cprintf(fmt, ...) \
+	init_phase(fmt, ##__VA_ARGS__)
+#endif
+
 // Lab 3: ELF executable containing root process, linked into the kernel
 #ifndef ROOTEXE_START
 #if LAB == 3
@@ -72,6 +102,83 @@ static char gcc_aligned(16) user_stack[PAGESIZE];
 #endif
 extern char ROOTEXE_START[];
 
+#if LAB >= 9
+// Return true if the kernel command line 'cmdline'
+// contains the space-separated word 'opt'.
+static bool
+init_bootopt(const char *cmdline, const char *opt)
+{
+	int len = strlen(opt);
+	while (*cmdline) {
+		while (*cmdline == ' ')
+			cmdline++;
+		if (strncmp(cmdline, opt, len) == 0
+				&& (cmdline[len] == ' ' || cmdline[len] == 0))
+			return 1;
+		while (*cmdline && *cmdline != ' ')
+			cmdline++;
+	}
+	return 0;
+}
+
+// Record a boot checkpoint for init_report(),
+// printing it as well if INIT_DEBUG is defined.
+static void
+init_phase(const char *fmt, ...)
+{
+#ifdef INIT_DEBUG
+	va_list ap;
+	va_start(ap, fmt);
+	vcprintf(fmt, ap);
+	va_end(ap);
+#endif
+	if (!cpu_onboot() || strchr(fmt, '%') != NULL
+			|| init_nphases == INIT_MAXPHASES)
+		return;
+	init_phases[init_nphases].name = fmt;
+	init_phases[init_nphases].tsc = rdtsc();
+	init_nphases++;
+}
+
+// Calibrate the TSC against the PIT: called right after timer_init()
+// and again after the boot CPU's lapic_init(), which spends 1/HZ sec
+// calibrating its own timer, keeping the PIT span short but measurable.
+static void
+init_clock(void)
+{
+	uint64_t pit = timer_read(), tsc = rdtsc();
+	if (init_pittsc0 == 0) {
+		init_pit0 = pit;
+		init_pittsc0 = tsc;
+	} else if (pit > init_pit0)
+		init_tschz = (tsc - init_pittsc0) * TIMER_FREQ
+				/ (pit - init_pit0);
+}
+
+// Print how long each phase of kernel initialization took.
+static void
+init_report(void)
+{
+	if (init_tschz == 0)
+		return;		// no clock to measure with
+
+	cprintf("boot time by phase:\n");
+	uint64_t last = init_tsc0;
+	int i;
+	for (i = 0; i < init_nphases; i++) {
+		const char *name = init_phases[i].name;
+		int len = strlen(name);
+		if (len > 0 && name[len-1] == '\n')
+			len--;
+		cprintf("  %-20.*s %8lld us\n", len, name, (long long)
+			((init_phases[i].tsc - last) * 1000000 / init_tschz));
+		last = init_phases[i].tsc;
+	}
+	cprintf("  %-20s %8lld us\n", "total", (long long)
+		((last - init_tsc0) * 1000000 / init_tschz));
+}
+#endif	// LAB >= 9
+
 #ifdef MULTIBOOT2
 struct mem_addr_range grub_mmap_entries[ENTMAX];
 int grub_mmap_nentries = 0;
@@ -98,6 +205,10 @@ parse_multiboot2_info(unsigned long addr)
 			struct multiboot_tag_string *tagstr = 
 				(struct multiboot_tag_string *)tag;
 			cprintf ("Command line = %s\n", tagstr->string);
+#if LAB >= 9
+			if (init_bootopt(tagstr->string, "check"))
+				init_check = 1;
+#endif
 			break;				       
 		}
 		case MULTIBOOT_TAG_TYPE_MMAP:
@@ -135,6 +246,10 @@ init(void)
 #endif
 {
 	extern char start[], edata[], end[];
+#if LAB >= 9
+	if (cpu_onboot())
+		init_tsc0 = rdtsc();
+#endif
 
 	// Before anything else, complete the ELF loading process.
 	// Clear all uninitialized global data (BSS) in our program,
@@ -175,7 +290,11 @@ init(void)
 
 #if LAB >= 2
 	// Lab 2: check spinlock implementation
+#if LAB >= 9
+	if (cpu_onboot() && init_check)
+#else
 	if (cpu_onboot())
+#endif
 		spinlock_check();
 
 #if LAB >= 3
@@ -191,11 +310,17 @@ init(void)
 	init_cprintf("pic init\n");
 #if LAB >= 9
 	timer_init();		// 8253 timer, used to calibrate LAPIC timers
+	if (cpu_onboot())
+		init_clock();
 	init_cprintf("timer init\n");
 #endif
 	ioapic_init();		// prepare to handle external device interrupts
 	init_cprintf("ioapic init\n");
 	lapic_init();		// setup this CPU's local APIC
+#if LAB >= 9
+	if (cpu_onboot())
+		init_clock();
+#endif
 	init_cprintf("lapic init\n");
 	cpu_bootothers();	// Get other processors started
 	init_cprintf("other cpu boot\n");
@@ -210,6 +335,11 @@ init(void)
 	net_init();		
 	init_cprintf("net init\n");
 #endif // LAB >= 5
+#if LAB >= 9
+	ide_init();		// Find the swap disk
+	swap_init();		// Get ready to page out memory to it
+	init_cprintf("swap init\n");
+#endif
 
 #if SOL >= 4
 	cons_intenable();	// Let the console start producing interrupts
@@ -346,6 +476,9 @@ init(void)
 
 	proc_ready(root);	// make the root process ready
 	init_cprintf("proc ready\n");
+#if LAB >= 9
+	init_report();
+#endif
 	proc_sched();		// run it
 	panic("should not get here");
 #else // SOL == 0
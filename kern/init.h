@@ -15,6 +15,7 @@
 # error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
 #include <inc/cdefs.h>
 
 
@@ -22,6 +23,8 @@
 #define lowcode_start	0x1000
 #define lowcode_bootother_vec	0x1000
 #define lowcode_bioscall_vec	0x1004
+#define lowcode_bootinfo	0x1008
+#define lowcode_entry		0x1010
 
 
 // Called on each processor to initialize the kernel.
@@ -31,6 +34,12 @@ void init(unsigned long, unsigned long);
 void init(void);
 #endif
 
+#if LAB >= 9
+// Nonzero if the exhaustive boot-time self-checks should run,
+// as when booting with "check" on the kernel command line.
+extern bool init_check;
+#endif
+
 // First function run in user mode (only on one processor)
 void user(void);
 
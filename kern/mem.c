@@ -16,6 +16,7 @@
 
 #include <kern/cpu.h>
 #include <kern/mem.h>
+#include <kern/init.h>
 #if LAB >= 2
 #include <kern/spinlock.h>
 #endif
@@ -25,19 +26,69 @@
 #if LAB >= 5
 #include <kern/net.h>
 #endif
+#if LAB >= 9
+#include <kern/swap.h>
+#endif
 
 size_t mem_max;			// Maximum physical memory address
 size_t mem_npage;		// Total number of physical memory pages
 
 pageinfo *mem_pageinfo;		// Metadata array indexed by page number
 
+#if LAB < 9
 pageinfo *mem_freelist;		// Start of free page list
+#endif
 #if SOL >= 2
 spinlock mem_freelock;		// Spinlock protecting the free page list
 #endif
+#if LAB >= 9
+
+// Each NUMA node keeps its own free memory.
+// Beyond a small LIFO cache of recently freed single pages,
+// a node's free memory lives in naturally aligned buddy blocks
+// of 2^order pages, up to one 2MB large page,
+// with a doubly linked free list per order.
+// Freeing a block merges it with its buddy whenever the buddy is free too
+// and on the same node, so free memory stays in large contiguous blocks.
+//
+// The pageinfo array is not even initialized all at once during mem_init:
+// it is filled in one MEM_CHUNKSIZE chunk at a time,
+// each time some node's allocator runs out of free blocks,
+// starting with the next chunk holding memory on that node.
+#define MEM_FREECACHE	64		// Max pages in a node's freelist
+#define MEM_CHUNKSIZE	((size_t)1 << 28) // Lazily initialized unit: 256MB
+#define MEM_MAXCHUNKS	4096		// Max chunks we track: 1TB
+#define MEM_MAXRANGES	32		// Max usable RAM ranges we track
+
+typedef struct memnode {
+	pageinfo	*freelist;	// Cache of recently freed pages
+	int		nfreelist;	// Number of pages in freelist
+	pageinfo	*blocks[MEM_MAXORDER+1]; // Free buddy blocks by order
+	size_t		lazy;		// Next chunk to look in for more memory
+	int		near[MEM_MAXNODES]; // Nodes to allocate from, nearest first
+} memnode;
+
+int mem_nnodes = 1;			// Number of NUMA nodes
+uint8_t mem_nodedist[MEM_MAXNODES][MEM_MAXNODES]; // SLIT distances
+
+static memnode mem_nodes[MEM_MAXNODES];	// Free memory by node
+static size_t mem_nchunks;		// Number of chunks in physical memory
+static uint8_t mem_chunkdone[MEM_MAXCHUNKS/8]; // Bitmap of chunks initialized
+static bool mem_stolen;			// No more chunks: mem_steal() active
+static size_t mem_freelo;		// Start of free extended memory
+static mem_addr_range mem_ram[MEM_MAXRANGES]; // Usable RAM ranges
+static int mem_nram;
+static mem_addr_range mem_numa[MEM_MAXRANGES]; // SRAT ranges, type = node
+static int mem_nnuma;
+
+static void mem_initchunk(size_t c);
+#endif
 
 
 void mem_check(void);
+#if LAB >= 5
+static void mem_rrinit(void);
+#endif
 
 void
 mem_init(void)
@@ -76,6 +127,10 @@ mem_init(void)
 			mem_ranges->type == MEM_RESERVED
 				? "reserved" : "usable");
 		assert(mem_ranges->size > 0);	// sanity check
+#if LAB >= 9
+		if (mem_ranges->type == MEM_RAM && mem_nram < MEM_MAXRANGES)
+			mem_ram[mem_nram++] = *mem_ranges;
+#endif
 		if (mem_ranges->type == MEM_RESERVED)
 			continue;
 		if (mem_ranges->base < MEM_EXT) {
@@ -113,6 +168,15 @@ mem_init(void)
 	// There are many pages in between that cannot be used:
 	// hence we later add only the usable pages to the free list.
 	mem_npage = mem_max / PAGESIZE;
+#if LAB >= 9
+	mem_nchunks = ROUNDUP(mem_max, MEM_CHUNKSIZE) / MEM_CHUNKSIZE;
+	if (mem_nchunks > MEM_MAXCHUNKS) {
+		warn("mem_init: ignoring physical memory beyond %lldGB",
+			(long long)(MEM_MAXCHUNKS * MEM_CHUNKSIZE) >> 30);
+		mem_nchunks = MEM_MAXCHUNKS;
+		mem_npage = MEM_MAXCHUNKS * MEM_CHUNKSIZE / PAGESIZE;
+	}
+#endif
 
 	cprintf("Physical memory: %dK available, ", (int)(mem_max/1024));
 	cprintf("base = %dK, extended = %dK\n",
@@ -128,8 +192,10 @@ mem_init(void)
 	// Make sure the pageinfo entries are naturally aligned.
 	mem_pageinfo = mem_ptr(ROUNDUP((size_t) end, sizeof(pageinfo)));
 
+#if LAB < 9
 	// Initialize the entire pageinfo array to zero for good measure.
 	memset(mem_pageinfo, 0, sizeof(pageinfo) * mem_npage);
+#endif
 
 	// Free extended memory starts just past the pageinfo array.
 	intptr_t freemem = mem_phys(&mem_pageinfo[mem_npage]);
@@ -141,6 +207,18 @@ mem_init(void)
 #if SOL >= 2
 	spinlock_init(&mem_freelock);
 #endif
+#if LAB >= 5
+	mem_rrinit();
+#endif
+#if LAB >= 9
+	// Initialize just the chunks up through the start of free memory now:
+	// file_initroot() counts on the kernel image's pages having refcount 1.
+	// The rest get initialized as the allocator needs them.
+	mem_freelo = freemem;
+	size_t c;
+	for (c = 0; c < mem_nchunks && c * MEM_CHUNKSIZE <= mem_freelo; c++)
+		mem_initchunk(c);
+#else
 	pageinfo **freetail = &mem_freelist;
 	int i;
 	for (i = 0; i < mem_npage; i++) {
@@ -165,6 +243,7 @@ mem_init(void)
 		}
 	}
 	*freetail = NULL;	// null-terminate the freelist
+#endif	// LAB < 9
 
 #ifdef BIOSCALL		// XXX not yet ported to 64-bit!
 	for(i=0;i<mem_npage;i++) {
@@ -257,6 +336,9 @@ mem_init(void)
 #endif /* not SOL >= 1 */
 
 	// Check to make sure the page allocator seems to work correctly.
+#if LAB >= 9
+	if (init_check)
+#endif
 	mem_check();
 }
 
@@ -344,6 +426,368 @@ void bios_call(struct bios_regs *inp)
 }
 #endif	// BIOSCALL
 
+#if LAB >= 9
+// Return the NUMA node physical address 'pa' lies on according to the SRAT,
+// and set '*end' to where that node's run of addresses containing 'pa' ends.
+// Addresses the SRAT does not mention belong to node 0.
+static int
+mem_physnode(size_t pa, size_t *end)
+{
+	int i;
+	*end = ~(size_t)0;
+	for (i = 0; i < mem_nnuma; i++) {
+		size_t lo = mem_numa[i].base, hi = lo + mem_numa[i].size;
+		if (pa >= lo && pa < hi) {
+			*end = hi;
+			return mem_numa[i].type;
+		}
+		if (lo > pa && lo < *end)
+			*end = lo;
+	}
+	return 0;
+}
+
+// Set the node of each page in physical address range [lo,hi).
+static void
+mem_setnode(size_t lo, size_t hi)
+{
+	while (lo < hi) {
+		size_t end;
+		int node = mem_physnode(lo, &end);
+		end = MIN(end, hi);
+		pageinfo *pi = mem_phys2pi(lo), *epi = mem_phys2pi(end);
+		for (; pi < epi; pi++)
+			pi->node = node;
+		lo = end;
+	}
+}
+
+// Remove free block 'pi' from its buddy free list.
+static void
+mem_unlink(pageinfo *pi)
+{
+	*pi->free_prev = pi->free_next;
+	if (pi->free_next != NULL)
+		pi->free_next->free_prev = pi->free_prev;
+	pi->free_next = NULL;
+	pi->free_prev = NULL;
+}
+
+// Push block 'pi' of 2^order pages onto its node's free list as it is.
+static void
+mem_link(pageinfo *pi, int order)
+{
+	pageinfo **head = &mem_nodes[pi->node].blocks[order];
+	pi->order = order;
+	pi->free_next = *head;
+	if (pi->free_next != NULL)
+		pi->free_next->free_prev = &pi->free_next;
+	pi->free_prev = head;
+	*head = pi;
+}
+
+// Free the block of 2^order pages starting at 'pi',
+// merging it with its buddy for as long as the buddy is free too.
+// A buddy never lies outside the 2MB block, and so the chunk, we're in.
+// Called with mem_freelock held.
+static void
+mem_put(pageinfo *pi, int order)
+{
+	while (order < MEM_MAXORDER) {
+		pageinfo *buddy = &mem_pageinfo[(pi - mem_pageinfo) ^ (1 << order)];
+		if (buddy >= &mem_pageinfo[mem_npage]
+				|| buddy->free_prev == NULL || buddy->order != order
+				|| buddy->node != pi->node)
+			break;
+		mem_unlink(buddy);
+		pi = MIN(pi, buddy);
+		order++;
+	}
+	mem_link(pi, order);
+}
+
+// Initialize the next chunk of physical memory holding some of a node's
+// memory, if the allocator needs more memory on that node.
+// Returns false if there is none left, or mem_steal() took it all.
+// Called with mem_freelock held.
+static bool
+mem_grow(int node)
+{
+	memnode *mn = &mem_nodes[node];
+	for (; !mem_stolen && mn->lazy < mem_nchunks; mn->lazy++) {
+		size_t c = mn->lazy, end;
+		if (mem_chunkdone[c / 8] & (1 << (c % 8)))
+			continue;
+		size_t lo = c * MEM_CHUNKSIZE;
+		size_t hi = MIN(lo + MEM_CHUNKSIZE, mem_npage*PAGESIZE);
+		for (; lo < hi; lo = end)
+			if (mem_physnode(lo, &end) == node) {
+				mem_initchunk(c);
+				return 1;
+			}
+	}
+	return 0;
+}
+
+// Take a free block of 2^order pages from a node,
+// splitting a larger one if need be,
+// and initializing more of the node's memory if there is none.
+// Called with mem_freelock held.
+static pageinfo *
+mem_take(int node, int order)
+{
+	memnode *mn = &mem_nodes[node];
+	int o = order;
+	while (o <= MEM_MAXORDER && mn->blocks[o] == NULL)
+		if (++o > MEM_MAXORDER && mem_grow(node))
+			o = order;	// found more memory: look again
+	if (o > MEM_MAXORDER)
+		return NULL;
+
+	pageinfo *pi = mn->blocks[o];
+	mem_unlink(pi);
+	while (o > order) {	// give back the halves we don't need
+		o--;
+		mem_link(pi + (1 << o), o);
+	}
+	return pi;
+}
+
+// Free the pages in physical address range [lo,hi) as large blocks,
+// each lying entirely on one node.
+static void
+mem_putrange(size_t lo, size_t hi)
+{
+	lo = ROUNDUP(MAX(lo, 2*PAGESIZE), PAGESIZE);	// keep pages 0 and 1
+	hi = ROUNDDOWN(hi, PAGESIZE);
+	while (lo < hi) {
+		size_t end;
+		mem_physnode(lo, &end);
+		end = end < hi ? ROUNDUP(end, PAGESIZE) : hi;
+		int order = MEM_MAXORDER;
+		while (order > 0 && ((lo & ((PAGESIZE << order) - 1)) != 0
+				|| lo + (PAGESIZE << order) > end))
+			order--;
+
+		pageinfo *pi = mem_phys2pi(lo), *epi = pi + (1 << order);
+		for (; pi < epi; pi++)
+			pi->refcount = 0;
+		mem_put(mem_phys2pi(lo), order);
+		lo += PAGESIZE << order;
+	}
+}
+
+// Initialize the pageinfo structs for chunk 'c' of physical memory,
+// and free the usable pages in it: the rest of base memory,
+// and extended memory past the kernel and the pageinfo array.
+// Called with mem_freelock held, or during mem_init().
+static void
+mem_initchunk(size_t c)
+{
+	size_t lo = c * MEM_CHUNKSIZE;
+	size_t hi = MIN(lo + MEM_CHUNKSIZE, mem_npage*PAGESIZE);
+	mem_chunkdone[c / 8] |= 1 << (c % 8);
+
+	pageinfo *pi;
+	memset(mem_phys2pi(lo), 0, (hi - lo) / PAGESIZE * sizeof(pageinfo));
+	for (pi = mem_phys2pi(lo); pi < mem_phys2pi(hi); pi++)
+		pi->refcount = 1;	// in use until proven free
+	mem_setnode(lo, hi);
+
+	int i;
+	for (i = 0; i < mem_nram; i++) {
+		size_t rlo = MAX(lo, mem_ram[i].base);
+		size_t rhi = MIN(hi, mem_ram[i].base + mem_ram[i].size);
+		mem_putrange(rlo, MIN(rhi, MEM_IO));
+		mem_putrange(MAX(rlo, mem_freelo), rhi);
+	}
+}
+
+// Allocate a naturally aligned block of 2^order contiguous pages,
+// up to MEM_MAXORDER (a 2MB large page), with all refcounts zero,
+// on the current CPU's node if possible.
+// Returns NULL if there is no free block that large.
+pageinfo *
+mem_allocblock(int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	memnode *mn = &mem_nodes[cpu_cur()->node];
+	pageinfo *pi = NULL;
+	int i;
+	spinlock_acquire(&mem_freelock);
+	for (i = 0; pi == NULL && i < mem_nnodes; i++)
+		pi = mem_take(mn->near[i], order);
+	spinlock_release(&mem_freelock);
+
+	for (i = 0; pi != NULL && i < (1 << order); i++) {
+		pi[i].home = 0;
+		pi[i].shared = 0;
+		pi[i].base = 0;
+	}
+	return pi;
+}
+
+// Free a block from mem_allocblock(), once all its pages are unreferenced.
+void
+mem_freeblock(pageinfo *pi, int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	assert(((pi - mem_pageinfo) & ((1 << order) - 1)) == 0);
+	int i;
+	for (i = 0; i < (1 << order); i++)
+		if (pi[i].refcount != 0)
+			panic("mem_freeblock: attempt to free in-use page");
+
+	spinlock_acquire(&mem_freelock);
+	mem_put(pi, order);
+	spinlock_release(&mem_freelock);
+}
+
+// Allocate a physical page on node 'node', or failing that,
+// on the nearest other node that has memory.
+pageinfo *
+mem_allocnode(int node)
+{
+	if (node < 0 || node >= mem_nnodes)
+		node = 0;
+	pageinfo *pi = NULL;
+	int i;
+	spinlock_acquire(&mem_freelock);
+	for (i = 0; pi == NULL && i < mem_nnodes; i++) {
+		int n = mem_nodes[node].near[i];
+		memnode *mn = &mem_nodes[n];
+		if ((pi = mn->freelist) != NULL) {
+			mn->freelist = pi->free_next;
+			mn->nfreelist--;
+		} else
+			pi = mem_take(n, 0);
+	}
+	if (pi != NULL) {
+		pi->free_next = NULL;		// Mark it not on the free list
+		pi->home = 0;			// Assume it originated here
+		pi->shared = 0;			// Unshared initially
+		pi->base = 0;			// Not a copy of a remote page
+	}
+	spinlock_release(&mem_freelock);
+
+	// Out of memory: page out some blocked process's memory and retry.
+	if (pi == NULL && swap_reclaim(NULL) > 0)
+		return mem_allocnode(node);
+	return pi;
+}
+
+// Take all free memory away from the allocator, for the self-checks,
+// returning it as a chain of blocks to give back with mem_unsteal().
+pageinfo *
+mem_steal(void)
+{
+	spinlock_acquire(&mem_freelock);
+	pageinfo *fl = NULL, *pi;
+	int n, o;
+	for (n = 0; n < mem_nnodes; n++) {
+		memnode *mn = &mem_nodes[n];
+		while ((pi = mn->freelist) != NULL) {
+			mn->freelist = pi->free_next;
+			pi->order = 0;
+			pi->free_next = fl;
+			fl = pi;
+		}
+		mn->nfreelist = 0;
+		for (o = 0; o <= MEM_MAXORDER; o++)
+			while ((pi = mn->blocks[o]) != NULL) {
+				mem_unlink(pi);
+				pi->free_next = fl;
+				fl = pi;
+			}
+	}
+	mem_stolen = 1;		// no initializing more memory either
+	spinlock_release(&mem_freelock);
+	return fl;
+}
+
+// Give back the free memory taken by mem_steal().
+void
+mem_unsteal(pageinfo *fl)
+{
+	spinlock_acquire(&mem_freelock);
+	while (fl != NULL) {
+		pageinfo *pi = fl;
+		fl = pi->free_next;
+		pi->free_next = NULL;
+		mem_put(pi, pi->order);
+	}
+	mem_stolen = 0;
+	spinlock_release(&mem_freelock);
+}
+
+// Record a range of physical memory the ACPI SRAT says is on a node.
+void
+mem_addnode(uint64_t base, uint64_t size, int node)
+{
+	assert(node >= 0 && node < MEM_MAXNODES);
+	if (mem_nnuma == MEM_MAXRANGES) {
+		warn("mem_addnode: too many NUMA memory ranges");
+		return;
+	}
+	mem_numa[mem_nnuma].base = base;
+	mem_numa[mem_nnuma].size = size;
+	mem_numa[mem_nnuma].type = node;
+	mem_nnuma++;
+	cprintf("NUMA node %d: %llx - %llx\n", node, base, base + size);
+}
+
+// Once the ACPI tables have told us the NUMA topology,
+// work out which nodes each node should fall back on, nearest first,
+// and move the memory we initialized before we knew to the proper nodes.
+// Called once on the boot CPU, before the other CPUs start.
+void
+mem_initnodes(void)
+{
+	int i, j, k;
+	for (i = 0; i < MEM_MAXNODES; i++)
+		for (j = 0; j < MEM_MAXNODES; j++)
+			if (mem_nodedist[i][j] == 0)	// no SLIT entry
+				mem_nodedist[i][j] = i == j ? 10 : 20;
+	for (i = 0; i < mem_nnodes; i++) {
+		int *near = mem_nodes[i].near;
+		for (j = 0; j < mem_nnodes; j++)
+			near[j] = j;
+		for (j = 0; j < mem_nnodes; j++)	// selection sort
+			for (k = j + 1; k < mem_nnodes; k++)
+				if (mem_nodedist[i][near[k]]
+						< mem_nodedist[i][near[j]]) {
+					int t = near[j];
+					near[j] = near[k];
+					near[k] = t;
+				}
+	}
+	if (mem_nnuma == 0)
+		return;		// everything stays on node 0
+
+	// So far every page was on node 0: fix the pages we've initialized,
+	// and free all the free ones again, now onto their proper nodes.
+	pageinfo *fl = mem_steal();
+	spinlock_acquire(&mem_freelock);
+	size_t c;
+	for (c = 0; c < mem_nchunks; c++)
+		if (mem_chunkdone[c / 8] & (1 << (c % 8)))
+			mem_setnode(c * MEM_CHUNKSIZE, MIN((c+1) * MEM_CHUNKSIZE,
+						mem_npage*PAGESIZE));
+	while (fl != NULL) {
+		pageinfo *pi = fl;
+		fl = pi->free_next;
+		pi->free_next = NULL;
+		size_t lo = mem_pi2phys(pi);
+		mem_putrange(lo, lo + (PAGESIZE << pi->order));
+	}
+	for (i = 0; i < mem_nnodes; i++)
+		mem_nodes[i].lazy = 0;
+	mem_stolen = 0;
+	spinlock_release(&mem_freelock);
+	cprintf("mem: %d NUMA nodes\n", mem_nnodes);
+}
+#endif	// LAB >= 9
+
 //
 // Allocates a physical page from the page free list.
 // Does NOT set the contents of the physical page to zero -
@@ -362,6 +806,9 @@ mem_alloc(void)
 {
 	// Fill this function in
 #if SOL >= 1
+#if LAB >= 9
+	return mem_allocnode(cpu_cur()->node);	// local memory if possible
+#else
 #if SOL >= 2
 	spinlock_acquire(&mem_freelock);
 #endif
@@ -373,6 +820,7 @@ mem_alloc(void)
 #if SOL >= 5
 		pi->home = 0;			// Assume it originated here
 		pi->shared = 0;			// Unshared initially
+		pi->base = 0;			// Not a copy of a remote page
 #endif
 	}
 
@@ -381,6 +829,7 @@ mem_alloc(void)
 #endif
 
 	return pi;	// Return pageinfo pointer or NULL
+#endif	// LAB < 9
 
 #else
 	// Fill this function in.
@@ -400,14 +849,30 @@ mem_free(pageinfo *pi)
 		panic("mem_free: attempt to free in-use page");
 	if (pi->free_next != NULL)
 		panic("mem_free: attempt to free already free page!");
+#if LAB >= 9
+	if (pi->free_prev != NULL)
+		panic("mem_free: attempt to free already free page!");
+#endif
 
 #if SOL >= 2
 	spinlock_acquire(&mem_freelock);
 #endif
 
+#if LAB >= 9
+	// Keep a few recently freed pages on their node handy for reuse
+	// while still warm; beyond that, merge them back into buddy blocks.
+	memnode *mn = &mem_nodes[pi->node];
+	if (mn->nfreelist < MEM_FREECACHE) {
+		pi->free_next = mn->freelist;
+		mn->freelist = pi;
+		mn->nfreelist++;
+	} else
+		mem_put(pi, 0);
+#else
 	// Insert the page at the head of the free list.
 	pi->free_next = mem_freelist;
 	mem_freelist = pi;
+#endif
 
 #if SOL >= 2
 	spinlock_release(&mem_freelock);
@@ -418,45 +883,84 @@ mem_free(pageinfo *pi)
 #endif /* not SOL >= 1 */
 }
 
+bool
+mem_empty(void)
+{
+#if LAB >= 9
+	int n, o;
+	for (n = 0; n < mem_nnodes; n++) {
+		if (mem_nodes[n].freelist != NULL)
+			return 0;
+		for (o = 0; o <= MEM_MAXORDER; o++)
+			if (mem_nodes[n].blocks[o] != NULL)
+				return 0;
+	}
+
+	// Memory we haven't initialized yet is free too, unless stolen.
+	size_t c;
+	for (c = 0; !mem_stolen && c < mem_nchunks; c++)
+		if (!(mem_chunkdone[c / 8] & (1 << (c % 8))))
+			return 0;
+	return 1;
+#else
+	return mem_freelist == NULL;
+#endif
+}
+
 #if LAB >= 5
+// Hash table mapping remote references to our local copies of those pages,
+// chained through pageinfo.homenext.
+// The buckets are protected by a set of spinlocks striped across them,
+// so that lookups neither contend with each other nor with page allocation.
+#define MEM_RRHASHBITS	12		// Log2 of number of hash buckets
+#define MEM_RRHASH	(1 << MEM_RRHASHBITS)
+#define MEM_RRLOCKS	64		// Spinlocks striped across buckets
+
+static pageinfo *mem_rrhash[MEM_RRHASH];
+static spinlock mem_rrlock[MEM_RRLOCKS];
+
+static int
+mem_rrbucket(intptr_t rr)
+{
+	return ((uint64_t)rr * 0x9e3779b97f4a7c15ULL) >> (64 - MEM_RRHASHBITS);
+}
+
+// Initialize the remote reference hash table's locks.
+static void
+mem_rrinit(void)
+{
+	int i;
+	for (i = 0; i < MEM_RRLOCKS; i++)
+		spinlock_init(&mem_rrlock[i]);
+}
+
 // When we receive a copy of a page or kernel object from a remote node,
 // we call this function to keep track of the page's origin,
 // so that we can later find it again given the same remote reference.
-void mem_rrtrack(uint32_t rr, pageinfo *pi)
+void mem_rrtrack(intptr_t rr, pageinfo *pi)
 {
 	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't track zero page!
 	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
-	// Change these to use whatever your memory spinlock is called.
-	spinlock_acquire(&mem_freelock);
-
 	uint8_t node = RRNODE(rr);
 	assert(node > 0 && node <= NET_MAXNODES);
 
-	// Look up our pageinfo struct containing our homelist
-	// for the appropriate remote physical address.
-	// This design assumes that our pageinfo array will be big enough,
-	// which implies that all nodes must have the same amount of RAM.
-	// This could easily be fixed by allocating a separate hash table
-	// mapping remote references to local pages.
-	uint32_t addr = RRADDR(rr);
-	pageinfo *hpi = mem_phys2pi(addr);
-	assert(hpi > &mem_pageinfo[1] && hpi < &mem_pageinfo[mem_npage]);
+	int b = mem_rrbucket(rr);
+	spinlock *lk = &mem_rrlock[b % MEM_RRLOCKS];
+	spinlock_acquire(lk);
 
 	// Quick scan just to make sure it's not already there - shouldn't be!
 	pageinfo *spi;
-	for (spi = hpi->homelist; spi != NULL; spi = spi->homenext) {
-		assert(RRADDR(spi->home) == addr);
+	for (spi = mem_rrhash[b]; spi != NULL; spi = spi->homenext)
 		assert(spi->home != rr);
-	}
 
-	// Insert the new page at the head of the appropriate homelist
+	// Insert the new page at the head of the appropriate hash chain
 	pi->home = rr;
-	pi->homenext = hpi->homelist;
-	hpi->homelist = pi;
+	pi->homenext = mem_rrhash[b];
+	mem_rrhash[b] = pi;
 
-	spinlock_release(&mem_freelock);
+	spinlock_release(lk);
 }
 
 // Given a remote reference to a page on some other node,
@@ -464,29 +968,28 @@ void mem_rrtrack(uint32_t rr, pageinfo *pi)
 // and return a pointer the beginning of that page if so.
 // Otherwise, returns NULL.
 pageinfo *
-mem_rrlookup(uint32_t rr)
+mem_rrlookup(intptr_t rr)
 {
-	// Change these to use whatever your memory spinlock is called.
-	spinlock_acquire(&mem_freelock);
-
 	uint8_t node = RRNODE(rr);
 	assert(node > 0 && node <= NET_MAXNODES);
-	uint32_t addr = RRADDR(rr);
-	pageinfo *pi = mem_phys2pi(addr);
-	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 
-	// Search for a page corresponding to this rr in the homelist
-	for (pi = pi->homelist; pi != NULL; pi = pi->homenext) {
-		assert(RRADDR(pi->home) == addr);
+	int b = mem_rrbucket(rr);
+	spinlock *lk = &mem_rrlock[b % MEM_RRLOCKS];
+	spinlock_acquire(lk);
+
+	// Search for a page corresponding to this rr in its hash chain
+	pageinfo *pi;
+	for (pi = mem_rrhash[b]; pi != NULL; pi = pi->homenext) {
 		if (pi->home == rr) {		// found it!
-			// Take a reference while we still have
-			// the pageinfo array locked, so it can't go away.
+			// Take a reference while we still hold the chain's lock.
+			// Pages that have been shared are never freed,
+			// so it can't go away in the meantime.
 			mem_incref(pi);
 			break;
 		}
 	}
 
-	spinlock_release(&mem_freelock);
+	spinlock_release(lk);
 	return pi;
 }
 
@@ -506,10 +1009,30 @@ mem_check()
         // the free list, try to make sure it
         // eventually causes trouble.
 	int freepages = 0;
+#if LAB >= 9
+	// Count the cached pages and buddy blocks on every node
+	// in the memory initialized so far,
+	// which is at least the chunk holding the kernel.
+	int n;
+	for (n = 0; n < mem_nnodes; n++) {
+		for (pp = mem_nodes[n].freelist; pp != 0; pp = pp->free_next)
+			freepages++;
+		for (i = 0; i <= MEM_MAXORDER; i++)
+			for (pp = mem_nodes[n].blocks[i]; pp != 0;
+					pp = pp->free_next) {
+				assert(pp->order == i && pp->refcount == 0);
+				assert(pp->node == n);
+				assert(((pp - mem_pageinfo) & ((1 << i) - 1))
+					== 0);
+				freepages += 1 << i;
+			}
+	}
+#else
 	for (pp = mem_freelist; pp != 0; pp = pp->free_next) {
 	//	memset(mem_pi2ptr(pp), 0x97, 128);
 		freepages++;
 	}
+#endif
 	cprintf("mem_check: %d free pages\n", freepages);
 	assert(freepages < mem_npage);	// can't have more free than total!
 	assert(freepages > 16000);	// make sure it's in the right ballpark
@@ -528,8 +1051,12 @@ mem_check()
         assert(mem_pi2phys(pp2) < mem_npage*PAGESIZE);
 
 	// temporarily steal the rest of the free pages
+#if LAB >= 9
+	fl = mem_steal();
+#else
 	fl = mem_freelist;
 	mem_freelist = 0;
+#endif
 
 	// should be no free memory
 	assert(mem_alloc() == 0);
@@ -548,7 +1075,11 @@ mem_check()
 	assert(mem_alloc() == 0);
 
 	// give free list back
+#if LAB >= 9
+	mem_unsteal(fl);
+#else
 	mem_freelist = fl;
+#endif
 
 	// free the pages we took
 	mem_free(pp0);
@@ -556,6 +1087,13 @@ mem_check()
 	mem_free(pp2);
 
 #if LAB >= 9
+	// the buddy allocator should hand out whole aligned large pages
+	pp0 = mem_allocblock(MEM_MAXORDER);
+	assert(pp0 != 0);
+	assert((mem_pi2phys(pp0) & (PTSIZE-1)) == 0);
+	mem_freeblock(pp0, MEM_MAXORDER);
+	assert(mem_allocblock(MEM_MAXORDER) == pp0);
+	mem_freeblock(pp0, MEM_MAXORDER);
 #else
 	cprintf("mem_check() succeeded!\n");
 #endif
@@ -110,11 +110,16 @@ extern int grub_mmap_nentries;
 typedef struct pageinfo {
 	struct pageinfo	*free_next;	// Next page number on free list
 	int32_t	refcount;		// Reference count on allocated pages
+#if LAB >= 9
+	int16_t	order;			// Log2 of pages in our free block
+	uint16_t node;			// NUMA node the page belongs to
+	struct pageinfo	**free_prev;	// Link to us if a free buddy block
+#endif
 #if LAB >= 5
 	intptr_t home;			// Remote reference to page's home
 	intptr_t shared;		// Other nodes I've given RRs to
-	struct pageinfo *homelist;	// My pages with homes at this physaddr
-	struct pageinfo *homenext;	// Next pointer on homelist
+	struct pageinfo *homenext;	// Next on remote ref hash chain
+	intptr_t base;			// RR of remote page we were copied from
 #endif
 } pageinfo;
 
@@ -136,6 +141,21 @@ extern pageinfo *mem_pageinfo;	// Metadata array indexed by page number
 // including the program's code, data, and bss sections.
 // Use these to avoid treating kernel code/data pages as free memory!
 extern char start[], end[];
+#if LAB >= 9
+
+// The binary files linked into the kernel (see kern/Makefrag) lie
+// page-aligned between these, and file_initroot() maps their whole pages
+// into the root process copy-on-write.  The kernel's own reference
+// keeps such a page's refcount above zero, so it never gets freed.
+extern char __start_binfiles[], __stop_binfiles[];
+#define mem_kernpage(pi) \
+	((pi) >= mem_ptr2pi(start) && (pi) <= mem_ptr2pi(end-1) \
+	 && !((pi) >= mem_ptr2pi(__start_binfiles) \
+	      && (pi) < mem_ptr2pi(__stop_binfiles)))
+#else
+#define mem_kernpage(pi) \
+	((pi) >= mem_ptr2pi(start) && (pi) <= mem_ptr2pi(end-1))
+#endif
 
 
 // Detect available physical memory and initialize the mem_pageinfo array.
@@ -148,13 +168,47 @@ pageinfo *mem_alloc(void);
 // Return a physical page to the free list.
 void mem_free(pageinfo *pi);
 
+// Return true if there are no free physical pages left to allocate.
+bool mem_empty(void);
+
+#if LAB >= 9
+// Free memory is kept in naturally aligned buddy blocks of 2^order pages,
+// up to MEM_MAXORDER: one 2MB large page.
+#define MEM_MAXORDER	(PDSHIFT(1) - PAGESHIFT)
+
+// Allocate or free a block of 2^order contiguous pages.
+pageinfo *mem_allocblock(int order);
+void mem_freeblock(pageinfo *pi, int order);
+
+// Take all free memory away from the allocator and give it back,
+// for the self-checks in mem_check() and pmap_check().
+pageinfo *mem_steal(void);
+void mem_unsteal(pageinfo *fl);
+
+// Free memory is kept separately for each NUMA node, and mem_alloc()
+// allocates on the current CPU's node, falling back to the nearest others.
+// The node topology comes from the ACPI SRAT and SLIT (see dev/acpi.c).
+#define MEM_MAXNODES	8		// Max NUMA nodes we support
+
+extern int mem_nnodes;			// Number of NUMA nodes
+extern uint8_t mem_nodedist[MEM_MAXNODES][MEM_MAXNODES]; // SLIT distances
+
+// Record that physical range [base,base+size) belongs to a node,
+// then redistribute free memory by node once all ranges are known.
+void mem_addnode(uint64_t base, uint64_t size, int node);
+void mem_initnodes(void);
+
+// Allocate a physical page on a given node if possible, else a near one.
+pageinfo *mem_allocnode(int node);
+#endif
+
 #if LAB >= 3
 extern uint8_t pmap_zero[PAGESIZE];	// for the asserts below
 #endif	// LAB >= 3
 #if LAB >= 5
 
-void mem_rrtrack(uint32_t rr, pageinfo *pi);
-pageinfo *mem_rrlookup(uint32_t rr);
+void mem_rrtrack(intptr_t rr, pageinfo *pi);
+pageinfo *mem_rrlookup(intptr_t rr);
 #endif // LAB >= 5
 
 
@@ -166,7 +220,7 @@ mem_incref(pageinfo *pi)
 #if LAB >= 3
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't alloc/free zero page!
 #endif
-	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+	assert(!mem_kernpage(pi));
 
 	lockadd(&pi->refcount, 1);
 }
@@ -180,7 +234,7 @@ mem_decref(pageinfo* pi, void (*freefun)(pageinfo *pi))
 #if LAB >= 3
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't alloc/free zero page!
 #endif
-	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
+	assert(!mem_kernpage(pi));
 
 	if (lockaddz(&pi->refcount, -1))
 #if LAB >= 5
@@ -17,29 +17,66 @@
 #include <kern/net.h>
 
 #include <dev/e100.h>
+#include <dev/vnet.h>
+#if LAB >= 9
+#include <dev/timer.h>
+#endif
 
 
 uint8_t net_node;	// My node number - from net_mac[5]
 uint8_t net_mac[6];	// My MAC address from the Ethernet card
+int net_maxpkt = NET_MAXPKT;	// Largest packet our card will send
 
 spinlock net_lock;
 proc *net_migrlist;	// List of currently migrating processes
-proc *net_pulllist;	// List of processes currently pulling a page
+proc *net_pulllist;	// List of processes currently pulling pages
+int net_pullwin = PROC_PULLWIN;	// Page pulls each process keeps in flight
+int net_pulllz = 1;		// Try LZ compressing page pull replies
+int net_pullpoll = 1;		// Poll the e100 instead of taking intrs
+				// while we have bulk page pulls going
+static bool net_polling;	// e100 is in polled mode
+
+net_stats net_stat;		// Retransmission statistics
+uint32_t net_ticks;		// Count of net_tick() calls on boot CPU
+
+// Per-peer round-trip time estimates, in net_ticks,
+// kept as in Jacobson's algorithm and used for retransmission timeouts.
+#define NET_RTOINIT	64	// Timeout before we have any RTT samples
+#define NET_RTOMIN	2	// Never time out quicker than this
+#define NET_RTOMAX	1024	// Cap on exponentially backed-off timeout
+static struct net_peer {
+	bool	valid;		// We have at least one RTT sample
+	int	srtt;		// Smoothed round-trip time, scaled by 8
+	int	rttvar;		// Round-trip time variation, scaled by 4
+} net_peer[NET_MAXNODES+1];
 
 #define NET_ETHERTYPE	0x9876	// Claim this ethertype for our packets
 
 
 void net_txmigrq(proc *p);
 void net_rxmigrq(net_migrq *migrq);
-void net_txmigrp(uint8_t dstnode, uint32_t prochome);
+void net_txmigrp(uint8_t dstnode, intptr_t prochome);
 void net_rxmigrp(net_migrp *migrp);
 
-void net_pull(proc *p, uint32_t rr, void *pg, int pglevel);
-void net_txpullrq(proc *p);
-void net_rxpullrq(net_pullrq *rq);
-void net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg);
+void net_pull(proc *p, intptr_t rr, void *pg, int pglevel,
+		int level, uintptr_t va);
+void net_txpullrq(proc *p, bool all);
+void net_rxpullrq(net_pullrq *rq, int len);
+void net_txpullrp(uint8_t rqnode, intptr_t rr, int pglev, int part, void *pg);
+static bool net_txpullrpz(uint8_t rqnode, intptr_t rr, int pglev, void *pg,
+			int need);
+static void net_pullconv(const pte_t *pt, pte_t *rrs, int nrrs,
+			int pglev, int base);
 void net_rxpullrp(net_pullrphdr *rp, int len);
-bool net_pullpte(proc *p, uint32_t *pte, int pglevel);
+static void net_pullkern(struct procpull *pl);
+static void net_pullfill(proc *p, struct procpull *pl);
+static bool net_pulllock(proc *p);
+static bool net_pullland(proc *p);
+static void net_pullwake(proc *w);
+static void net_pulldone(proc *p);
+bool net_pullwalk(proc *p);
+static void net_txpullnak(proc *p, struct procpull *pl, uint8_t miss);
+bool net_pullpte(proc *p, pte_t *pte, int level, uintptr_t va);
 
 void
 net_init(void)
@@ -49,10 +86,12 @@ net_init(void)
 
 	spinlock_init(&net_lock);
 
-	if (!e100_present) {
+	if (!e100_present && !vnet_present) {
 		cprintf("No network card found; networking disabled\n");
 		return;
 	}
+	if (vnet_present)
+		net_maxpkt = vnet_maxpkt;
 
 	// Ethernet card should already have been initialized
 	assert(net_mac[0] != 0 && net_mac[5] != 0);
@@ -71,7 +110,8 @@ net_ethsetup(net_ethhdr *eth, uint8_t destnode)
 	eth->type = htons(NET_ETHERTYPE);
 }
 
-// Just a trivial wrapper for the e100 driver's transmit function.
+// Just a trivial wrapper for the network driver's transmit function,
+// preferring the virtio card if we have one.
 // The two buffers provided get concatenated to form the transmitted packet;
 // this is just a convenience (and optimization) for when the caller has a
 // "packet head" and a "packet body" coming from different memory areas.
@@ -79,10 +119,12 @@ net_ethsetup(net_ethhdr *eth, uint8_t destnode)
 int net_tx(void *hdr, int hlen, void *body, int blen)
 {
 	//cprintf("net_tx %d+%d\n", hlen, blen);
+	if (vnet_present)
+		return vnet_tx(hdr, hlen, body, blen);
 	return e100_tx(hdr, hlen, body, blen);
 }
 
-// The e100 network interface device driver calls this
+// The network interface device driver calls this
 // from its interrupt handler whenever it receives a packet.
 void
 net_rx(void *pkt, int len)
@@ -94,7 +136,10 @@ net_rx(void *pkt, int len)
 	}
 	net_hdr *h = pkt;
 	if (memcmp(h->eth.dst, net_mac, 6) != 0) {	// is it for us?
-		warn("net_rx: stray packet received for someone else");
+		// On a shared multicast network (see misc/cluster.sh)
+		// we see all the other nodes' traffic too: drop it quietly.
+		if (memcmp(h->eth.dst, net_mac, 5) != 0)
+			warn("net_rx: stray packet received for someone else");
 		return;	// drop
 	}
 	if (memcmp(h->eth.src, net_mac, 5) != 0		// from a node we know?
@@ -124,11 +169,11 @@ net_rx(void *pkt, int len)
 		net_rxmigrp(pkt);
 		break;
 	case NET_PULLRQ:
-		if (len < sizeof(net_pullrq)) {
+		if (len < offsetof(net_pullrq, rq[1])) {
 			warn("net_rx: runt pull request (%d bytes)", len);
 			return;	// drop
 		}
-		net_rxpullrq(pkt);
+		net_rxpullrq(pkt, len);
 		break;
 	case NET_PULLRP:
 		if (len < sizeof(net_pullrphdr)) {
@@ -147,32 +192,92 @@ net_rx(void *pkt, int len)
 #endif // ! SOL >= 5
 }
 
+// Record a round-trip time sample for requests answered by node.
+// Callers must only sample requests transmitted once (Karn's rule).
+static void
+net_rttsample(uint8_t node, uint32_t rtt)
+{
+	struct net_peer *np = &net_peer[node];
+	if (!np->valid) {
+		np->srtt = rtt << 3;
+		np->rttvar = rtt << 1;
+		np->valid = 1;
+	} else {
+		int delta = (int)rtt - (np->srtt >> 3);
+		np->srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		np->rttvar += delta - (np->rttvar >> 2);
+	}
+	net_stat.rttsamples++;
+}
+
+// Return how many net_ticks to wait for a reply from node
+// to a request we've already transmitted ntx times,
+// backing off exponentially with each retransmission.
+static uint32_t
+net_rto(uint8_t node, int ntx)
+{
+	struct net_peer *np = &net_peer[node];
+	uint32_t rto = np->valid ? (np->srtt >> 3) + np->rttvar : NET_RTOINIT;
+	rto = MAX(rto, NET_RTOMIN);
+	while (--ntx > 0 && rto < NET_RTOMAX)
+		rto <<= 1;
+	return MIN(rto, NET_RTOMAX);
+}
+
 // Called by trap() on every timer interrupt,
-// so that we can periodically retransmit lost packets.
+// so that we can retransmit lost packets once they time out.
 void
 net_tick()
 {
 	if (!cpu_onboot())
 		return;		// count only one CPU's ticks
 
-	static int tick;
-	if (++tick & 63)
-		return;
+	net_ticks++;
+
+	// Poll the network card while we're pulling pages,
+	// and go back to interrupts once all pulls are done.
+	bool poll = net_pullpoll && e100_present && !vnet_present
+			&& net_pulllist != NULL;
+	if (poll != net_polling) {
+		net_polling = poll;
+		e100_setpoll(poll);
+	}
+	if (net_polling)
+		e100_poll();	// in case no CPU is idle to do it
+
+	if (net_migrlist == NULL && net_pulllist == NULL)
+		return;		// Nothing waiting for replies
 
 	spinlock_acquire(&net_lock);
 
 #if SOL >= 5
-	// Retransmit process migrate requests
+	// Retransmit process migrate requests that have timed out
 	proc *p;
 	for (p = net_migrlist; p != NULL; p = p->migrnext) {
-		cprintf("retransmit migrq for %x\n", p);
+		if (net_ticks - p->migrtx < net_rto(p->migrdest, p->migrntx))
+			continue;
+		net_stat.migrqretx++;
 		net_txmigrq(p);
 	}
 
-	// Retransmit page pull requests
-	for (p = net_pulllist; p != NULL; p = p->pullnext) {
-		cprintf("retransmit pullrq for %x\n", p);
-		net_txpullrq(p);
+	// Retransmit page pull requests that have timed out,
+	// and install pages that net_rxpullrp() had to leave waiting.
+	proc *next, *done = NULL;
+	for (p = net_pulllist; p != NULL; p = next) {
+		next = p->pullnext;
+		if (net_pulllock(p)) {
+			if (net_pullland(p)) {
+				if (p->state == PROC_PULL)
+					net_pullwake(p);
+				p->pullnext = done;
+				done = p;
+			}
+			spinlock_release(&p->lock);
+		}
+		if (p->pulling && p->npull > 0)
+			net_txpullrq(p, 1);
 	}
 #else	// ! SOL >= 5
 	// Lab 5: your code here.
@@ -180,6 +285,25 @@ net_tick()
 #endif	// ! SOL >= 5
 
 	spinlock_release(&net_lock);
+
+#if SOL >= 5
+	while (done != NULL) {
+		p = done;
+		done = p->pullnext;
+		if (p->state == PROC_PULL)	// Waiting in net_pullsync()?
+			proc_ready(p);
+		net_pulldone(p);
+	}
+#endif
+}
+
+// Called by idle CPUs spinning in proc_sched(),
+// to service the network card while it's in polled mode.
+void
+net_poll(void)
+{
+	if (net_polling)
+		e100_poll();
 }
 
 // Whenever we send a page containing remote refs to a new node,
@@ -204,6 +328,13 @@ void gcc_noinline
 net_migrate(trapframe *tf, uint8_t dstnode, int entry)
 {
 	proc *p = proc_cur();
+	if (p->pulling)		// Finish pulling our address space first:
+		net_pullsync(tf, entry > 0 ? 0 : entry); // retry when done
+#if LAB >= 9
+	// do_put()/do_get() page everything in before leaving home,
+	// and we never page out a process that's away from home.
+	assert(p->nswapped == 0);
+#endif
 	proc_save(p, tf, entry);	// save current process's state
 
 	assert(dstnode > 0 && dstnode <= NET_MAXNODES && dstnode != net_node);
@@ -223,6 +354,7 @@ net_migrate(trapframe *tf, uint8_t dstnode, int entry)
 	assert(p->migrnext == NULL);
 	p->state = PROC_MIGR;
 	p->migrdest = dstnode;
+	p->migrntx = 0;
 	p->migrnext = net_migrlist;
 	net_migrlist = p;
 
@@ -260,6 +392,8 @@ net_txmigrq(proc *p)
 	rq.pml4 = RRCONS(net_node, mem_phys(p->pml4), 0);
 	rq.save = p->sv;
 	net_tx(&rq, sizeof(rq), NULL, 0);
+	p->migrtx = net_ticks;
+	p->migrntx++;
 #else	// ! SOL >= 5
 	// Lab 5: insert code to create and send out a migrate request
 	// for a process waiting to migrate (in the PROC_MIGR state).
@@ -312,13 +446,31 @@ void net_rxmigrq(net_migrq *migrq)
 	// Now we need to pull over the page directory next,
 	// before we can do anything else.
 	// Just pull it straight into our proc's page directory;
+	// the proc can run as soon as it arrives,
+	// pulling everything else on demand or in the background.
 	// XXX first free old contents of pdir
-	net_pull(p, p->rrpml4, p->pml4, PGLEV_PDIR);
+	spinlock_acquire(&net_lock);
+	assert(p->pullnext == NULL);
+	p->pullnext = net_pulllist;
+	net_pulllist = p;
+	p->state = PROC_PULL;
+	p->pulling = 1;
+	p->pullwait = p->rrpml4;
+	p->npull = 0;
+#if LAB >= 9
+	p->pullstart = timer_read();
+	p->pullready = 0;
+	p->pullpages = 0;
+	p->pullwire = 0;
+#endif
+	net_pull(p, p->rrpml4, p->pml4, PGLEV_PML4, -1, 0);
+	net_txpullrq(p, 0);
+	spinlock_release(&net_lock);
 }
 
 // Transmit a migration reply to a given node, for a given proc's home RR
 void
-net_txmigrp(uint8_t dstnode, uint32_t prochome)
+net_txmigrp(uint8_t dstnode, intptr_t prochome)
 {
 #if SOL >= 5
 	net_migrp migrp;
@@ -355,6 +507,8 @@ void net_rxmigrp(net_migrp *migrp)
 
 	//cprintf("net_rxmigrp: proc %x successfully migrated\n");
 	assert(p->migrdest != 0);
+	if (p->migrntx == 1)
+		net_rttsample(p->migrdest, net_ticks - p->migrtx);
 	p->migrdest = 0;
 	p->migrnext = NULL;
 	p->state = PROC_AWAY;
@@ -368,80 +522,118 @@ void net_rxmigrp(net_migrp *migrp)
 #endif	// ! SOL >= 5
 }
 
-// Pull a page via a remote ref and put process p to sleep waiting for it.
+// Add a pull of a page via a remote ref to process p's window of pulls.
+// The process must already be on the pull list;
+// the request goes out with the next batch sent by net_txpullrq().
+// When the page arrives, net_pullfill() installs it in p's page map
+// at the entry for 'va' in the page map level 'level'.
 void
-net_pull(proc *p, uint32_t rr, void *pg, int pglevel)
+net_pull(proc *p, intptr_t rr, void *pg, int pglevel, int level, uintptr_t va)
 {
 	//cprintf("net_pull: proc %x rr %x -> %x level %d\n",
 	//	p, rr, pg, pglevel);
 	uint8_t dstnode = RRNODE(rr);
 	assert(dstnode > 0 && dstnode <= NET_MAXNODES);
 	assert(dstnode != net_node);
-	assert(pglevel >= 0 && pglevel <= 2);
+	assert(pglevel >= PGLEV_PAGE && pglevel <= PGLEV_PML4);
 
 #if SOL >= 5
-	spinlock_acquire(&net_lock);
-
-	assert(p->pullnext == NULL);
-	p->pullnext = net_pulllist;
-	net_pulllist = p;
-	p->state = PROC_PULL;
-	p->pullrr = rr;
-	p->pullpg = pg;
-	p->pglev = pglevel;
-	p->arrived = 0;		// Bitmask of page parts that have arrived
-
-	// Ship out a pull request - net_tick() will retransmit if necessary.
-	net_txpullrq(p);
-
-	spinlock_release(&net_lock);
+	assert(spinlock_holding(&net_lock));
+	assert(p->pulling);
+	assert(p->npull < PROC_PULLWIN);
+
+	struct procpull *pp = &p->pull[p->npull++];
+	pp->rr = rr;
+	pp->pg = pg;
+	pp->va = va;
+	pp->level = level;
+	pp->pglev = pglevel;
+	pp->arrived = 0;	// Bitmask of page parts that have arrived
+	pp->nakd = 0;
+	pp->ntx = 0;		// Not requested yet
 #else	// ! SOL >= 5
-	// Lab 5: insert code here to put the process into the PROC_PULL state,
-	// save in the proc structure all information needed for the pull,
-	// and transmit a pull message using net_txpullrq().
+	// Lab 5: insert code here to record the pull in a free slot
+	// of the process's pull window (p->pull[]),
+	// saving all information needed to complete the pull later.
 	warn("net_pull not implemented");
 #endif	// ! SOL >= 5
 }
 
-// Transmit a page pull request on behalf of some process.
+// Transmit page pull requests on behalf of process p,
+// batching as many of its pulls from the same node into each message
+// as will fit.  Normally sends only pulls we haven't requested yet;
+// if 'retx' is true, also re-requests pulls whose replies
+// haven't arrived within the node's current retransmission timeout.
 void
-net_txpullrq(proc *p)
+net_txpullrq(proc *p, bool retx)
 {
-	assert(p->state == PROC_PULL);
+	assert(p->pulling);
 	assert(spinlock_holding(&net_lock));
 
 #if SOL >= 5
-	// Create and send a pull request
-	//cprintf("net_txpullrq proc %x rr %x lev %d need %x\n",
-	//	p, p->pullrr, p->pglev, p->arrived ^ 7);
-	net_pullrq rq;
-	net_ethsetup(&rq.eth, RRNODE(p->pullrr));
-	rq.type = NET_PULLRQ;
-	rq.rr = p->pullrr;
-	rq.pglev = p->pglev;
-	rq.need = p->arrived ^ 7;	// Need all parts that haven't arrived
-	net_tx(&rq, sizeof(rq), NULL, 0);
+	bool done[PROC_PULLWIN];
+	int i, j;
+	for (i = 0; i < p->npull; i++) {
+		struct procpull *pp = &p->pull[i];
+		done[i] = pp->arrived == 7 || (pp->ntx > 0 && (!retx ||
+			net_ticks - pp->txtick <
+					net_rto(RRNODE(pp->rr), pp->ntx)));
+		if (!done[i] && pp->ntx > 0)
+			net_stat.pullrqretx++;
+	}
+
+	for (i = 0; i < p->npull; i++) {
+		if (done[i])
+			continue;
+
+		// Collect the outstanding pulls from the same node as this one
+		uint8_t node = RRNODE(p->pull[i].rr);
+		net_pullrq rq;
+		net_ethsetup(&rq.eth, node);
+		rq.type = NET_PULLRQ;
+		rq.nrq = 0;
+		for (j = i; j < p->npull && rq.nrq < NET_PULLRQMAX; j++) {
+			struct procpull *pp = &p->pull[j];
+			if (done[j] || RRNODE(pp->rr) != node)
+				continue;
+			//cprintf("net_txpullrq proc %x rr %x lev %d need %x\n",
+			//	p, pp->rr, pp->pglev, pp->arrived ^ 7);
+			rq.rq[rq.nrq].rr = pp->rr;
+			rq.rq[rq.nrq].pglev = pp->pglev;
+			rq.rq[rq.nrq].need = (pp->arrived ^ 7)
+					| NET_PULLZOK | NET_PULLDOK;
+			if (net_maxpkt >= sizeof(net_pullrphdr) + PAGESIZE)
+				rq.rq[rq.nrq].need |= NET_PULLBIG;
+			rq.nrq++;
+			pp->txtick = net_ticks;
+			pp->ntx++;
+			pp->nakd = 0;
+			done[j] = 1;
+		}
+		net_tx(&rq, offsetof(net_pullrq, rq[rq.nrq]), NULL, 0);
+	}
 #else	// ! SOL >= 5
-	// Lab 5: transmit or retransmit a pull request (net_pullrq).
+	// Lab 5: transmit or retransmit pull requests (net_pullrq).
 	warn("net_txpullrq not implemented");
 #endif	// ! SOL >= 5
 }
 
-// Process a page pull request we've received.
-void
-net_rxpullrq(net_pullrq *rq)
+// Process one page requested in a page pull request we've received.
+static void
+net_rxpullrqent(uint8_t rqnode, struct net_pullrqent *rq)
 {
-	assert(rq->type == NET_PULLRQ);
-	uint8_t rqnode = rq->eth.src[5];
-	assert(rqnode > 0 && rqnode <= NET_MAXNODES && rqnode != net_node);
-
 	// Validate the requested node number and page address.
-	uint32_t rr = rq->rr;
+	intptr_t rr = rq->rr;
 	if (RRNODE(rr) != net_node) {
 		warn("net_rxpullrq: pull request came to wrong node!?");
 		return;
 	}
-	uint32_t addr = RRADDR(rr);
+	if (rq->pglev > PGLEV_PML4) {
+		warn("net_rxpullrq: pull request for invalid level %d",
+			rq->pglev);
+		return;
+	}
+	intptr_t addr = RRADDR(rr);
 	pageinfo *pi = mem_phys2pi(addr);
 	if (pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]) {
 		warn("net_rxpullrq: pull request for invalid page %x", addr);
@@ -461,12 +653,20 @@ net_rxpullrq(net_pullrq *rq)
 	// Mark the page shared, since we're about to share it.
 	net_rrshare(pg, rqnode);
 
-	// Send back whichever of the three page parts the caller still needs.
+	// Send the whole page in one encoded packet if the caller accepts that
+	// and it fits; otherwise send back whichever of the three page parts
+	// the caller still needs.
 	// (We must divide the page into parts to fit into Ethernet packets.)
 #if SOL >= 5
+	spinlock_acquire(&net_lock);	// for net_txscratch
+	if ((rq->need & NET_PULLZOK) &&
+			net_txpullrpz(rqnode, rr, rq->pglev, pg, rq->need))
+		goto sent;
 	if (rq->need & 1) net_txpullrp(rqnode, rr, rq->pglev, 0, pg);
 	if (rq->need & 2) net_txpullrp(rqnode, rr, rq->pglev, 1, pg);
 	if (rq->need & 4) net_txpullrp(rqnode, rr, rq->pglev, 2, pg);
+	sent:
+	spinlock_release(&net_lock);
 #else	// ! SOL >= 5
 	// Lab 5: use net_txpullrp() to send the appropriate parts of the page.
 	warn("net_rxpullrq not fully implemented");
@@ -478,65 +678,73 @@ net_rxpullrq(net_pullrq *rq)
 	pi->shared |= 1 << (rqnode-1);
 }
 
+// Process a page pull request we've received,
+// which may ask for several pages at once.
+void
+net_rxpullrq(net_pullrq *rq, int len)
+{
+	assert(rq->type == NET_PULLRQ);
+	uint8_t rqnode = rq->eth.src[5];
+	assert(rqnode > 0 && rqnode <= NET_MAXNODES && rqnode != net_node);
+
+	int nrq = rq->nrq;
+	if (nrq < 1 || nrq > NET_PULLRQMAX
+			|| len < offsetof(net_pullrq, rq[nrq])) {
+		warn("net_rxpullrq: bad request count %d (%d bytes)", nrq, len);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < nrq; i++)
+		net_rxpullrqent(rqnode, &rq->rq[i]);
+}
+
 static const int partlen[3] = {
 	NET_PULLPART0, NET_PULLPART1, NET_PULLPART2};
 
+#define NET_LZHASH	10		// Log2 of match-finder hash table size
+
+// Scratch space for building pull replies, protected by net_lock,
+// so that serving a pull doesn't eat several KB of the kernel stack
+// of whatever the receive interrupt happened to interrupt.
+static struct {
+	uint8_t	enc[2][NET_PULLPART];	// Candidate encodings of a page
+	pte_t	rrs[NPTENTRIES];	// Page map table converted to RRs
+	uint16_t lzhash[1 << NET_LZHASH]; // net_lzenc()'s match finder
+} net_txscratch;
+
+// Return true if a packet body at 'body' won't survive until the card
+// gets around to reading it, so the driver must copy it:
+// it's on our kernel stack, or in scratch space the next reply reuses.
+bool
+net_txtransient(const void *body)
+{
+	uintptr_t b = (uintptr_t)body;
+	return ROUNDDOWN(b, KSTACKSIZE) == (uintptr_t)cpu_cur()
+		|| (b >= (uintptr_t)&net_txscratch
+			&& b < (uintptr_t)(&net_txscratch + 1));
+}
+
 void
-net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg)
+net_txpullrp(uint8_t rqnode, intptr_t rr, int pglev, int part, void *pg)
 {
+	assert(spinlock_holding(&net_lock));	// for net_txscratch
+
 	// Find appropriate part of this page
 	void *data = pg + NET_PULLPART*part;
 	int len = partlen[part];
 	assert(len <= NET_PULLPART);
-	assert((len & 3) == 0);		// must contain only whole PTEs
+	assert(len % sizeof(pte_t) == 0); // must contain only whole PTEs
 
-	// If we're transmitting part of a page directory or page table,
+	// If we're transmitting part of a page map table at any level,
 	// then first convert all PTEs into remote references.
 	// XXX it's not ideal that we just believe the requestor's word
 	// about whether this is a page table or regular page;
 	// would be better if we kept our own type info in struct pageinfo.
-	int nrrs = len/4;
-	uint32_t rrs[nrrs];
-	if (pglev > 0) {
-		const uint32_t *pt = data;
-#if SOL >= 5
-		int i;
-		for (i = 0; i < nrrs; i++) {
-			uint32_t pte = pt[i];
-			if (pte & PTE_REMOTE) {	// Already remote: just copy
-				rrs[i] = pte;
-				continue;
-			}
-			if (pte & PTE_G) {	// Kernel portion of pdir
-				rrs[i] = 0;
-				continue;
-			}
-			uint32_t addr = PGADDR(pte);
-			if (addr == PTE_ZERO) {	// Zero: send only perms
-				rrs[i] = RR_REMOTE | (pte & RR_RW);
-				continue;
-			}
-			pageinfo *pi = mem_phys2pi(addr);
-			assert(pi > &mem_pageinfo[0]);
-			assert(pi < &mem_pageinfo[mem_npage]);
-			assert(pi->refcount > 0);
-			if (pi->home != 0) {	// Did we originate this page?
-				rrs[i] = pi->home; // No - send original RR
-			} else {		// Yes - create new RR
-				rrs[i] = RRCONS(net_node, addr, pte & RR_RW);
-			}
-		}
-#else	// ! SOL >= 5
-		// Lab 5: convert the PDEs or PTEs in pt[0..nrrs-1]
-		// into corresponding remote references in rrs[0..nrrs-1].
-		// For PDEs/PTEs pointing to PMAP_ZERO,
-		// produce an RR that is zero except for the RR_REMOTE
-		// and the PDE/PTE's nominal permissions.
-		// For page directories, just produce zero RRs
-		// for PDEs representing the non-user portions
-		// of the address space.
-		warn("net_txpullrq not fully implemented");
-#endif	// ! SOL >= 5
+	if (pglev > PGLEV_PAGE) {
+		pte_t *rrs = net_txscratch.rrs;
+		net_pullconv(data, rrs, len / sizeof(pte_t), pglev,
+				NET_PULLPART*part / sizeof(pte_t));
 		data = rrs;	// Send RRs instead of original page.
 	}
 
@@ -546,9 +754,431 @@ net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg)
 	rph.type = NET_PULLRP;
 	rph.rr = rr;
 	rph.part = part;
+	rph.enc = NET_PULLRAW;
 	net_tx(&rph, sizeof(rph), data, len);
 }
 
+// Convert the page map entries in pt[0..nrrs-1], which are entries
+// base through base+nrrs-1 of a table of level pglev,
+// into corresponding remote references in rrs[0..nrrs-1].
+static void
+net_pullconv(const pte_t *pt, pte_t *rrs, int nrrs, int pglev, int base)
+{
+#if SOL >= 5
+	int i;
+	for (i = 0; i < nrrs; i++) {
+		pte_t pte = pt[i];
+		if (pglev == PGLEV_PML4 && (base+i < PDX(3, VM_USERLO) ||
+					base+i >= PDX(3, VM_USERHI))) {
+			rrs[i] = 0;	// Kernel portion of pml4
+			continue;
+		}
+		if ((pte & PTE_P) && ((pte & PTE_G) || (pglev > PGLEV_PTAB
+						&& (pte & PTE_PS)))) {
+			rrs[i] = 0;	// Kernel mapping below the pml4
+			continue;
+		}
+		if (pte & PTE_REMOTE) {	// Already remote: just copy
+			rrs[i] = pte;
+			continue;
+		}
+		intptr_t addr = PTE_ADDR(pte);
+		if (addr == PTE_ZERO) {	// Zero: send only perms
+			rrs[i] = RR_REMOTE | (pte & RR_RW);
+			continue;
+		}
+		pageinfo *pi = mem_phys2pi(addr);
+		assert(pi > &mem_pageinfo[0]);
+		assert(pi < &mem_pageinfo[mem_npage]);
+		assert(pi->refcount > 0);
+		if (pi->home != 0) {	// Did we originate this page?
+			rrs[i] = pi->home; // No - send original RR
+		} else {		// Yes - create new RR
+			rrs[i] = RRCONS(net_node, addr, pte & RR_RW);
+		}
+	}
+#else	// ! SOL >= 5
+	// Lab 5: convert the page map entries in pt[0..nrrs-1]
+	// into corresponding remote references in rrs[0..nrrs-1].
+	// For entries pointing to PTE_ZERO,
+	// produce an RR that is zero except for the RR_REMOTE
+	// and the entry's nominal permissions.
+	// For the page map level-4, just produce zero RRs
+	// for entries representing the non-user portions
+	// of the address space.
+	warn("net_pullconv not implemented");
+#endif	// ! SOL >= 5
+}
+
+// Encode a page as a series of records, each holding a count of literal
+// 64-bit words and a count of repetitions of the word following them,
+// then the literal words themselves and the repeated word.
+// Runs of zero PTEs or zero data are the common case this elides.
+// Returns the encoded length, or 0 if it won't fit in 'max' bytes.
+static int
+net_rlenc(const void *pg, uint8_t *out, int max)
+{
+	const uint64_t *w = pg;
+	const int n = PAGESIZE/8;
+	int i = 0, len = 0;
+	while (i < n) {
+		// Count literal words up to the next pair of equal words.
+		int lit = 0;
+		while (i+lit < n && lit < 255 &&
+				!(i+lit+1 < n && w[i+lit] == w[i+lit+1]))
+			lit++;
+		int rep = 0;
+		if (lit < 255)
+			while (i+lit+rep < n && rep < 255 &&
+					w[i+lit+rep] == w[i+lit])
+				rep++;
+
+		if (len + 2 + 8*(lit + (rep > 0)) > max)
+			return 0;
+		out[len++] = lit;
+		out[len++] = rep;
+		memcpy(&out[len], &w[i], 8*lit);
+		len += 8*lit;
+		if (rep > 0) {
+			memcpy(&out[len], &w[i+lit], 8);
+			len += 8;
+		}
+		i += lit + rep;
+	}
+	return len;
+}
+
+// Decode a page encoded by net_rlenc(), checking that it fills the page.
+static bool
+net_rldec(const uint8_t *in, int len, void *pg)
+{
+	uint64_t *w = pg;
+	const int n = PAGESIZE/8;
+	int i = 0, pos = 0;
+	while (pos < len) {
+		if (pos + 2 > len)
+			return 0;
+		int lit = in[pos++];
+		int rep = in[pos++];
+		if (pos + 8*(lit + (rep > 0)) > len || i + lit + rep > n)
+			return 0;
+		memcpy(&w[i], &in[pos], 8*lit);
+		pos += 8*lit;
+		i += lit;
+		if (rep > 0) {
+			uint64_t v;
+			memcpy(&v, &in[pos], 8);
+			pos += 8;
+			while (rep-- > 0)
+				w[i++] = v;
+		}
+	}
+	return i == n;
+}
+
+// A small LZ77 coder in the style of LZ4, fast enough to run per packet.
+// Each sequence is a token byte holding a literal count (high nibble)
+// and a match length minus NET_LZMIN (low nibble),
+// where a nibble of 15 is extended by following bytes as in LZ4,
+// then the literals, then a 2-byte little-endian match offset.
+// The last sequence has literals only.
+#define NET_LZMIN	4		// Shortest match worth encoding
+
+// Append a nibble overflow count, returning new length or -1 if no room.
+static int
+net_lzputlen(uint8_t *out, int op, int max, int n)
+{
+	if (n < 15)
+		return op;
+	for (n -= 15; n >= 255; n -= 255) {
+		if (op >= max)
+			return -1;
+		out[op++] = 255;
+	}
+	if (op >= max)
+		return -1;
+	out[op++] = n;
+	return op;
+}
+
+// Read back a count from a token nibble plus its overflow bytes.
+static int
+net_lzgetlen(const uint8_t *in, int *ip, int len, int n)
+{
+	if (n < 15)
+		return n;
+	int b;
+	do {
+		if (*ip >= len)
+			return -1;
+		b = in[(*ip)++];
+		n += b;
+	} while (b == 255);
+	return n;
+}
+
+// Append one sequence: nlit literals, then a match unless mlen is 0.
+static int
+net_lzseq(uint8_t *out, int op, int max, const uint8_t *lit, int nlit,
+		int off, int mlen)
+{
+	int mcode = mlen > 0 ? mlen - NET_LZMIN : 0;
+	if (op >= max)
+		return -1;
+	int tok = op++;
+	out[tok] = (MIN(nlit, 15) << 4) | MIN(mcode, 15);
+	op = net_lzputlen(out, op, max, nlit);
+	if (op < 0 || op + nlit > max)
+		return -1;
+	memcpy(&out[op], lit, nlit);
+	op += nlit;
+	if (mlen == 0)
+		return op;
+	if (op + 2 > max)
+		return -1;
+	out[op++] = off;
+	out[op++] = off >> 8;
+	return net_lzputlen(out, op, max, mcode);
+}
+
+// LZ compress a page, returning the compressed length,
+// or 0 if it won't fit in 'max' bytes.
+// The match finder's hash table lives in net_txscratch.
+static int
+net_lzenc(const void *pg, uint8_t *out, int max)
+{
+	assert(spinlock_holding(&net_lock));	// for net_txscratch
+	const uint8_t *in = pg;
+	uint16_t *hash = net_txscratch.lzhash;
+	memset(hash, 0xff, sizeof(net_txscratch.lzhash)); // 0xffff: none yet
+
+	int ip = 0, anchor = 0, op = 0;
+	while (ip + NET_LZMIN <= PAGESIZE) {
+		uint32_t v;
+		memcpy(&v, &in[ip], 4);
+		int h = (v * 2654435761U) >> (32 - NET_LZHASH);
+		int ref = hash[h];
+		hash[h] = ip;
+		if (ref == 0xffff || memcmp(&in[ref], &in[ip], 4) != 0) {
+			ip++;
+			continue;
+		}
+		int mlen = NET_LZMIN;
+		while (ip + mlen < PAGESIZE && in[ref+mlen] == in[ip+mlen])
+			mlen++;
+		op = net_lzseq(out, op, max, &in[anchor], ip - anchor,
+				ip - ref, mlen);
+		if (op < 0)
+			return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+	op = net_lzseq(out, op, max, &in[anchor], PAGESIZE - anchor, 0, 0);
+	return op < 0 ? 0 : op;
+}
+
+// Decompress a page compressed by net_lzenc(),
+// checking every count and offset since it came off the network.
+static bool
+net_lzdec(const uint8_t *in, int len, void *pg)
+{
+	uint8_t *out = pg;
+	int ip = 0, op = 0;
+	while (ip < len) {
+		int tok = in[ip++];
+		int nlit = net_lzgetlen(in, &ip, len, tok >> 4);
+		if (nlit < 0 || ip + nlit > len || op + nlit > PAGESIZE)
+			return 0;
+		memcpy(&out[op], &in[ip], nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == len)
+			break;		// Last sequence: literals only
+
+		if (ip + 2 > len)
+			return 0;
+		int off = in[ip] | (in[ip+1] << 8);
+		ip += 2;
+		int mlen = net_lzgetlen(in, &ip, len, tok & 15);
+		if (mlen < 0)
+			return 0;
+		mlen += NET_LZMIN;
+		if (off == 0 || off > op || op + mlen > PAGESIZE)
+			return 0;
+		while (mlen-- > 0) {	// Byte at a time: may overlap itself
+			out[op] = out[op - off];
+			op++;
+		}
+	}
+	return op == PAGESIZE;
+}
+
+// Encode the differences between a page and the page it was copied from,
+// as records each holding a 16-bit offset and length, then the new bytes.
+// Runs of changed bytes separated by fewer than NET_DIFFGAP unchanged bytes
+// go in one record, since a record header costs that much.
+// Output starts after room for the base page's RR at the start of 'out'.
+// Returns the encoded length, or 0 if it won't fit in 'max' bytes.
+#define NET_DIFFGAP	4
+static int
+net_diffenc(const uint8_t *pg, const uint8_t *base, uint8_t *out, int max)
+{
+	int op = sizeof(intptr_t), i = 0;
+	while (1) {
+		// Skip unchanged bytes, a word at a time where we can.
+		while (i < PAGESIZE && (i & 7) && pg[i] == base[i])
+			i++;
+		while (i < PAGESIZE && !(i & 7) && *(const uint64_t*)&pg[i]
+					== *(const uint64_t*)&base[i])
+			i += 8;
+		while (i < PAGESIZE && pg[i] == base[i])
+			i++;
+		if (i == PAGESIZE)
+			return op;
+
+		// Find the end of this run of changes.
+		int s = i, e = i + 1;	// e: just past last changed byte
+		for (i = e; i < PAGESIZE && i - e < NET_DIFFGAP; i++)
+			if (pg[i] != base[i])
+				e = i + 1;
+
+		uint16_t hdr[2] = { s, e - s };
+		if (op + sizeof(hdr) + (e - s) > max)
+			return 0;
+		memcpy(&out[op], hdr, sizeof(hdr));
+		memcpy(&out[op + sizeof(hdr)], &pg[s], e - s);
+		op += sizeof(hdr) + (e - s);
+		i = e;
+	}
+}
+
+// Apply the diff records produced by net_diffenc() to 'pg',
+// which must already hold a copy of the base page.
+static bool
+net_diffdec(const uint8_t *in, int len, uint8_t *pg)
+{
+	int ip = 0;
+	while (ip < len) {
+		uint16_t hdr[2];
+		if (len - ip < sizeof(hdr))
+			return 0;
+		memcpy(hdr, &in[ip], sizeof(hdr));
+		ip += sizeof(hdr);
+		if (hdr[1] == 0 || hdr[0] + hdr[1] > PAGESIZE
+				|| len - ip < hdr[1])
+			return 0;
+		memcpy(&pg[hdr[0]], &in[ip], hdr[1]);
+		ip += hdr[1];
+	}
+	return 1;
+}
+
+// Try to send a whole page in a single encoded pull reply,
+// using whichever encoding comes out smallest.
+// A page we copied from one of the requester's own pages goes as a diff
+// against our copy of the original, if the requester accepts that.
+// If both ends handle jumbo frames, an incompressible page
+// goes whole and unencoded, straight from its page frame.
+// Returns false if the page doesn't fit into one packet's payload.
+static bool
+net_txpullrpz(uint8_t rqnode, intptr_t rr, int pglev, void *pg, int need)
+{
+	assert(spinlock_holding(&net_lock));	// for net_txscratch
+	uint8_t (*buf)[NET_PULLPART] = net_txscratch.enc;
+	void *body;
+	int enc, len;
+
+	pageinfo *pi = mem_ptr2pi(pg);
+	if (pglev == PGLEV_PAGE && (need & NET_PULLDOK)
+			&& pi->base != 0 && RRNODE(pi->base) == rqnode) {
+		pageinfo *bpi = mem_rrlookup(pi->base);
+		if (bpi != NULL) {
+			memcpy(buf[0], &pi->base, sizeof(intptr_t));
+			len = net_diffenc(pg, mem_pi2ptr(bpi), buf[0],
+						NET_PULLPART);
+			mem_decref(bpi, mem_free);
+			if (len > 0) {
+				enc = NET_PULLDIFF, body = buf[0];
+				goto send;
+			}
+		}
+	}
+
+	void *data = pg;
+	if (pglev > PGLEV_PAGE) {
+		pte_t *rrs = net_txscratch.rrs;
+		net_pullconv(pg, rrs, NPTENTRIES, pglev, 0);
+		data = rrs;	// Encode RRs instead of original page.
+	}
+
+	enc = NET_PULLRLE;
+	len = net_rlenc(data, buf[0], NET_PULLPART);
+	if (net_pulllz) {
+		int lzlen = net_lzenc(data, buf[1],
+				len > 0 ? len - 1 : NET_PULLPART);
+		if (lzlen > 0)
+			enc = NET_PULLLZ, len = lzlen;
+	}
+	body = buf[enc == NET_PULLLZ];
+	if (len == 0) {		// Doesn't compress well enough
+		if (!(need & NET_PULLBIG)
+				|| net_maxpkt < sizeof(net_pullrphdr) + PAGESIZE)
+			return 0;
+		enc = NET_PULLPAGE, body = data, len = PAGESIZE;
+	}
+
+	send:;
+	net_pullrphdr rph;
+	net_ethsetup(&rph.eth, rqnode);
+	rph.type = NET_PULLRP;
+	rph.rr = rr;
+	rph.part = 0;
+	rph.enc = enc;
+	net_tx(&rph, sizeof(rph), body, len);
+	return 1;
+}
+
+// Send a NACK for a page pull some of whose reply parts have gone missing:
+// a single-entry pull request asking for just the parts in 'miss'.
+static void
+net_txpullnak(proc *p, struct procpull *pl, uint8_t miss)
+{
+	net_pullrq rq;
+	net_ethsetup(&rq.eth, RRNODE(pl->rr));
+	rq.type = NET_PULLRQ;
+	rq.nrq = 1;
+	rq.rq[0].rr = pl->rr;
+	rq.rq[0].pglev = pl->pglev;
+	rq.rq[0].need = miss;
+	net_tx(&rq, offsetof(net_pullrq, rq[1]), NULL, 0);
+	pl->nakd |= miss;
+	net_stat.pullnaks++;
+}
+
+// Reconstruct a page sent as a diff against one of our own pages:
+// one we shared with the sender, who copied and modified it.
+static bool
+net_pulldiff(struct procpull *pl, const uint8_t *in, int len)
+{
+	intptr_t base;
+	if (pl->pglev != PGLEV_PAGE || len < sizeof(base))
+		return 0;
+	memcpy(&base, in, sizeof(base));
+	if (RRNODE(base) != net_node)
+		return 0;
+	pageinfo *bpi = mem_phys2pi(RRADDR(base));
+	if (bpi <= &mem_pageinfo[0] || bpi >= &mem_pageinfo[mem_npage]
+			|| bpi->home != 0 || bpi->shared == 0)
+		return 0;	// Not a page we own and have shared
+
+	// Pages we've shared are never freed, so the base is still there.
+	memcpy(pl->pg, mem_pi2ptr(bpi), PAGESIZE);
+	if (!net_diffdec(in + sizeof(base), len - sizeof(base), pl->pg))
+		return 0;
+	net_stat.pulldiffs++;
+	return 1;
+}
+
 void
 net_rxpullrp(net_pullrphdr *rp, int len)
 {
@@ -559,96 +1189,456 @@ net_rxpullrp(net_pullrphdr *rp, int len)
 
 	spinlock_acquire(&net_lock);
 
-	// Find the process waiting for this pull reply, if any.
+	// Find the process and pull waiting for this pull reply, if any.
 	proc *p, **pp;
+	struct procpull *pl = NULL;
 	for (pp = &net_pulllist; (p = *pp) != NULL; pp = &p->pullnext) {
-		assert(p->state == PROC_PULL);
-		if (p->pullrr == rp->rr)
+		assert(p->pulling);
+		int i;
+		for (i = 0; i < p->npull; i++)
+			if (p->pull[i].rr == rp->rr)
+				break;
+		if (i < p->npull) {
+			pl = &p->pull[i];
 			break;
+		}
 	}
 	if (p == NULL) {	// Probably a duplicate due to retransmission
 		//warn("net_rxpullrp: no process waiting for RR %x", rp->rr);
 		return spinlock_release(&net_lock);
 	}
+	if (pl->arrived == 7) {	// Arrived already, waiting to be installed
+		net_stat.pulldups++;
+		return spinlock_release(&net_lock);
+	}
+	int datalen = len - sizeof(*rp);
+	if (rp->enc != NET_PULLRAW) {
+		// Decode the whole page at once.
+		bool ok = rp->enc == NET_PULLRLE ?
+				net_rldec((uint8_t*)rp->data, datalen, pl->pg) :
+			rp->enc == NET_PULLLZ ?
+				net_lzdec((uint8_t*)rp->data, datalen, pl->pg) :
+			rp->enc == NET_PULLPAGE && datalen == PAGESIZE ?
+				(memcpy(pl->pg, rp->data, PAGESIZE), 1) :
+			rp->enc == NET_PULLDIFF ?
+				net_pulldiff(pl, (uint8_t*)rp->data, datalen) :
+			0;
+		if (!ok) {
+			warn("net_rxpullrp: bad encoded page (enc %d, %d bytes)",
+				rp->enc, datalen);
+			pl->arrived = 0;	// Page is garbage: pull it again
+			return spinlock_release(&net_lock);
+		}
+		pl->arrived = 7;
+		goto filled;
+	}
 	int part = rp->part;
 	if (part < 0 || part > 2) {
 		warn("net_rxpullrp: invalid part number %d", part);
 		return spinlock_release(&net_lock);
 	}
-	if (p->arrived & (1 << rp->part)) {
-		warn("net_rxpullrp: part %d already arrived", part);
+	if (pl->arrived & (1 << rp->part)) {
+		net_stat.pulldups++;	// Crossed with a retransmission
 		return spinlock_release(&net_lock);
 	}
-	int datalen = len - sizeof(*rp);
 	if (datalen != partlen[rp->part]) {
 		warn("net_rxpullrp: part %d wrong size %d", part, datalen);
 		return spinlock_release(&net_lock);
 	}
 
 	// Fill in the appropriate part of the page.
-	memcpy(p->pullpg + NET_PULLPART*part, rp->data, datalen);
-	p->arrived |= 1 << rp->part;	// Mark this part arrived.
-	if (p->arrived == 7)		// All three parts arrived?
-		*pp = p->pullnext;	// Remove from list of waiting procs.
+	memcpy(pl->pg + NET_PULLPART*part, rp->data, datalen);
+	pl->arrived |= 1 << rp->part;	// Mark this part arrived.
+	filled:
+#if LAB >= 9
+	p->pullwire += datalen;
+#endif
+	if (pl->arrived != 7) {		// All three parts arrived?
+		// Parts are sent in order, so any missing before this one
+		// were probably lost: NACK them now instead of timing out.
+		uint8_t miss = ~pl->arrived & ~pl->nakd & ((1 << part) - 1);
+		if (miss != 0)
+			net_txpullnak(p, pl, miss);
+		return spinlock_release(&net_lock); // Wait for the rest
+	}
+	if (pl->ntx == 1)
+		net_rttsample(RRNODE(pl->rr), net_ticks - pl->txtick);
+
+	// If this was a page map table, reinitialize the kernel portions.
+	if (pl->pglev > PGLEV_PTAB)
+		net_pullkern(pl);
+
+#if LAB >= 9
+	p->pullpages++;
+#endif
+
+	// Wake whoever was waiting for this very page:
+	// the proc itself, or its parent pulling it for a PUT or GET.
+	proc *w = NULL;
+	if (p->state == PROC_PULL && p->pullwait == pl->rr)
+		w = p;
+	else if (p->parent != NULL && p->parent->state == PROC_PULL
+			&& p->parent->pullwait == pl->rr)
+		w = p->parent;
+
+	// Hook the page into the proc's page map if nobody else can be
+	// touching it right now; otherwise it waits there until someone can.
+	bool done = 0;
+	if (net_pulllock(p)) {
+		done = net_pullland(p);
+		spinlock_release(&p->lock);
+	}
+	if (done && p->state == PROC_PULL)	// Waiting in net_pullsync()?
+		w = p;
+	net_pullwake(w);
 
 	spinlock_release(&net_lock);
 
-	if (p->arrived != 7)
-		return;			// Wait for remaining parts
+	if (w != NULL)
+		proc_ready(w);
+	if (done)
+		net_pulldone(p);
+}
 
-	// If this was a page directory, reinitialize the kernel portions.
-	if (p->pglev == PGLEV_PDIR) {
-		intptr_t *pml4 = p->pullpg;
-		int i;
-		for (i = 0; i < NPTENTRIES; i++) {
-			if (i == PDX(3, VM_USERLO))	// skip user area
-				i = PDX(3, VM_USERHI);
-			pml4[i] = pmap_bootpmap[i];
+// Return true if we may install pulled pages in p's page map right now,
+// having locked p so that it can't start running meanwhile.
+// That excludes a proc running on another CPU, which may be changing
+// its page map itself, and a stopped proc, whose parent may be.
+// We only try the lock, since its holder may be waiting for net_lock.
+static bool
+net_pulllock(proc *p)
+{
+	if (!spinlock_try(&p->lock))
+		return 0;
+	if (p->state == PROC_STOP
+			|| (p->state == PROC_RUN && p->runcpu != cpu_cur())) {
+		spinlock_release(&p->lock);
+		return 0;
+	}
+	return 1;
+}
+
+// Install all of p's pulls whose pages have completely arrived,
+// free their window slots, and keep the window full.
+// The caller must make sure nobody else is touching p's page map.
+// Returns true if p's whole address space is now local,
+// having taken p off the pull list: the caller calls net_pulldone().
+static bool
+net_pullland(proc *p)
+{
+	assert(spinlock_holding(&net_lock));
+	assert(p->pulling);
+
+	int i = 0;
+	while (i < p->npull) {
+		struct procpull *pl = &p->pull[i];
+		if (pl->arrived != 7) {
+			i++;
+			continue;
 		}
+		net_pullfill(p, pl);
+		*pl = p->pull[--p->npull];
+	}
+
+	if (!net_pullwalk(p)) {
+		net_txpullrq(p, 0);	// Request any newly-started pulls.
+		return 0;
 	}
 
-	// Done - what else does this proc need to pull before it can run?
-	// Remove/disable this code if the VM system supports pull-on-demand.
-	while (p->pullva < VM_USERHI) {
+	proc **pp;
+	for (pp = &net_pulllist; *pp != p; pp = &(*pp)->pullnext)
+		assert(*pp != NULL);
+	*pp = p->pullnext;	// Remove from list of pulling procs.
+	p->pulling = 0;
+	return 1;
+}
+
+// Get proc w, if any, ready to be woken from PROC_PULL state.
+static void
+net_pullwake(proc *w)
+{
+	if (w == NULL)
+		return;
+	w->pullwait = 0;
+#if LAB >= 9
+	if (w->pullready == 0)
+		w->pullready = timer_read();
+#endif
+}
 
-		// Pull or traverse PDE to find page table.
-		pte_t *pde = &p->pml4[PDX(3,p->pullva)];
-		if (*pde & PTE_REMOTE) {	// Need to pull remote ptab?
-			if (!net_pullpte(p, pde, PGLEV_PTAB))
-				return; // Wait for the pull to complete.
+// Wrap up after pulling proc p's entire address space.
+static void
+net_pulldone(proc *p)
+{
+	p->pullnext = NULL;
+#if LAB >= 9
+	uint64_t us = (timer_read() - p->pullstart) * 1000000 / TIMER_FREQ;
+	uint64_t rus = (p->pullready - p->pullstart) * 1000000 / TIMER_FREQ;
+	uint64_t bytes = (uint64_t)p->pullpages * PAGESIZE;
+	if (us == 0)
+		us = 1;
+	cprintf("net: pulled %d pages in %lld us (runnable after %lld us): "
+		"%lld pages/sec, %lld bytes/sec\n", p->pullpages, us, rus,
+		(uint64_t)p->pullpages * 1000000 / us, bytes * 1000000 / us);
+	cprintf("net: %lld wire bytes for %lld page bytes: "
+		"%lld%% compression ratio, %lld bytes saved\n",
+		p->pullwire, bytes, bytes * 100 / MAX(p->pullwire, 1),
+		bytes > p->pullwire ? bytes - p->pullwire : 0);
+	cprintf("net: retransmits: %d migrq, %d pullrq; %d NACKs, "
+		"%d duplicate parts, %d RTT samples\n",
+		net_stat.migrqretx, net_stat.pullrqretx, net_stat.pullnaks,
+		net_stat.pulldups, net_stat.rttsamples);
+	cprintf("net: %d pages received as diffs\n", net_stat.pulldiffs);
+#endif
+	//cprintf("net_rxpullrp: migration complete\n");
+}
+
+// Fill in the entries of page map table pl->pg, just pulled,
+// that map only kernel space and that the sender therefore zeroed,
+// from our own bootstrap page map.
+static void
+net_pullkern(struct procpull *pl)
+{
+	pte_t *pt = pl->pg;
+	int lev = pl->pglev - 1;	// Level of the table's entries
+	uintptr_t base = PDADDR(pl->pglev, pl->va);
+	int i;
+	for (i = 0; i < NPTENTRIES; i++) {
+		uintptr_t va = base + i * PDSIZE(lev);
+		if (va + PDSIZE(lev) > VM_USERLO && va < VM_USERHI)
+			continue;	// Overlaps user space: keep what we pulled
+
+		// Find the corresponding entry in the bootstrap page map.
+		pte_t *bt = pmap_bootpmap;
+		int l;
+		for (l = NPTLVLS; l > lev && bt != NULL; l--) {
+			pte_t e = bt[PDX(l, va)];
+			bt = (e & PTE_P) && !(e & PTE_PS) ?
+				mem_ptr(PTE_ADDR(e)) : NULL;
 		}
-		assert(!(*pde & PTE_REMOTE));
-		if (PGADDR(*pde) == PTE_ZERO) {		// Skip empty PDEs
-			p->pullva = PDADDR(1, p->pullva + PDSIZE(1));
+		pt[i] = bt != NULL ? bt[PDX(lev, va)] : 0;
+	}
+	if (pl->pglev == PGLEV_PML4)	// Our own self-map, not the boot one
+		pt[PML4SELFOFFSET] = mem_phys(pt) | PTE_P | PTE_W;
+}
+
+// Install a page that just arrived into the page map entry it was pulled for.
+// The proc may have been running and changing its page map meanwhile,
+// so we walk down to the entry afresh, and fill it only if
+// it still holds the remote reference we pulled.
+static void
+net_pullfill(proc *p, struct procpull *pl)
+{
+	if (pl->level < 0)
+		return;		// Page map level-4 is pulled in place
+
+	pte_t *pmtab = p->pml4;
+	int lev;
+	for (lev = NPTLVLS; lev > pl->level; lev--) {
+		pte_t pde = pmtab[PDX(lev, pl->va)];
+		if ((pde & PTE_REMOTE) || PTE_ADDR(pde) == PTE_ZERO)
+			return;
+		pmtab = mem_ptr(PTE_ADDR(pde));
+	}
+	pte_t *pte = &pmtab[PDX(lev, pl->va)];
+	if (*pte != pl->rr)
+		return;	// Keep our ref: the page stays tracked by its RR
+
+	*pte = mem_phys(pl->pg) | (pl->rr & RR_RW);
+	if (pl->level > 0 || pl->rr & SYS_READ)
+		*pte |= PTE_P | PTE_U;	// make it readable (but read-only)
+}
+
+// Walk process p's address space from p->pullva,
+// prefetching remote pages until the pull window is full.
+// We can't walk below a page table that is still on its way,
+// so the walk pauses whenever it reaches such a pull.
+// One window slot is left free for demand pulls from net_pullfault().
+// Returns true once the entire address space is local.
+bool
+net_pullwalk(proc *p)
+{
+	assert(spinlock_holding(&net_lock));
+
+	int win = MIN(net_pullwin, PROC_PULLWIN-1);
+	while (p->pullva < VM_USERHI && p->npull < win) {
+
+		// Pull or traverse the page map tables down to the page table.
+		pte_t *pmtab = p->pml4;
+		int lev;
+		for (lev = NPTLVLS; lev > 0; lev--) {
+			pte_t *pde = &pmtab[PDX(lev, p->pullva)];
+			if ((*pde & PTE_REMOTE) &&
+					!net_pullpte(p, pde, lev, p->pullva))
+				return 0;	// Wait for the table to arrive.
+			if (PTE_ADDR(*pde) == PTE_ZERO)
+				break;		// Nothing mapped below here
+			pmtab = mem_ptr(PTE_ADDR(*pde));
+		}
+		if (lev > 0) {		// Skip the whole empty region
+			p->pullva = PDADDR(lev, p->pullva) + PDSIZE(lev);
 			continue;
 		}
-		assert(PGADDR(*pde) != 0);
-		uint32_t *ptab = mem_ptr(PGADDR(*pde));
 
 		// Pull or traverse PTE to find page.
-		uint32_t *pte = &ptab[PDX(0, p->pullva)];
-		if (*pte & PTE_REMOTE) {	// Need to pull remote page?
-			if (!net_pullpte(p, pte, PGLEV_PAGE))
-				return;	// Wait for the pull to complete.
+		// Page pulls needn't complete before we move on.
+		pte_t *pte = &pmtab[PDX(0, p->pullva)];
+		if (*pte & PTE_REMOTE)		// Need to pull remote page?
+			net_pullpte(p, pte, 0, p->pullva);
+		p->pullva += PAGESIZE;	// Page is local or on its way.
+	}
+
+	return p->pullva >= VM_USERHI && p->npull == 0;
+}
+
+// Handle a page fault at 'fva' that hit a non-present page map entry,
+// either in user mode or in usercopy() on behalf of a system call.
+// If the entry on the way to 'fva' is a remote reference
+// that the migrating proc hasn't pulled yet, pull just that page or table
+// and block the proc until it arrives, then replay the faulting instruction
+// (or system call), while net_pullwalk() goes on prefetching the rest
+// in the background.
+// Returns only if there's no remote reference in the way.
+void
+net_pullfault(trapframe *tf, uintptr_t fva)
+{
+	proc *p = proc_cur();
+	if (p == NULL || !p->pulling)
+		return;
+
+	spinlock_acquire(&net_lock);
+
+	// First install whatever arrived while we were running,
+	// since that may well include the page we need.
+	if (net_pullland(p)) {
+		spinlock_release(&net_lock);
+		net_pulldone(p);
+		trap_return(tf);	// Retry with everything local
+	}
+
+	bool fixed = 0;
+	pte_t *pmtab = p->pml4;
+	int lev;
+	for (lev = NPTLVLS; lev >= 0; lev--) {
+		pte_t *pte = &pmtab[PDX(lev, fva)];
+		if (*pte & PTE_REMOTE) {
+			intptr_t rr = *pte;
+			if (!net_pullpte(p, pte, lev, fva)) {
+				// Sleep until the pull completes,
+				// then replay the instruction that faulted -
+				// or if usercopy() did, the whole system call.
+				p->state = PROC_PULL;
+				p->pullwait = rr;
+				if (tf->cs & 3)
+					proc_save(p, tf, -1);
+				else
+					proc_save(p, cpu_cur()->recoverdata, 0);
+				net_txpullrq(p, 0);
+				spinlock_release(&net_lock);
+				proc_sched();
+			}
+			fixed = 1;	// Resolved the RR locally
 		}
-		assert(!(*pte & PTE_REMOTE));
-		assert(PGADDR(*pte) != 0);
-		p->pullva += PAGESIZE;	// Page is local - move to next.
+		if (lev == 0 || !(*pte & PTE_P))
+			break;
+		pmtab = mem_ptr(PTE_ADDR(*pte));
 	}
+	spinlock_release(&net_lock);
 
-	// We've pulled the proc's entire address space: it's ready to go!
-	//cprintf("net_rxpullrp: migration complete\n");
-	proc_ready(p);
+	if (fixed)
+		trap_return(tf);	// Retry with the new mapping
+}
+
+// Make sure no remote references are left in [va,va+size)
+// of proc p's address space, which a system call by the current proc
+// is about to manipulate wholesale with the pmap functions:
+// p is either the current proc or a stopped child it controls.
+// Pulls only what's in the range, as many pages at once as the window allows,
+// and blocks the current proc until the first one arrives,
+// then replays the system call to check the range again.
+// Returns once the whole range is local.
+void
+net_pullrange(trapframe *tf, proc *p, uintptr_t va, size_t size)
+{
+	if (!p->pulling)
+		return;
+
+	spinlock_acquire(&net_lock);
+	if (net_pullland(p)) {
+		spinlock_release(&net_lock);
+		return net_pulldone(p);
+	}
+
+	intptr_t wait = 0;
+	bool full = 0;
+	uintptr_t eva = va + size;
+	while (va < eva && !full) {
+		pte_t *pmtab = p->pml4;
+		int lev;
+		for (lev = NPTLVLS; ; lev--) {
+			pte_t *pte = &pmtab[PDX(lev, va)];
+			if (*pte & PTE_REMOTE) {
+				intptr_t rr = *pte;
+				if (p->npull == PROC_PULLWIN) {
+					full = 1;	// Wait for a free slot
+					if (wait == 0)
+						wait = p->pull[0].rr;
+					break;
+				}
+				if (!net_pullpte(p, pte, lev, va) && wait == 0)
+					wait = rr;
+			}
+			if (lev == 0 || !(*pte & PTE_P)
+					|| PTE_ADDR(*pte) == PTE_ZERO)
+				break;	// Nothing (yet) to walk below here
+			pmtab = mem_ptr(PTE_ADDR(*pte));
+		}
+		va = PDADDR(lev, va) + PDSIZE(lev);
+	}
+	if (wait == 0)
+		return spinlock_release(&net_lock);
+
+	// Sleep until the first pull completes, then try the syscall again.
+	proc *cp = proc_cur();
+	cp->state = PROC_PULL;
+	cp->pullwait = wait;
+	proc_save(cp, tf, 0);
+	net_txpullrq(p, 0);
+	spinlock_release(&net_lock);
+	proc_sched();
+}
+
+// Block the current proc until its migrated address space is entirely local,
+// then resume it at the point indicated by 'entry' as in proc_save().
+// Used before migrating on, since we can't ship off
+// a page map with pulls still outstanding against it.
+// Returns immediately if the proc isn't pulling.
+void
+net_pullsync(trapframe *tf, int entry)
+{
+	proc *p = proc_cur();
+	spinlock_acquire(&net_lock);
+	if (!p->pulling)
+		return spinlock_release(&net_lock);
+
+	p->state = PROC_PULL;
+	p->pullwait = 0;	// No RR: woken when the last pull completes
+	proc_save(p, tf, entry);
+	spinlock_release(&net_lock);
+	proc_sched();
 }
 
-// See if we need to pull a page to fill a given PDE or PTE.
-// Returns false if we started a pull and need to wait until it's finished,
+// See if we need to pull a page to fill a given page map entry,
+// which maps 'va' at page map level 'level' (0 for a PTE).
+// Returns false if a pull is in progress and we need to wait for it,
 // or true if we were able to resolve the RR immediately.
+// The entry keeps holding the RR until the pulled page arrives.
 bool
-net_pullpte(proc *p, uint32_t *pte, int pglevel)
+net_pullpte(proc *p, pte_t *pte, int level, uintptr_t va)
 {
-	uint32_t rr = *pte;
+	intptr_t rr = *pte;
 	assert(rr & RR_REMOTE);
+	int pglevel = level;	// An entry of level n refers to a page of level n
 
 #if SOL >= 5
 	// Don't pull zero pages - just use our own zero page.
@@ -673,6 +1663,12 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
 		return 1;
 	}
 
+	// If we're already pulling this page, just wait for it.
+	int i;
+	for (i = 0; i < p->npull; i++)
+		if (p->pull[i].rr == rr)
+			return 0;
+
 	// If we already have a copy of the page, just reuse it.
 	pageinfo *pi = mem_rrlookup(rr);
 	if (pi != NULL) {
@@ -683,19 +1679,16 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
 		goto ptefixed;
 	}
 
-	// Allocate a page to pull into, and replace the pte with that.
+	// Allocate a page to pull into; net_pullfill() maps it on arrival.
 	pi = mem_alloc(); assert(pi != NULL);
 	mem_incref(pi);
-	*pte = mem_pi2phys(pi) | (rr & RR_RW);
-	if (pglevel > PGLEV_PAGE || rr & SYS_READ)
-		*pte |= PTE_P | PTE_U;	// make it readable (but read-only)
 
 	mem_rrtrack(rr, pi);		// Track page's origin for future reuse
 	pi->shared = 1 << (RRNODE(rr) - 1);	// and that it's shared
 	assert(pi->shared != 0);
 	assert(pi->home == rr);
 
-	net_pull(p, rr, mem_pi2ptr(pi), pglevel);	// go pull the page
+	net_pull(p, rr, mem_pi2ptr(pi), pglevel, level, va); // go pull it
 	return 0;	// Now must wait for pull to complete.
 #else	// ! SOL >= 5
 	// Lab 5: Examine an RR that we received in a pdir or ptable,
@@ -94,7 +94,7 @@ typedef struct net_hdr {
 typedef struct net_migrq {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_MIGRQ
-	uint32_t	home;	// Remote ref for proc's home node & physaddr
+	intptr_t	home;	// Remote ref for proc's home node & physaddr
 	intptr_t	pml4;	// Remote ref for proc's page map
 	procstate	save;	// Process's saved user-visible state
 } net_migrq;
@@ -102,17 +102,24 @@ typedef struct net_migrq {
 typedef struct net_migrp {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_MIGRP
-	uint32_t	home;	// Remote ref for proc being acknowledged
+	intptr_t	home;	// Remote ref for proc being acknowledged
 } net_migrp;
 
-// Pull a page from a remote node
+// Pull one or more pages from a remote node
+#define NET_PULLRQMAX	16		// Max pages requested in one message
 typedef struct net_pullrq {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_PULLRQ
-	intptr_t	rr;	// Remote ref to pdir, ptab, or page
-	uint8_t		pglev;	// 0=page, 1=page table, 2=page directory
-	uint8_t		need;	// Bits 2-0: which parts of page are needed
+	int		nrq;	// Number of pages requested in rq[] below
+	struct net_pullrqent {
+		intptr_t	rr;	// Remote ref to page map table or page
+		uint8_t		pglev;	// PGLEV_PAGE through PGLEV_PML4
+		uint8_t		need;	// Bits 2-0: which parts are needed
+	} rq[NET_PULLRQMAX];	// Only the first nrq entries are sent
 } net_pullrq;
+#define NET_PULLZOK	0x08		// need: can take an encoded whole page
+#define NET_PULLBIG	0x10		// need: can take a raw page in one packet
+#define NET_PULLDOK	0x20		// need: can take a diff against our page
 
 // Page pull reply - 3 required per page, to fit in Ethernet packet size.
 #define NET_PULLPART	1368		// 1368*3 >= 4096
@@ -124,42 +131,76 @@ typedef struct net_pullrphdr {
 	net_msgtype	type;	// = NET_PULLRP
 	intptr_t	rr;	// Remote reference
 	int		part;	// Which part of the page this is: 0, 1, or 2
+	uint8_t		enc;	// Payload encoding: NET_PULLRAW etc. below
 	char		data[0]; // Variable-length payload follows pullrphdr
 } net_pullrphdr;
 
+// Pull reply payload encodings.  The sender picks one per reply:
+// a page that encodes into a single NET_PULLPART-byte payload
+// is sent whole in one packet; otherwise it goes raw in three parts.
+#define NET_PULLRAW	0		// Raw page part selected by 'part'
+#define NET_PULLRLE	1		// Whole page, repeated-word runs elided
+#define NET_PULLLZ	2		// Whole page, LZ compressed
+#define NET_PULLPAGE	3		// Whole page, raw, in a jumbo frame
+#define NET_PULLDIFF	4		// Changes to a page the requester owns
 
-// 32-bit remote reference layout.
+
+// 64-bit remote reference layout.
 // Note that bit 0, corresponding to PTE_P, must always be zero,
-// so that an RR can coexist with local page refs in page dirs & ptables.
-#define RR_ADDR		0xfffff000	// Page's physical address on home node
-#define RR_REMOTE	0x00000800	// Set to distinguish from a local ref
-#define RR_RW		0x00000600	// Nominal perms for mapping (=SYS_RW)
-#define RR_HOME		0x000001fe	// 8-bit home node
+// so that an RR can coexist with local page refs in page map tables.
+// The address field covers the same physical address bits as PTE_ADDR().
+#define RR_ADDR		0x000ffffffffff000 // Page's physaddr on home node
+#define RR_REMOTE	0x0000000000000800 // Set to distinguish from local ref
+#define RR_RW		0x0000000000000600 // Nominal perms for mapping (=SYS_RW)
+#define RR_HOME		0x00000000000001fe // 8-bit home node
 #define RR_HOMESHIFT		1	// Home node field starts at bit 1
 
 // Macros to construct and extract fields from remote refs
-#define RRCONS(node,addr,perm)	(RR_REMOTE | ((addr) & RR_ADDR) \
-				 | ((uint8_t)(node) << 1) | ((perm) & RR_RW))
+#define RRCONS(node,addr,perm)	(RR_REMOTE | ((intptr_t)(addr) & RR_ADDR) \
+				 | ((intptr_t)(uint8_t)(node) << RR_HOMESHIFT) \
+				 | ((perm) & RR_RW))
 #define RRNODE(rr)		((uint8_t)((rr) >> RR_HOMESHIFT))
 #define RRADDR(rr)		((rr) & RR_ADDR)
 
 #define PTE_REMOTE	RR_REMOTE	// RRs can masquerade as PTEs
 
+// Levels of pages we pull: a page map table of level n holds entries
+// of level n-1 in the PDX() numbering, so an entry of level n
+// refers to a page of level n.
 #define PGLEV_PAGE		0	// Plain data page
-#define PGLEV_PTAB		1	// Page directory
-#define PGLEV_PDIR		2	// Page directory
+#define PGLEV_PTAB		1	// Page table
+#define PGLEV_PML4	(NPTLVLS+1)	// Page map level-4
 
 
 extern uint8_t net_node;	// My node number - from net_mac[5]
 extern uint8_t net_mac[6];	// My MAC address from the Ethernet card
+extern int net_maxpkt;		// Max packet size our network card handles
+
+// Retransmission statistics, counted instead of printed.
+typedef struct net_stats {
+	uint32_t	migrqretx;	// Migrate requests retransmitted
+	uint32_t	pullrqretx;	// Page pulls re-requested after timeout
+	uint32_t	pullnaks;	// Page pulls NACKed for missing parts
+	uint32_t	pulldups;	// Duplicate pull reply parts dropped
+	uint32_t	rttsamples;	// Round-trip time samples taken
+	uint32_t	pulldiffs;	// Pages received as diffs against ours
+} net_stats;
+extern net_stats net_stat;
 
 
 struct trapframe;
+struct proc;
 
 void net_init(void);
 void net_rx(void *ethpkt, int len);
 void net_tick(void);
+void net_poll(void);
+bool net_txtransient(const void *body);
 void gcc_noreturn net_migrate(struct trapframe *tf, uint8_t node, int entry);
+void net_pullfault(struct trapframe *tf, uintptr_t fva);
+void net_pullrange(struct trapframe *tf, struct proc *p,
+			uintptr_t va, size_t size);
+void net_pullsync(struct trapframe *tf, int entry);
 
 #endif // !PIOS_KERN_NET_H
 #endif // LAB >= 2
@@ -24,6 +24,13 @@
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/pmap.h>
+#include <kern/init.h>
+#if LAB >= 5
+#include <kern/net.h>
+#endif
+#if LAB >= 9
+#include <kern/swap.h>
+#endif
 
 // Statically allocated page directory mapping the kernel's address space.
 // We use this as a template for all pdirs for user-level processes.
@@ -108,7 +115,11 @@ pmap_init(void)
 	cr0 &= ~(CR0_EM);
 	lcr0(cr0);
 
+#if LAB >= 9
+	if (cpu_onboot() && init_check) {
+#else
 	if (cpu_onboot()) {
+#endif
 		pmap_check();
 		pmap_check_adv();
 	}
@@ -329,6 +340,9 @@ pmap_walk_level(int pmlevel, pte_t *pmtab, intptr_t la, bool writing)
 			// down to all individual entrys in lower level.
 			int i;
 			for (i = 0; i < NPTENTRIES; i++)
+#if LAB >= 5
+				if (!(plowtab[i] & PTE_REMOTE)) // not yet pulled
+#endif
 				plowtab[i] &= ~PTE_W;
 		} else {
 			// Lower page map table is or may still be shared - must copy.
@@ -343,6 +357,12 @@ pmap_walk_level(int pmlevel, pte_t *pmtab, intptr_t la, bool writing)
 			int i;
 			for (i = 0; i < NPTENTRIES; i++) {
 				intptr_t pte = plowtab[i];
+#if LAB >= 5
+				if (pte & PTE_REMOTE) {	// not yet pulled
+					nplowtab[i] = pte;
+					continue;
+				}
+#endif
 				nplowtab[i] = pte & ~PTE_W;
 				assert(PTE_ADDR(pte) != 0);
 				if (PTE_ADDR(pte) != PTE_ZERO)
@@ -627,8 +647,11 @@ pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab,
 			pmap_remove_level(pmlevel, dpmtab, dva, dva + size);
 		} else {
 			// source is valid, copy it
-			// we must guarantee that lower-level table exists
-			if (PTE_ADDR(*dpmte) == PTE_ZERO) {
+			// we must guarantee that lower-level table exists,
+			// and that it's ours alone: the destination may share
+			// it copy-on-write with an earlier copy's source,
+			// which a copy at other alignments would clobber.
+			if (PTE_ADDR(*dpmte) == PTE_ZERO || !(*dpmte & PTE_W)) {
 				pmap_walk_level(pmlevel, dpmtab, dva, 1);
 			}
 			assert(PTE_ADDR(*dpmte) != PTE_ZERO);
@@ -646,10 +669,24 @@ pmap_copy_level(int pmlevel, pte_t *spmtab, intptr_t sva, pte_t *dpmtab,
 	}
 }
 
+#if LAB >= 9
+// Allocate a frame for one of process p's pages on the NUMA node
+// its memory policy names, or by default, the node of the CPU we're on:
+// the one that just faulted on the page and will most likely use it.
+static pageinfo *
+pmap_allocpage(proc *p)
+{
+	return p->memnode >= 0 ? mem_allocnode(p->memnode) : mem_alloc();
+}
+
+#endif
 //
 // Transparently handle a page fault entirely in the kernel, if possible.
 // If the page fault was caused by a write to a copy-on-write page,
 // then performs the actual page copy on demand and calls trap_return().
+// If the fault hit a remote reference left by process migration,
+// pulls the missing page on demand and resumes the process once it arrives.
+// If it hit a page that was paged out to disk, pages it back in.
 // If the fault wasn't due to the kernel's copy on write optimization,
 // however, this function just returns so the trap gets blamed on the user.
 //
@@ -660,6 +697,23 @@ pmap_pagefault(trapframe *tf)
 	uintptr_t fva = rcr2();
 
 #if SOL >= 3
+#if LAB >= 5
+	// A migrated process may touch a page or page table
+	// that still holds a remote reference we haven't pulled yet,
+	// itself or through a system call copying in or out of user space.
+	// If so, net_pullfault() fetches it and never returns.
+	if (!(tf->err & PFE_PR) && fva >= VM_USERLO && fva < VM_USERHI
+			&& ((tf->err & PFE_U) || cpu_cur()->recover != NULL))
+		net_pullfault(tf, fva);
+#endif
+#if LAB >= 9
+	// Or it or the kernel may touch a page we paged out to disk
+	// under memory pressure.
+	if (!(tf->err & PFE_PR) && fva >= VM_USERLO && fva < VM_USERHI
+			&& swap_fault(proc_cur(), fva))
+		trap_return(tf);
+#endif
+
 	// It can't be our problem unless it's a write fault in user space!
 	if (fva < VM_USERLO || fva >= VM_USERHI || !(tf->err & PFE_WR)) {
 		cprintf("pmap_pagefault: fva %p err %x\n", fva, tf->err);
@@ -688,14 +742,33 @@ pmap_pagefault(trapframe *tf)
 	assert(!(*pte & PTE_W));
 
 	// Find the "shared" page.  If refcount is 1, we have the only ref!
+	// A local copy of a remote page must keep matching its home page,
+	// so we copy that too, remembering the copy's origin:
+	// net_txpullrpz() can then send it home as a diff against the original.
 	intptr_t pg = PTE_ADDR(*pte);
-	if (pg == PTE_ZERO || mem_phys2pi(pg)->refcount > 1) {
+	if (pg == PTE_ZERO || mem_phys2pi(pg)->refcount > 1
+#if LAB >= 5
+			|| mem_phys2pi(pg)->home != 0
+#endif
+			) {
+#if LAB >= 9
+		pageinfo *npi;
+		while ((npi = pmap_allocpage(p)) == NULL)
+			if (!swap_reclaim(p))	// page out some of our own pages
+				panic("pmap_pagefault: out of memory and swap");
+#else
 		pageinfo *npi = mem_alloc(); assert(npi);
+#endif
 		mem_incref(npi);
 		intptr_t npg = mem_pi2phys(npi);
-		memmove((void*)npg, (void*)pg, PAGESIZE); // copy the page
-		if (pg != PTE_ZERO)
+		memmove(mem_ptr(npg), mem_ptr(pg), PAGESIZE); // copy the page
+		if (pg != PTE_ZERO) {
+#if LAB >= 5
+			pageinfo *pi = mem_phys2pi(pg);
+			npi->base = pi->home != 0 ? pi->home : pi->base;
+#endif
 			mem_decref(mem_phys2pi(pg), mem_free); // drop old ref
+		}
 		pg = npg;
 	}
 	*pte = pg | SYS_RW | PTE_A | PTE_D | PTE_W | PTE_U | PTE_P;
@@ -725,14 +798,29 @@ pmap_mergepage(pte_t *rpte, pte_t *spte, pte_t *dpte, intptr_t dva)
 	uint8_t *dpg = mem_ptr(PTE_ADDR(*dpte));
 //	if (mem_phys(dpg) == pmap_zero) return;	// Conflict - just leave dest unmapped
 
-	// Make sure the destination page isn't shared
-	if (mem_phys(dpg) == PTE_ZERO || mem_ptr2pi(dpg)->refcount > 1) {
+	// Make sure the destination page isn't shared,
+	// nor a local copy of a remote page that must keep matching its home:
+	// copy it, remembering its origin, as pmap_pagefault() does.
+	if (mem_phys(dpg) == PTE_ZERO || mem_ptr2pi(dpg)->refcount > 1
+#if LAB >= 5
+			|| mem_ptr2pi(dpg)->home != 0
+#endif
+			) {
+#if LAB >= 9
+		pageinfo *npi = pmap_allocpage(proc_cur()); assert(npi);
+#else
 		pageinfo *npi = mem_alloc(); assert(npi);
+#endif
 		mem_incref(npi);
 		uint8_t *npg = mem_pi2ptr(npi);
 		memmove(npg, dpg, PAGESIZE); // copy the page
-		if (dpg != (uint8_t*)PTE_ZERO)
+		if (mem_phys(dpg) != PTE_ZERO) {
+#if LAB >= 5
+			pageinfo *pi = mem_ptr2pi(dpg);
+			npi->base = pi->home != 0 ? pi->home : pi->base;
+#endif
 			mem_decref(mem_ptr2pi(dpg), mem_free); // drop old ref
+		}
 		dpg = npg;
 		*dpte = mem_phys(npg) |
 			SYS_RW | PTE_A | PTE_D | PTE_W | PTE_U | PTE_P;
@@ -973,8 +1061,12 @@ pmap_check(void)
 	assert(pi4 && pi4 != pi3 && pi4 != pi2 && pi4 != pi1 && pi4 != pi0);
 
 	// temporarily steal the rest of the free pages
+#if LAB >= 9
+	fl = mem_steal();
+#else
 	fl = mem_freelist;
 	mem_freelist = NULL;
+#endif
 
 	// should be no free memory
 	assert(mem_alloc() == NULL);
@@ -1086,7 +1178,7 @@ pmap_check(void)
 	assert(pi1->refcount == 0);
 	assert(mem_alloc() == pi1);
 	assert(mem_alloc() == pi0);
-	assert(mem_freelist == NULL);
+	assert(mem_empty());
 
 	// test pmap_remove with large, non-ptable-aligned regions
 	mem_free(pi1);
@@ -1097,20 +1189,20 @@ pmap_check(void)
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE-PAGESIZE, 0));
 	assert(PTE_ADDR(((pte_t *)PTE_ADDR(pmap_bootpmap[PDX(3, VM_USERLO)]))[PDX(2, VM_USERLO)]) == mem_pi2phys(pi0));
 	assert(PTE_ADDR(((pte_t *)PTE_ADDR(((pte_t *)PTE_ADDR(pmap_bootpmap[PDX(3, VM_USERLO)]))[PDX(2, VM_USERLO)]))[PDX(1, VM_USERLO)]) == mem_pi2phys(pi1));
-	assert(mem_freelist == NULL);
+	assert(mem_empty());
 	mem_free(pi2);
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE, 0));
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE*2-PAGESIZE, 0));
 	assert(PTE_ADDR(((pte_t *)PTE_ADDR(((pte_t *)PTE_ADDR(pmap_bootpmap[PDX(3, VM_USERLO+PTSIZE)]))[PDX(2, VM_USERLO+PTSIZE)]))[PDX(1, VM_USERLO+PTSIZE)]) == mem_pi2phys(pi2));
-	assert(mem_freelist == NULL);
+	assert(mem_empty());
 	mem_free(pi3);
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE*2, 0));
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE*2+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE*3-PAGESIZE*2, 0));
 	assert(pmap_insert(pmap_bootpmap, pi4, va+PTSIZE*3-PAGESIZE, 0));
 	assert(PTE_ADDR(((pte_t *)PTE_ADDR(((pte_t *)PTE_ADDR(pmap_bootpmap[PDX(3, VM_USERLO+PTSIZE*2)]))[PDX(2, VM_USERLO+PTSIZE*2)]))[PDX(1, VM_USERLO+PTSIZE*2)]) == mem_pi2phys(pi3));
-	assert(mem_freelist == NULL);
+	assert(mem_empty());
 	assert(pi0->refcount == 1);
 	assert(pi1->refcount == 1);
 	assert(pi2->refcount == 1);
@@ -1120,18 +1212,18 @@ pmap_check(void)
 	assert(pi4->refcount == 2);
 	assert(pi2->refcount == 0);
 	assert(mem_alloc() == pi2);
-	assert(mem_freelist == NULL);
+	assert(mem_empty());
 	pmap_remove(pmap_bootpmap, va, PTSIZE*3-PAGESIZE);
 	assert(pi4->refcount == 1);
 	assert(pi1->refcount == 0);
 	assert(mem_alloc() == pi1);
-	assert(mem_freelist == NULL);
+	assert(mem_empty());
 	pmap_remove(pmap_bootpmap, va+PTSIZE*3-PAGESIZE, PAGESIZE);
 	assert(pi4->refcount == 0);	// pi3 might or might not also be freed
 	pmap_remove(pmap_bootpmap, va+PAGESIZE, PTSIZE*3);
 	assert(pi3->refcount == 0);
 	mem_alloc(); mem_alloc();	// collect pi4 and pi3
-	assert(mem_freelist == NULL);
+	assert(mem_empty());
 #if 0
 	// check pointer arithmetic in pmap_walk
 	mem_free(pi4);
@@ -1145,7 +1237,11 @@ pmap_check(void)
 	assert(mem_alloc() == pi0);
 
 	// give free list back
+#if LAB >= 9
+	mem_unsteal(fl);
+#else
 	mem_freelist = fl;
+#endif
 
 	// free the pages we filched
 	mem_free(pi0);
@@ -1185,8 +1281,12 @@ pmap_check_adv(void)
 	pi4 = mem_alloc();
 
 	// temporarily steal the rest of the free pages
+#if LAB >= 9
+	fl = mem_steal();
+#else
 	fl = mem_freelist;
 	mem_freelist = NULL;
+#endif
 
 	// free pi0, pi1 and try again: pi0 and pi1 should be used for page table
 	mem_free(pi0);
@@ -1220,7 +1320,11 @@ pmap_check_adv(void)
 	assert(mem_alloc() == NULL);
 
 	// give free list back
+#if LAB >= 9
+	mem_unsteal(fl);
+#else
 	mem_freelist = fl;
+#endif
 
 	// free the pages we filched
 	mem_free(pi0);
@@ -73,6 +73,9 @@ proc_alloc(proc *p, uint32_t cn)
 #if LAB >= 5
 	cp->home = RRCONS(net_node, mem_phys(cp), 0);
 #endif	// LAB >= 5
+#if LAB >= 9
+	cp->memnode = p ? p->memnode : -1;	// inherit parent's policy
+#endif
 
 	// Integer register state
 #if LAB >= 9
@@ -211,6 +214,9 @@ proc_sched(void)
 
 		//cprintf("cpu %d waiting for work\n", cpu_cur()->id);
 		while (!readyhead || cpu_disabled(c)) {	// spin-wait for work
+#if SOL >= 5
+			net_poll();	// service network card if polling
+#endif
 			sti();		// enable device interrupts briefly
 			pause();	// let CPU know we're in a spin loop
 			cli();		// disable interrupts again
@@ -27,6 +27,10 @@
 #define PROC_CHILDREN	256	// Max # of children a process can have
 #endif
 
+#if LAB >= 5
+#define PROC_PULLWIN	16	// Max outstanding page pulls per process
+#endif
+
 typedef enum proc_state {
 	PROC_STOP	= 0,	// Passively waiting for parent to run it
 	PROC_READY,		// Scheduled to run but not running now
@@ -70,20 +74,40 @@ typedef struct proc {
 	uintptr_t	home;		// RR to proc's home node and addr
 	uintptr_t	rrpml4;		// RR to migration source's page dir
 	uint8_t		migrdest;	// Destination we're migrating to
+	uint8_t		migrntx;	// Times migrate request transmitted
+	uint32_t	migrtx;		// net_ticks at last transmission
 	struct proc	*migrnext;	// Next on list of migrating procs
 
 	// Remote reference pulling state.
 	struct proc	*pullnext;	// Next on list of page-pulling procs
 	intptr_t	pullva;		// Where we are pulling in our addr spc
-	intptr_t	pullrr;		// Current RR we are pulling
-	void		*pullpg;	// Local page we are pulling into
-	uint8_t		pglev;		// Level: 0=page, 1=page table, 2=pdir
-	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+	bool		pulling;	// Still prefetching migrated addr spc
+	intptr_t	pullwait;	// RR we're blocked on in PROC_PULL state
+	int		npull;		// Number of pulls outstanding in pull[]
+	struct procpull {
+		intptr_t	rr;	// RR we are pulling
+		void		*pg;	// Local page we are pulling into
+		uintptr_t	va;	// Virtual address the page maps
+		int8_t		level;	// Page map level to fill, -1 for pml4
+		uint8_t		pglev;	// Level: PGLEV_PAGE to PGLEV_PML4
+		uint8_t		arrived; // Bits 0-2: which parts have arrived
+		uint8_t		nakd;	// Parts NACKed since last request
+		uint8_t		ntx;	// Times pull request transmitted
+		uint32_t	txtick;	// net_ticks at last transmission
+	} pull[PROC_PULLWIN];	// Window of pulls in progress
+#if LAB >= 9
+	uint64_t	pullstart;	// timer_read() when migration arrived
+	uint64_t	pullready;	// timer_read() when proc first runnable
+	uint32_t	pullpages;	// Pages pulled so far for this migration
+	uint64_t	pullwire;	// Pull reply payload bytes received
+#endif
 #endif
 #endif	// LAB >= 3
 #if LAB >= 9
 
 	int32_t		pmcmax;		// Max insn count set using perf ctrs
+	int8_t		memnode;	// NUMA node for our pages, -1 for local
+	uint32_t	nswapped;	// Swap PTEs in our pml4 and rpml4
 #endif
 } proc;
 
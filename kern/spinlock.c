@@ -51,6 +51,26 @@ spinlock_acquire(struct spinlock *lk)
 #endif // SOL >= 2
 }
 
+#if LAB >= 5
+// Try once to acquire the lock without spinning,
+// for callers that must not wait on a lock another CPU may hold
+// while it waits on something the caller holds.
+// Returns true if we got the lock.
+int
+spinlock_try(struct spinlock *lk)
+{
+	if(spinlock_holding(lk))
+		panic("recursive spinlock_try");
+
+	if(xchg(&lk->locked, 1) != 0)
+		return 0;
+
+	lk->cpu = cpu_cur();
+	debug_trace(read_rbp(), lk->eips);
+	return 1;
+}
+
+#endif // LAB >= 5
 // Release the lock.
 void
 spinlock_release(struct spinlock *lk)
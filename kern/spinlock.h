@@ -37,6 +37,9 @@ typedef struct spinlock {
 void spinlock_init_(spinlock *lk, const char *file, int line);
 void spinlock_acquire(spinlock *lk);
 void spinlock_release(spinlock *lk);
+#if LAB >= 5
+int spinlock_try(spinlock *lk);
+#endif
 int spinlock_holding(spinlock *lk);
 void spinlock_check();
 
@@ -0,0 +1,460 @@
+#if LAB >= 9
+/*
+ * Demand paging of user memory to disk under memory pressure.
+ *
+ * When physical memory runs out, swap_reclaim() sweeps a clock hand
+ * over the address spaces of processes that can't touch them right now,
+ * giving recently accessed pages a second chance and paging out the rest
+ * to the second IDE disk, one page per 4KB slot.
+ * Pages that turn out to be all zeros go back to being zero mappings
+ * without any I/O.  Pages referenced only by a child's reference snapshot
+ * (its rpml4) are fair game like any other: the child has since moved on
+ * from them, so they are cold until its parent next merges it.
+ *
+ * Only pages with exactly one reference, in page tables with exactly one
+ * reference, are paged out, so a swap PTE never shows up in a page table
+ * shared between address spaces.  Paged-out pages come back on demand
+ * in swap_fault() when the process (or usercopy() on its behalf)
+ * touches them, and in swap_range() for just the part of an address space
+ * a system call is about to manipulate with the pmap functions.
+ * Both directions keep several transfers queued at the disk at once.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/vm.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/proc.h>
+#include <kern/pmap.h>
+#include <kern/swap.h>
+#include <kern/net.h>
+
+#include <dev/ide.h>
+
+
+#define SWAP_SLOTSECS	(PAGESIZE / IDE_SECSIZE) // Disk sectors per slot
+
+swap_stats swap_stat;
+
+static uint32_t swap_nslots;		// Slots on the disk we can use
+static uint8_t swap_slotmap[SWAP_MAXSLOTS/8]; // Bitmap of slots in use
+static uint32_t swap_nextslot;		// Where to start looking for a slot
+static spinlock swap_slotlock;		// Protects the slot bitmap
+
+// A page transfer to or from disk in progress.
+typedef struct swapio {
+	iderq		rq;		// Disk request for the page's slot
+	pte_t		*pte;		// PTE of the page we're transferring
+	pte_t		*pml4;		// Address space the PTE is in
+	uintptr_t	va;		// Virtual address the PTE maps
+	pageinfo	*pi;		// Physical page we're transferring
+} swapio;
+
+static spinlock swap_clocklock;		// Protects the clock hand and outq
+static proc *swap_hand;			// Process the clock hand points into
+static bool swap_handref;		// Pointing into its rpml4, not its pml4
+static uintptr_t swap_handva;		// Next virtual address to look at
+static swapio swap_outq[SWAP_BATCH];	// Page-out writes in progress
+static int swap_nout;
+
+
+void
+swap_init(void)
+{
+	if (!cpu_onboot())
+		return;
+
+	spinlock_init(&swap_slotlock);
+	spinlock_init(&swap_clocklock);
+
+	swap_nslots = MIN(ide_nsecs / SWAP_SLOTSECS, SWAP_MAXSLOTS);
+	swap_slotmap[0] = 1;	// slot 0 is never used
+	swap_nextslot = 1;
+	if (swap_nslots > 0)
+		cprintf("swap: %d MB of swap space\n",
+			(int)((uint64_t)swap_nslots * PAGESIZE >> 20));
+	else
+		warn("swap_init: no swap disk, paging out only zero pages");
+}
+
+// Allocate a free disk slot, returning 0 if the disk is full.
+static uint32_t
+swap_allocslot(void)
+{
+	uint32_t i, slot = 0;
+	spinlock_acquire(&swap_slotlock);
+	for (i = 0; i < swap_nslots; i++) {
+		uint32_t s = (swap_nextslot + i) % swap_nslots;
+		if (!(swap_slotmap[s/8] & (1 << (s%8)))) {
+			swap_slotmap[s/8] |= 1 << (s%8);
+			swap_nextslot = s + 1;
+			slot = s;
+			break;
+		}
+	}
+	spinlock_release(&swap_slotlock);
+	return slot;
+}
+
+static void
+swap_freeslot(uint32_t slot)
+{
+	assert(slot > 0 && slot < swap_nslots);
+	spinlock_acquire(&swap_slotlock);
+	assert(swap_slotmap[slot/8] & (1 << (slot%8)));
+	swap_slotmap[slot/8] &= ~(1 << (slot%8));
+	spinlock_release(&swap_slotlock);
+}
+
+// Find the PTE for *va in address space pml4, provided that every
+// page table on the way down belongs to this address space alone.
+// If not, advance *va past the region the missing or shared table covers
+// and return NULL.
+static pte_t *
+swap_walk(pte_t *pml4, uintptr_t *va)
+{
+	pte_t *pmtab = pml4;
+	int pmlevel;
+	for (pmlevel = NPTLVLS; pmlevel > 0; pmlevel--) {
+		pte_t pmte = pmtab[PDX(pmlevel, *va)];
+		if (!(pmte & PTE_P) || PTE_ADDR(pmte) == PTE_ZERO
+				|| mem_phys2pi(PTE_ADDR(pmte))->refcount != 1) {
+			*va = PDADDR(pmlevel, *va) + PDSIZE(pmlevel);
+			return NULL;
+		}
+		pmtab = mem_ptr(PTE_ADDR(pmte));
+	}
+	return &pmtab[PDX(0, *va)];
+}
+
+// Is this page referenced only by the one mapping we found it through,
+// and not involved in any cross-node sharing?
+static bool
+swap_private(pte_t pte)
+{
+	if (PTE_ADDR(pte) == 0 || PTE_ADDR(pte) == PTE_ZERO
+			|| (pte & (PTE_SWAP | PTE_REMOTE)))
+		return 0;
+	pageinfo *pi = mem_phys2pi(PTE_ADDR(pte));
+	return pi->refcount == 1 && pi->home == 0 && pi->shared == 0
+		&& pi->base == 0;
+}
+
+// Return a PTE mapping physical page 'pg' with nominal permissions 'perm'.
+static pte_t
+swap_mkpte(intptr_t pg, pte_t perm)
+{
+	return pg | perm | (perm & SYS_READ ? PTE_U | PTE_P | PTE_A : 0);
+}
+
+// Start paging out the page that *pte maps in address space pml4,
+// returning true if it will be freed by the next swap_flush().
+// All-zero pages we remap to the zero page and free right away.
+static bool
+swap_out(pte_t *pml4, uintptr_t va, pte_t *pte)
+{
+	pageinfo *pi = mem_phys2pi(PTE_ADDR(*pte));
+	uint64_t *pg = mem_pi2ptr(pi);
+
+	int i;
+	for (i = 0; i < PAGESIZE/8 && pg[i] == 0; i++)
+		;
+	if (i == PAGESIZE/8) {
+		*pte = swap_mkpte(PTE_ZERO, *pte & SYS_RW);
+		pmap_inval(pml4, va, PAGESIZE);
+		mem_decref(pi, mem_free);
+		swap_stat.zeroed++;
+		return 1;
+	}
+
+	uint32_t slot = swap_allocslot();
+	if (slot == 0)
+		return 0;	// out of swap space
+	assert(swap_nout < SWAP_BATCH);
+	swapio *io = &swap_outq[swap_nout++];
+	io->pte = pte;
+	io->pml4 = pml4;
+	io->va = va;
+	io->pi = pi;
+	io->rq.secno = slot * SWAP_SLOTSECS;
+	io->rq.nsecs = SWAP_SLOTSECS;
+	io->rq.write = 1;
+	io->rq.buf = pg;
+	ide_submit(&io->rq);
+	return 1;
+}
+
+// Wait for the page-out writes we started for process p to finish,
+// then replace the pages with swap PTEs and free them.
+// Returns the number of pages we failed to write out after all.
+static int
+swap_flush(proc *p)
+{
+	int i, failed = 0;
+	for (i = 0; i < swap_nout; i++) {
+		swapio *io = &swap_outq[i];
+		uint32_t slot = io->rq.secno / SWAP_SLOTSECS;
+		ide_await(&io->rq);
+		if (!io->rq.ok) {
+			warn("swap_flush: error writing slot %d", slot);
+			swap_freeslot(slot);
+			failed++;
+			continue;
+		}
+		*io->pte = (pte_t)slot << PAGESHIFT | PTE_SWAP
+				| (*io->pte & SYS_RW);
+		pmap_inval(io->pml4, io->va, PAGESIZE);
+		mem_decref(io->pi, mem_free);
+		p->nswapped++;
+		swap_stat.out++;
+	}
+	swap_nout = 0;
+	return failed;
+}
+
+// Allocate a page for swap PTE *pte in process p and start reading it in,
+// returning false if there's no memory for it.
+static bool
+swap_startin(proc *p, pte_t *pte, swapio *io)
+{
+	assert(*pte & PTE_SWAP);
+	pageinfo *pi = p->memnode >= 0 ? mem_allocnode(p->memnode)
+					: mem_alloc();
+	if (pi == NULL)
+		return 0;
+	io->pte = pte;
+	io->pi = pi;
+	io->rq.secno = (PTE_ADDR(*pte) >> PAGESHIFT) * SWAP_SLOTSECS;
+	io->rq.nsecs = SWAP_SLOTSECS;
+	io->rq.write = 0;
+	io->rq.buf = mem_pi2ptr(pi);
+	ide_submit(&io->rq);
+	return 1;
+}
+
+// Wait for a page-in read to finish and map the page in place of its swap PTE.
+static void
+swap_endin(proc *p, swapio *io)
+{
+	uint32_t slot = io->rq.secno / SWAP_SLOTSECS;
+	ide_await(&io->rq);
+	if (!io->rq.ok)
+		panic("swap_endin: error reading slot %d", slot);
+	mem_incref(io->pi);
+
+	// Map it read-only: a write fault makes it writable,
+	// since we hold the only reference to it.
+	*io->pte = swap_mkpte(mem_pi2phys(io->pi), *io->pte & SYS_RW);
+	swap_freeslot(slot);
+	p->nswapped--;
+	swap_stat.in++;
+}
+
+// Sweep the clock hand over address space pml4,
+// from *va up to the end of user space or until we've freed 'need' pages.
+// Returns the number of pages freed or on their way out.
+static int
+swap_scan(pte_t *pml4, uintptr_t *va, int need)
+{
+	int freed = 0;
+	while (*va < VM_USERHI && freed < need) {
+		pte_t *pte = swap_walk(pml4, va);
+		if (pte == NULL)
+			continue;
+		uintptr_t pva = *va;
+		*va += PAGESIZE;
+		if (!swap_private(*pte))
+			continue;
+		swap_stat.scanned++;
+
+		// Give recently used pages a second chance.
+		if (*pte & PTE_A) {
+			*pte &= ~PTE_A;
+			pmap_inval(pml4, pva, PAGESIZE);
+			continue;
+		}
+		if (!swap_out(pml4, pva, pte))
+			break;
+		freed++;
+	}
+	return freed;
+}
+
+// Try to make sure no one else will touch process p's address spaces
+// until we're done paging them out.  That holds for 'self' as long as
+// it is in a page fault, even one in usercopy() during a system call,
+// rather than in the middle of a page map operation,
+// for its stopped children, for processes waiting on a child,
+// and for stopped children of those: we hold the waiting process's lock
+// so no child can wake it up in the meantime.
+// Returns false if p isn't safe to page out right now;
+// otherwise returns true with the lock we took, if any, in *lk.
+static bool
+swap_lockproc(proc *p, proc *self, spinlock **lk)
+{
+	*lk = NULL;
+	if (p->pulling)
+		return 0;	// still has migration work in its page tables
+	if (RRNODE(p->home) != net_node)
+		return 0;	// must be able to ship its pages back home
+	if (self != NULL && (p == self
+			|| (p->parent == self && p->state == PROC_STOP)))
+		return 1;
+
+	proc *wp = p->state == PROC_STOP ? p->parent : p;
+	if (wp == NULL || wp->state != PROC_WAIT
+			|| spinlock_holding(&wp->lock) || !spinlock_try(&wp->lock))
+		return 0;
+	if (wp->state != PROC_WAIT || p->state != (wp == p ? PROC_WAIT
+							: PROC_STOP)) {
+		spinlock_release(&wp->lock);
+		return 0;
+	}
+	*lk = &wp->lock;
+	return 1;
+}
+
+// Return the process after p in a depth-first walk of the process tree,
+// wrapping around to the root after the last one.
+static proc *
+swap_nextproc(proc *p)
+{
+	int i;
+	for (i = 0; i < PROC_CHILDREN; i++)	// first child, if any
+		if (p->child[i])
+			return p->child[i];
+	while (p->parent) {		// else next sibling of p or an ancestor
+		proc *pp = p->parent;
+		for (i = 0; i < PROC_CHILDREN && pp->child[i] != p; i++)
+			;
+		for (i++; i < PROC_CHILDREN; i++)
+			if (pp->child[i])
+				return pp->child[i];
+		p = pp;
+	}
+	return p;
+}
+
+// Page out up to SWAP_BATCH pages to free up physical memory.
+// The current process passes itself as 'self' from a page fault,
+// which lets us take pages from its own address spaces too.
+// Returns the number of pages freed.
+int
+swap_reclaim(proc *self)
+{
+	if (proc_root == NULL)
+		return 0;	// no user processes yet
+
+	int freed = 0, wraps = 0;
+	spinlock_acquire(&swap_clocklock);
+	swap_stat.passes++;
+	if (swap_hand == NULL)
+		swap_hand = proc_root, swap_handva = VM_USERLO;
+
+	// Go around the process tree at least once in full,
+	// so pages we clear the accessed bit on get a second look.
+	while (freed < SWAP_BATCH && wraps < 3) {
+		proc *p = swap_hand;
+		spinlock *lk;
+		if (swap_lockproc(p, self, &lk)) {
+			if (!swap_handref) {
+				freed += swap_scan(p->pml4, &swap_handva,
+							SWAP_BATCH - freed);
+				if (swap_handva >= VM_USERHI)
+					swap_handref = 1,
+					swap_handva = VM_USERLO;
+			}
+			if (swap_handref)
+				freed += swap_scan(p->rpml4, &swap_handva,
+							SWAP_BATCH - freed);
+			freed -= swap_flush(p);
+			if (lk)
+				spinlock_release(lk);
+			if (swap_handva < VM_USERHI)
+				break;	// pick up here next time
+		}
+		swap_hand = swap_nextproc(p);
+		swap_handref = 0;
+		swap_handva = VM_USERLO;
+		if (swap_hand == proc_root)
+			wraps++;
+	}
+
+	if (freed == 0)
+		swap_stat.failed++;
+	spinlock_release(&swap_clocklock);
+	return freed;
+}
+
+// Handle a page fault at va in process p's address space,
+// from user mode or from the kernel accessing user memory,
+// returning true if it was on a paged-out page that we've now paged in.
+// Returns false if we're out of both memory and swap space,
+// so the fault gets blamed on the process instead of panicking the kernel.
+bool
+swap_fault(proc *p, uintptr_t va)
+{
+	if (p == NULL || p->nswapped == 0)
+		return 0;
+	uintptr_t wva = va;
+	pte_t *pte = swap_walk(p->pml4, &wva);
+	if (pte == NULL || !(*pte & PTE_SWAP))
+		return 0;
+
+	swapio io;
+	while (!swap_startin(p, pte, &io))
+		if (!swap_reclaim(p)) {
+			warn("swap_fault: out of memory and swap space");
+			return 0;
+		}
+	swap_endin(p, &io);
+	return 1;
+}
+
+// Page in whatever process p has paged out of [va,va+size)
+// in its address space pml4 (its pml4 or rpml4),
+// keeping up to IDE_QLEN reads going at once.
+// The process must be the current one or a stopped child of it.
+// Returns false if we ran out of memory before paging it all in.
+bool
+swap_range(proc *p, pte_t *pml4, uintptr_t va, size_t size)
+{
+	uintptr_t eva = va + size;
+	swapio io[IDE_QLEN];
+	bool ok = 1;
+	while (va < eva && p->nswapped > 0 && ok) {
+		int j, n = 0;
+		while (n < IDE_QLEN && n < p->nswapped && va < eva) {
+			pte_t *pte = swap_walk(pml4, &va);
+			if (pte == NULL)
+				continue;
+			va += PAGESIZE;
+			if (!(*pte & PTE_SWAP))
+				continue;
+			if (!(ok = swap_startin(p, pte, &io[n])))
+				break;
+			n++;
+		}
+		for (j = 0; j < n; j++)
+			swap_endin(p, &io[j]);
+	}
+	return ok;
+}
+
+// Page in everything process p has paged out, in both its address spaces,
+// before we ship it off to another node.
+// Returns false if we ran out of memory before paging it all in.
+bool
+swap_sync(proc *p)
+{
+	return swap_range(p, p->pml4, VM_USERLO, VM_USERHI-VM_USERLO)
+		&& swap_range(p, p->rpml4, VM_USERLO, VM_USERHI-VM_USERLO);
+}
+
+#endif	// LAB >= 9
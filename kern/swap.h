@@ -0,0 +1,52 @@
+#if LAB >= 9
+/*
+ * Demand paging of user memory to disk under memory pressure.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_SWAP_H
+#define PIOS_KERN_SWAP_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/pmap.h>
+
+
+// A page we have paged out leaves behind a non-present "swap PTE"
+// holding the page's disk slot number in the PTE_ADDR part,
+// the page's nominal permissions in SYS_RW, and PTE_SWAP
+// in one of the bits above the physical address that the MMU ignores.
+// Swap PTEs appear only in page tables private to one address space,
+// and the kernel pages them back in before a system call
+// copies, merges, or otherwise looks inside that part of the address space.
+#define PTE_SWAP	((pte_t)1 << 52)
+
+#define SWAP_MAXSLOTS	(1 << 18)	// Most slots we use: 1GB of disk
+#define SWAP_BATCH	64		// Pages to page out per reclaim pass
+
+// Paging statistics, for tuning.
+typedef struct swap_stats {
+	uint64_t	out;		// Pages written to disk
+	uint64_t	in;		// Pages read back from disk
+	uint64_t	zeroed;		// All-zero pages dropped without I/O
+	uint64_t	scanned;	// Candidate PTEs examined
+	uint64_t	passes;		// Reclaim passes run
+	uint64_t	failed;		// Passes that freed nothing
+} swap_stats;
+extern swap_stats swap_stat;
+
+
+struct proc;
+
+void swap_init(void);
+int swap_reclaim(struct proc *self);
+bool swap_fault(struct proc *p, uintptr_t va);
+bool swap_range(struct proc *p, pte_t *pml4, uintptr_t va, size_t size);
+bool swap_sync(struct proc *p);
+
+#endif // !PIOS_KERN_SWAP_H
+#endif // LAB >= 9
@@ -24,6 +24,7 @@
 #endif
 
 #if LAB >= 9
+#include <kern/swap.h>
 #include <dev/timer.h>
 #endif
 
@@ -116,6 +117,7 @@ void usercopy(trapframe *utf, bool copyout,
 	cpu *c = cpu_cur();
 	assert(c->recover == NULL);
 	c->recover = sysrecover;
+	c->recoverdata = utf;
 
 	//pmap_inval(proc_cur()->pml4, VM_USERLO, VM_USERHI-VM_USERLO);
 
@@ -131,6 +133,27 @@ void usercopy(trapframe *utf, bool copyout,
 #endif
 }
 
+#if SOL >= 3
+// Make sure [va,va+size) of address space pml4 belonging to process p
+// is all here before we operate on it with the pmap functions:
+// p may have just migrated here and still be pulling it,
+// or may have paged some of it out to disk.
+// Waiting for a pull blocks us and replays the system call;
+// running out of memory to page it in fails the system call.
+static void
+sysmemin(trapframe *tf, proc *p, pte_t *pml4, uintptr_t va, size_t size)
+{
+#if SOL >= 5
+	if (pml4 == p->pml4)
+		net_pullrange(tf, p, va, size);
+#endif
+#if LAB >= 9
+	if (p->nswapped && !swap_range(p, pml4, va, size))
+		systrap(tf, T_PGFLT, 0);
+#endif
+}
+
+#endif	// SOL >= 3
 static void
 do_cputs(trapframe *tf, uint32_t cmd)
 {
@@ -159,8 +182,14 @@ do_put(trapframe *tf, uint32_t cmd)
 	// First migrate if we need to.
 	uint8_t node = (tf->rdx >> 8) & 0xff;
 	if (node == 0) node = RRNODE(p->home);		// Goin' home
-	if (node != net_node)
+	if (node != net_node) {
+#if LAB >= 9
+		// We can't ship pages that are out on our disk.
+		if (p->nswapped && !swap_sync(p))
+			systrap(tf, T_PGFLT, 0);
+#endif
 		net_migrate(tf, node, 0);	// abort syscall and migrate
+	}
 
 #endif // SOL >= 5
 	spinlock_acquire(&p->lock);
@@ -236,6 +265,9 @@ do_put(trapframe *tf, uint32_t cmd)
 				|| size > VM_USERHI-dva)
 			systrap(tf, T_GPFLT, 0);
 
+		if ((cmd & SYS_MEMOP) == SYS_COPY)
+			sysmemin(tf, p, p->pml4, sva, size);
+		sysmemin(tf, cp, cp->pml4, dva, size);
 		switch (cmd & SYS_MEMOP) {
 		case SYS_ZERO:	// zero memory and clear permissions
 			pmap_remove(cp->pml4, dva, size);
@@ -255,13 +287,17 @@ do_put(trapframe *tf, uint32_t cmd)
 				|| dva < VM_USERLO || dva > VM_USERHI
 				|| size > VM_USERHI-dva)
 			systrap(tf, T_GPFLT, 0);
+		sysmemin(tf, cp, cp->pml4, dva, size);
 		if (!pmap_setperm(cp->pml4, dva, size, cmd & SYS_RW))
 			panic("pmap_put: no memory to set permissions");
 	}
 
-	if (cmd & SYS_SNAP)	// Snapshot child's state
+	if (cmd & SYS_SNAP) {	// Snapshot child's state
+		sysmemin(tf, cp, cp->pml4, VM_USERLO, VM_USERHI-VM_USERLO);
+		sysmemin(tf, cp, cp->rpml4, VM_USERLO, VM_USERHI-VM_USERLO);
 		pmap_copy(cp->pml4, VM_USERLO, cp->rpml4, VM_USERLO,
 				VM_USERHI-VM_USERLO);
+	}
 
 #endif	// SOL >= 3
 	// Start the child if requested
@@ -282,8 +318,14 @@ do_get(trapframe *tf, uint32_t cmd)
 	// First migrate if we need to.
 	uint8_t node = (tf->rdx >> 8) & 0xff;
 	if (node == 0) node = RRNODE(p->home);		// Goin' home
-	if (node != net_node)
+	if (node != net_node) {
+#if LAB >= 9
+		// We can't ship pages that are out on our disk.
+		if (p->nswapped && !swap_sync(p))
+			systrap(tf, T_PGFLT, 0);
+#endif
 		net_migrate(tf, node, 0);	// abort syscall and migrate
+	}
 
 #endif // SOL >= 5
 	spinlock_acquire(&p->lock);
@@ -346,6 +388,11 @@ do_get(trapframe *tf, uint32_t cmd)
 				|| size > VM_USERHI-dva)
 			systrap(tf, T_GPFLT, 0);
 
+		if ((cmd & SYS_MEMOP) != SYS_ZERO)
+			sysmemin(tf, cp, cp->pml4, sva, size);
+		if ((cmd & SYS_MEMOP) == SYS_MERGE)
+			sysmemin(tf, cp, cp->rpml4, sva, size);
+		sysmemin(tf, p, p->pml4, dva, size);
 		switch (cmd & SYS_MEMOP) {
 		case SYS_ZERO:	// zero memory and clear permissions
 			pmap_remove(p->pml4, dva, size);
@@ -369,6 +416,7 @@ do_get(trapframe *tf, uint32_t cmd)
 				|| dva < VM_USERLO || dva > VM_USERHI
 				|| size > VM_USERHI-dva)
 			systrap(tf, T_GPFLT, 0);
+		sysmemin(tf, p, p->pml4, dva, size);
 		if (!pmap_setperm(p->pml4, dva, size, cmd & SYS_RW))
 			panic("pmap_get: no memory to set permissions");
 	}
@@ -409,6 +457,18 @@ do_ncpu(trapframe *tf)
 	cprintf("do_ncpu: CPU limit now %d\n", cpu_limit);
 	trap_return(tf);
 }
+
+static void gcc_noreturn
+do_memnode(trapframe *tf)
+{
+	int node = tf->rcx;
+	if (node >= -1 && node < mem_nnodes)
+		proc_cur()->memnode = node;
+	else
+		warn("do_memnode: bad NUMA node %d", node);
+	tf->rax = mem_nnodes;
+	trap_return(tf);
+}
 #endif
 #endif	// SOL >= 2
 
@@ -429,6 +489,7 @@ syscall(trapframe *tf)
 #if LAB >= 9
 	case SYS_TIME:	return do_time(tf);
 	case SYS_NCPU:	return do_ncpu(tf);
+	case SYS_MEMNODE: return do_memnode(tf);
 #endif
 #else	// not SOL >= 2
 	// Your implementations of SYS_PUT, SYS_GET, SYS_RET here...
@@ -34,6 +34,7 @@
 #if LAB >= 9
 #include <dev/timer.h>
 #include <dev/pmc.h>
+#include <dev/ide.h>
 #endif
 #include <dev/lapic.h>
 #if LAB >= 4
@@ -42,6 +43,7 @@
 #endif
 #if LAB >= 5
 #include <dev/e100.h>
+#include <dev/vnet.h>
 #endif
 #endif // LAB >= 2
 
@@ -321,7 +323,7 @@ trap(trapframe *tf)
 		serial_intr();
 		trap_return(tf);
 #endif // SOL >= 4
-#if LAB >= 99
+#if LAB >= 9
 	case T_IRQ0 + IRQ_IDE:
 		ide_intr();
 		lapic_eoi();
@@ -385,6 +387,13 @@ trap(trapframe *tf)
 #endif	// LAB >= 9
 	}
 #if SOL >= 5
+	if (vnet_present && tf->trapno == T_IRQ0 + vnet_irq) {
+		vnet_intr();
+		if (e100_present && e100_irq == vnet_irq)
+			e100_intr();	// shared legacy interrupt line
+		lapic_eoi();
+		trap_return(tf);
+	}
 	if (tf->trapno == T_IRQ0 + e100_irq) {
 		e100_intr();
 		lapic_eoi();
@@ -79,6 +79,74 @@ bench_join(uint8_t child)
 	}
 }
 
+// Arguments each node of a fork tree needs to start its own subtree.
+struct treeargs {
+	int	node;			// This node: 0 is the caller, n >= 1 runs
+	int	nchildren;		// Total number of nodes that run 'fun'
+	void	*(*fun)(void *);	// Function each node runs...
+	void	**args;			// ...on argument args[node-1]
+};
+
+static void *bench_treenode(void *arg);
+
+// Fork the children of fork tree node 'ta->node',
+// using this process's child slots 0 through BENCH_TREEFANOUT-1.
+static void
+bench_treespawn(struct treeargs *ta)
+{
+	struct treeargs ca = *ta;
+	int c;
+	for (c = 0; c < BENCH_TREEFANOUT; c++) {
+		ca.node = ta->node * BENCH_TREEFANOUT + 1 + c;
+		if (ca.node > ta->nchildren)
+			break;
+		bench_fork(c, bench_treenode, &ca);
+	}
+}
+
+// Join the children of a fork tree node, merging in their whole subtrees.
+static void
+bench_treejoin(int node, int nchildren)
+{
+	int c;
+	for (c = 0; c < BENCH_TREEFANOUT; c++) {
+		if (node * BENCH_TREEFANOUT + 1 + c > nchildren)
+			break;
+		bench_join(c);
+	}
+}
+
+// Body of each fork tree node: start our subtree before doing our own work,
+// so that each level of the tree gets going in parallel on other CPUs,
+// then merge our subtree's results into ours on the way back up.
+static void *
+bench_treenode(void *arg)
+{
+	struct treeargs ta = *(struct treeargs*)arg;
+	bench_treespawn(&ta);
+	ta.fun(ta.args[ta.node - 1]);
+	bench_treejoin(ta.node, ta.nchildren);
+	return NULL;
+}
+
+// Start 'nchildren' children running fun(args[i]) for i in 0..nchildren-1,
+// as a fork tree of depth log(nchildren) rooted at the caller,
+// instead of forking every child serially from the caller.
+void
+bench_forktree(int nchildren, void *(*fun)(void *), void **args)
+{
+	struct treeargs ta = { 0, nchildren, fun, args };
+	bench_treespawn(&ta);
+}
+
+// Wait for a fork tree started with bench_forktree() to finish,
+// merging in all the children's results.
+void
+bench_jointree(int nchildren)
+{
+	bench_treejoin(0, nchildren);
+}
+
 uint64_t
 bench_time(void)
 {
@@ -121,6 +189,23 @@ bench_join(uint8_t child)
 	tforked[child] = 0;
 }
 
+// Threads are cheap to create here, so just start them all directly.
+void
+bench_forktree(int nchildren, void *(*fun)(void *), void **args)
+{
+	int i;
+	for (i = 0; i < nchildren; i++)
+		bench_fork(i, fun, args[i]);
+}
+
+void
+bench_jointree(int nchildren)
+{
+	int i;
+	for (i = 0; i < nchildren; i++)
+		bench_join(i);
+}
+
 uint64_t
 bench_time(void)
 {
@@ -14,6 +14,11 @@
 #include <inc/string.h>
 #include <inc/assert.h>
 #include <inc/dirent.h>
+#if LAB >= 9
+#include <inc/syscall.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#endif
 
 
 int
@@ -37,6 +42,13 @@ dir_walk(const char *path, mode_t createmode)
 
 	// Look for a regular directory entry with a matching name.
 	int ino, len;
+#if LAB >= 9
+	for (len = 0; path[len] != 0 && path[len] != '/'; len++)
+		;
+	ino = fileino_lookup(files, dino, path, len);
+	if (ino != 0)
+		goto found;
+#else
 	for (ino = 1; ino < FILE_INODES; ino++) {
 		if (!fileino_alloced(ino) || files->fi[ino].dino != dino)
 			continue;	// not an entry in directory 'dino'
@@ -45,41 +57,11 @@ dir_walk(const char *path, mode_t createmode)
 		len = strlen(files->fi[ino].de.d_name);
 		if (memcmp(path, files->fi[ino].de.d_name, len) != 0)
 			continue;	// no match
-		found:
-		if (path[len] == 0) {
-			// Exact match at end of path - but does it exist?
-			if (fileino_exists(ino))
-				return ino;	// yes - return it
-
-			// no - existed, but was deleted.  re-create?
-			if (!createmode) {
-				errno = ENOENT;
-				return -1;
-			}
-			files->fi[ino].ver++;	// an exclusive change
-			files->fi[ino].mode = createmode;
-			files->fi[ino].size = 0;
-			return ino;
-		}
-		if (path[len] != '/')
+		if (path[len] != 0 && path[len] != '/')
 			continue;	// no match
-
-		// Make sure this dirent refers to a directory
-		if (!fileino_isdir(ino)) {
-			errno = ENOTDIR;
-			return -1;
-		}
-
-		// Skip slashes to find next component
-		do { len++; } while (path[len] == '/');
-		if (path[len] == 0)
-			return ino;	// matched directory at end of path
-
-		// Walk the next directory in the path
-		dino = ino;
-		path += len;
-		goto searchdir;
+		goto found;
 	}
+#endif
 
 	// Looking for one of the special entries '.' or '..'?
 	if (path[0] == '.' && (path[1] == 0 || path[1] == '/')) {
@@ -114,7 +96,48 @@ dir_walk(const char *path, mode_t createmode)
 	files->fi[ino].ver = 0;
 	files->fi[ino].mode = createmode;
 	files->fi[ino].size = 0;
+#if LAB >= 9
+	fileino_hashin(files, ino);
+	fileino_dirty(ino);
+#endif
 	return ino;
+
+	found:
+	// Entry 'ino' matches the next 'len' bytes of our path.
+	if (path[len] == 0) {
+		// Exact match at end of path - but does it exist?
+		if (fileino_exists(ino))
+			return ino;	// yes - return it
+
+		// no - existed, but was deleted.  re-create?
+		if (!createmode) {
+			errno = ENOENT;
+			return -1;
+		}
+		files->fi[ino].ver++;	// an exclusive change
+		files->fi[ino].mode = createmode;
+		files->fi[ino].size = 0;
+#if LAB >= 9
+		fileino_dirty(ino);
+#endif
+		return ino;
+	}
+
+	// Make sure this dirent refers to a directory
+	if (!fileino_isdir(ino)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	// Skip slashes to find next component
+	do { len++; } while (path[len] == '/');
+	if (path[len] == 0)
+		return ino;	// matched directory at end of path
+
+	// Walk the next directory in the path
+	dino = ino;
+	path += len;
+	goto searchdir;
 }
 
 // Open a directory for scanning.
@@ -185,16 +208,68 @@ long telldir(DIR *dir)
 }
 
 #if LAB >= 9
+// Rename a regular file.  Inode names never change once allocated,
+// since reconcile() matches inodes across processes by name,
+// so we move the content to the inode for 'newpath' (creating it if needed)
+// and delete 'oldpath', leaving the directory index untouched.
 int rename(const char *oldpath, const char *newpath)
 {
-	panic("rename() not implemented");
+	int oino = dir_walk(oldpath, 0);
+	if (oino < 0)
+		return -1;
+	fileinode *ofi = &files->fi[oino];
+	if (oino < FILEINO_GENERAL || !S_ISREG(ofi->mode)) {
+		errno = EPERM;	// can't move directories or special files
+		return -1;
+	}
+
+	int nino = dir_walk(newpath, ofi->mode);
+	if (nino < 0)
+		return -1;
+	if (nino == oino)
+		return 0;	// same file - nothing to do
+	fileinode *nfi = &files->fi[nino];
+	if (nino < FILEINO_GENERAL || !S_ISREG(nfi->mode)) {
+		errno = EISDIR;
+		return -1;
+	}
+
+	// Move the old file's content pages copy-on-write
+	// via our scratch child 0, rather than copying bytes.
+	size_t size = ofi->size;
+	size_t pagelim = ROUNDUP(size, PAGESIZE);
+	fileino_truncate(nino, 0);
+	if (pagelim > 0) {
+		sys_put(SYS_COPY, 0, NULL, FILEDATA(oino),
+			(void*)VM_SCRATCHLO, pagelim);
+		sys_get(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
+			FILEDATA(nino), pagelim);
+	}
+	nfi->size = size;
+	nfi->mode = ofi->mode;
+
+	// Delete the old name, as unlink() would.
+	fileino_truncate(oino, 0);
+	ofi->mode = 0;
+	return 0;
 }
 
+// Delete a regular file.  The inode stays allocated under its name,
+// marked deleted with a new version, so that reconcile() can propagate
+// the deletion and the name can be re-created in place later.
 int unlink(const char *path)
 {
-	warn("unlink() not implemented");
-	errno = ENOSYS;
-	return -1;
+	int ino = dir_walk(path, 0);
+	if (ino < 0)
+		return -1;
+	if (ino < FILEINO_GENERAL || !S_ISREG(files->fi[ino].mode)) {
+		errno = EPERM;	// can't unlink directories or special files
+		return -1;
+	}
+
+	fileino_truncate(ino, 0);	// free content and bump version
+	files->fi[ino].mode = 0;
+	return 0;
 }
 #endif
 
@@ -18,6 +18,10 @@
 #include <inc/unistd.h>
 #include <inc/elf.h>
 #include <inc/vm.h>
+#if LAB >= 9
+#include <inc/file.h>
+#include <inc/errno.h>
+#endif
 
 
 // Maximum size of executable image we can load -
@@ -27,8 +31,8 @@
 extern void start(void);
 extern void exec_start(intptr_t esp) gcc_noreturn;
 
-int exec_readelf(const char *path);
-intptr_t exec_copyargs(char *const argv[]);
+int exec_readelf(const char *path, pid_t child);
+intptr_t exec_copyargs(char *const argv[], pid_t child);
 
 int
 execl(const char *path, const char *arg0, ...)
@@ -45,11 +49,11 @@ execv(const char *path, char *const argv[])
 	sys_put(SYS_ZERO, 0, NULL, NULL, (void*)VM_USERLO, VM_USERHI-VM_USERLO);
 
 	// Load the ELF executable into child 0.
-	if (exec_readelf(path) < 0)
+	if (exec_readelf(path, 0) < 0)
 		return -1;
 
 	// Setup child 0's stack with the argument array.
-	intptr_t esp = exec_copyargs(argv);
+	intptr_t esp = exec_copyargs(argv, 0);
 
 	// Copy our Unix file system and process state into the child.
 	sys_put(SYS_COPY, 0, NULL, (void*)VM_FILELO, (void*)VM_FILELO,
@@ -60,8 +64,90 @@ execv(const char *path, char *const argv[])
 	exec_start(esp);
 }
 
+#if LAB >= 9
+// Start a new child process running the program 'path' with arguments 'argv',
+// with the same effect as a fork() whose child immediately calls execv(),
+// or as a posix_spawn() with no file actions or attributes.
+// But where fork() would copy our entire address space into the child
+// only for execv() to throw it away again, we build the new program's image
+// directly in the child and copy it nothing of ours but our file state.
+// Returns the child's pid, or -1 with errno set if the program can't be loaded.
+pid_t
+spawnv(const char *path, char *const argv[])
+{
+	int i;
+
+	// Find a free child process slot, as fork() does.
+	pid_t pid;
+	for (pid = 1; pid < PROC_CHILDREN; pid++)
+		if (files->child[pid].state == PROC_FREE)
+			break;
+	if (pid == PROC_CHILDREN) {
+		warn("spawnv: no child process available");
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// Load the program and its arguments straight into the child.
+	sys_put(SYS_ZERO, pid, NULL, NULL, (void*)VM_USERLO,
+		VM_USERHI-VM_USERLO);
+	if (exec_readelf(path, pid) < 0)
+		return -1;
+	intptr_t esp = exec_copyargs(argv, pid);
+
+	// Give the child our Unix file system and process state,
+	// then fix it up the way fork()'s child fixes up its own copy.
+	sys_put(SYS_COPY, pid, NULL, (void*)VM_FILELO, (void*)VM_FILELO,
+		VM_FILEHI-VM_FILELO);
+	sys_get(SYS_COPY, pid, NULL, (void*)FILESVA, (void*)VM_SCRATCHLO,
+		PTSIZE);
+	filestate *cfiles = (filestate*)VM_SCRATCHLO;
+	cfiles->thself = pid;
+	memset(&cfiles->child, 0, sizeof(cfiles->child));
+	cfiles->child[0].state = PROC_RESERVED;
+	memset(cfiles->dirty, 0, sizeof(cfiles->dirty));
+	for (i = 1; i < FILE_INODES; i++)
+		if (cfiles->fi[i].de.d_name[0] != 0) {
+			cfiles->fi[i].rino = i;	// 1-to-1 mapping
+			cfiles->fi[i].rver = cfiles->fi[i].ver;
+			cfiles->fi[i].rlen = cfiles->fi[i].size;
+		}
+	pipe_forked(cfiles);
+	sys_put(SYS_COPY, pid, NULL, (void*)VM_SCRATCHLO, (void*)FILESVA,
+		PTSIZE);
+
+	// Start the new program at its entrypoint, on its new stack.
+	struct procstate ps;
+	memset(&ps, 0, sizeof(ps));
+	ps.tf.rip = (intptr_t)start;
+	ps.tf.rsp = esp;
+	sys_put(SYS_REGS | SYS_START, pid, &ps, NULL, NULL, 0);
+
+	// Record the child as fork() does.
+	memset(&files->child[pid], 0, sizeof(files->child[pid]));
+	files->child[pid].state = PROC_FORKED;
+	files->child[pid].rseq = files->dirtyseq;
+	pipe_fork(pid);
+
+	return pid;
+}
+#endif	// LAB >= 9
+
+// Find the range of whole pages [*lo,*hi) of ELF segment 'ph'
+// that we can map copy-on-write from the executable file's own pages,
+// which needs the segment to sit at the same page offset in memory and
+// in the file.  Returns false if there are no such pages.
+static bool
+exec_cowpages(proghdr *ph, intptr_t *lo, intptr_t *hi)
+{
+	intptr_t valo = ph->p_va;
+	*lo = ROUNDUP(valo, PAGESIZE);
+	*hi = ROUNDDOWN(valo + ph->p_filesz, PAGESIZE);
+	return PGOFF(valo) == PGOFF(ph->p_offset) && *lo < *hi;
+}
+
 int
-exec_readelf(const char *path)
+exec_readelf(const char *path, pid_t child)
 {
 	// We'll load the ELF image into a scratch area in our address space.
 	sys_get(SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, EXEMAX);
@@ -101,6 +187,14 @@ exec_readelf(const char *path)
 			goto err;
 		}
 
+		intptr_t filelo = ph->p_offset;
+		intptr_t filehi = filelo + ph->p_filesz;
+		if (filelo < 0 || filelo > imgsize
+				|| filehi < filelo || filehi > imgsize) {
+			warn("exec_readelf: loaded section out of bounds");
+			goto err;
+		}
+
 		// Map all pages the segment touches in our scratch region.
 		// They've already been zeroed by the SYS_ZERO above.
 		intptr_t scratchofs = VM_SCRATCHLO - VM_USERLO;
@@ -110,17 +204,19 @@ exec_readelf(const char *path)
 			(void*)pagelo + scratchofs, pagehi - pagelo);
 
 		// Initialize the file-loaded part of the ELF image.
-		// (We could use copy-on-write if SYS_COPY
-		// supports copying at arbitrary page boundaries.)
-		intptr_t filelo = ph->p_offset;
-		intptr_t filehi = filelo + ph->p_filesz;
-		if (filelo < 0 || filelo > imgsize
-				|| filehi < filelo || filehi > imgsize) {
-			warn("exec_readelf: loaded section out of bounds");
-			goto err;
-		}
-		memcpy((void*)valo + scratchofs, imgdata + filelo,
-			filehi - filelo);
+		// The whole pages of a segment laid out page-for-page
+		// with the file (see user/user.ld) get mapped copy-on-write
+		// straight from the file's pages below, so copy only the rest.
+		intptr_t cowlo, cowhi;
+		if (exec_cowpages(ph, &cowlo, &cowhi)) {
+			memcpy((void*)valo + scratchofs, imgdata + filelo,
+				cowlo - valo);
+			memcpy((void*)cowhi + scratchofs,
+				imgdata + filelo + (cowhi - valo),
+				valo + (filehi - filelo) - cowhi);
+		} else
+			memcpy((void*)valo + scratchofs, imgdata + filelo,
+				filehi - filelo);
 
 		// Finally, remove write permissions on read-only segments.
 		if (!(ph->p_flags & ELF_PROG_FLAG_WRITE))
@@ -128,10 +224,25 @@ exec_readelf(const char *path)
 				(void*)pagelo + scratchofs, pagehi - pagelo);
 	}
 
-	// Copy the ELF image into its correct position in child 0.
-	sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
+	// Copy the ELF image into its correct position in the child.
+	sys_put(SYS_COPY, child, NULL, (void*)VM_SCRATCHLO,
 		(void*)VM_USERLO, EXEMAX);
 
+	// Then map the whole file-backed pages of each segment over it,
+	// sharing them copy-on-write with the file and every other
+	// process running the same program.
+	for (ph = imgdata + eh->e_phoff; ph < eph; ph++) {
+		intptr_t cowlo, cowhi;
+		if (ph->p_type != ELF_PROG_LOAD
+				|| !exec_cowpages(ph, &cowlo, &cowhi))
+			continue;
+		int perm = (ph->p_flags & ELF_PROG_FLAG_WRITE)
+				? SYS_READ | SYS_WRITE : SYS_READ;
+		sys_put(SYS_COPY | SYS_PERM | perm, child, NULL,
+			imgdata + ph->p_offset + (cowlo - ph->p_va),
+			(void*)cowlo, cowhi - cowlo);
+	}
+
 	// The new program should have the same entrypoint as we do!
 	if (eh->e_entry != (intptr_t)start) {
 		warn("exec_readelf: executable has a different start address");
@@ -147,7 +258,7 @@ err:
 }
 
 intptr_t
-exec_copyargs(char *const argv[])
+exec_copyargs(char *const argv[], pid_t child)
 {
 	// Give the process a nice big 4MB, zero-filled stack.
 	sys_get(SYS_ZERO | SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL,
@@ -190,8 +301,8 @@ exec_copyargs(char *const argv[])
 	intptr_t esp = VM_STACKHI;	// no arguments - fix this.
 #endif // ! SOL >= 4
 
-	// Copy the stack into its correct position in child 0.
-	sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
+	// Copy the stack into its correct position in the child.
+	sys_put(SYS_COPY, child, NULL, (void*)VM_SCRATCHLO,
 		(void*)VM_STACKHI-PTSIZE, PTSIZE);
 
 	return esp;
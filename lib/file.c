@@ -57,16 +57,25 @@ fileino_create(filestate *fs, int dino, const char *name)
 
 	// First see if an inode already exists for this directory and name.
 	int i;
+#if LAB >= 9
+	i = fileino_lookup(fs, dino, name, strlen(name));
+	if (i >= FILEINO_GENERAL)
+		return i;
+#else
 	for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
 		if (fs->fi[i].dino == dino
 				&& strcmp(fs->fi[i].de.d_name, name) == 0)
 			return i;
+#endif
 
 	// No inode allocated to this name - find a free one to allocate.
 	for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
 		if (fs->fi[i].de.d_name[0] == 0) {
 			fs->fi[i].dino = dino;
 			strcpy(fs->fi[i].de.d_name, name);
+#if LAB >= 9
+			fileino_hashin(fs, i);
+#endif
 			return i;
 		}
 
@@ -75,6 +84,77 @@ fileino_create(filestate *fs, int dino, const char *name)
 	return -1;
 }
 
+#if LAB >= 9
+// Hash a directory inode number and a 'len'-byte name into a dirhash chain.
+static int
+fileino_hash(int dino, const char *name, int len)
+{
+	uint32_t h = dino;
+	while (len-- > 0)
+		h = h * 31 + (uint8_t)*name++;
+	return h & (FILE_DIRHASH-1);
+}
+
+// Link allocated inode 'ino' into the directory index of filestate 'fs'.
+// If the index isn't built yet, it will pick up 'ino' when it is.
+void
+fileino_hashin(filestate *fs, int ino)
+{
+	assert(fileino_isvalid(ino) && fs->fi[ino].de.d_name[0] != 0);
+	if (!fs->dirhashed)
+		return;
+
+	fileinode *fi = &fs->fi[ino];
+	int h = fileino_hash(fi->dino, fi->de.d_name, strlen(fi->de.d_name));
+	fs->dirnext[ino] = fs->dirhash[h];
+	fs->dirhash[h] = ino;
+}
+
+// Find the allocated inode (which may be deleted)
+// named by the first 'len' bytes of 'name' in directory 'dino',
+// building the filestate's directory index first if necessary.
+// Returns the inode number, or 0 if no such entry has ever existed.
+int
+fileino_lookup(filestate *fs, int dino, const char *name, int len)
+{
+	if (!fs->dirhashed) {
+		// Build the index, lowest inodes first in each chain.
+		memset(fs->dirhash, 0, sizeof(fs->dirhash));
+		fs->dirhashed = 1;
+		int ino;
+		for (ino = FILE_INODES-1; ino > 0; ino--)
+			if (fs->fi[ino].de.d_name[0] != 0)
+				fileino_hashin(fs, ino);
+	}
+
+	if (len <= 0 || len > NAME_MAX)
+		return 0;	// no such name can be in the index
+
+	// The index might come from a child, so don't trust it blindly:
+	// check every link and never walk more links than inodes.
+	int ino = fs->dirhash[fileino_hash(dino, name, len)];
+	int n;
+	for (n = 0; fileino_isvalid(ino) && n < FILE_INODES; n++) {
+		fileinode *fi = &fs->fi[ino];
+		if (fi->dino == dino && memcmp(fi->de.d_name, name, len) == 0
+				&& fi->de.d_name[len] == 0)
+			return ino;
+		ino = fs->dirnext[ino];
+	}
+	return 0;
+}
+
+// Note that inode 'ino' has changed in this process,
+// so that the next reconcile() with our parent or children looks at it.
+void
+fileino_dirty(int ino)
+{
+	assert(fileino_isvalid(ino));
+	files->dirty[ino / 32] |= 1 << (ino % 32);
+	files->inoseq[ino] = ++files->dirtyseq;
+}
+#endif	// LAB >= 9
+
 // Read up to 'count' data elements each of size 'eltsize',
 // starting at absolute byte offset 'ofs' within the file in inode 'ino'.
 // Returns the number of elements (NOT the number of bytes!) actually read,
@@ -90,11 +170,7 @@ fileino_read(int ino, off_t ofs, void *buf, size_t eltsize, size_t count)
 	assert(eltsize > 0);
 
 	fileinode *fi = &files->fi[ino];
-#if LAB >= 9
-	// XXX hack: allow reading init-files bigger than 4MB
-#else
 	assert(fi->size <= FILE_MAXSIZE);
-#endif
 
 #if SOL >= 4
 	ssize_t actual = 0;
@@ -138,7 +214,7 @@ fileino_read(int ino, off_t ofs, void *buf, size_t eltsize, size_t count)
 // which should always be equal to the 'count' input parameter
 // unless an error occurs, in which case this function
 // returns -1 and sets errno appropriately.
-// Since PIOS files can be up to only FILE_MAXSIZE bytes in size (4MB),
+// Since PIOS files can be up to only FILE_MAXSIZE bytes in size,
 // one particular reason an error might occur is if an application
 // tries to grow a file beyond this maximum file size,
 // in which case this function generates the EFBIG error.
@@ -174,6 +250,9 @@ fileino_write(int ino, off_t ofs, const void *buf, size_t eltsize, size_t count)
 
 	// Write the data.
 	memmove(FILEDATA(ino) + ofs, buf, len);
+#if LAB >= 9
+	fileino_dirty(ino);
+#endif
 	return count;
 #else	// ! SOL >= 4
 	// Lab 4: insert your file writing code here.
@@ -192,13 +271,20 @@ fileino_stat(int ino, struct stat *st)
 	assert(fileino_exists(ino));
 
 	fileinode *fi = &files->fi[ino];
-	assert(fileino_isdir(fi->dino));	// Should be in a directory!
 #if LAB >= 9
+	assert(fileino_isdir(fi->dino)		// Should be in a directory,
+		|| S_ISFIFO(fi->mode));		// unless it's a pipe
 	memset(st, 0, sizeof(*st));		// Clear unused parts of struct
+#else
+	assert(fileino_isdir(fi->dino));	// Should be in a directory!
 #endif
 	st->st_ino = ino;
 	st->st_mode = fi->mode;
 	st->st_size = fi->size;
+#if LAB >= 9
+	if (S_ISFIFO(fi->mode))
+		st->st_size = fi->size - fi->rdofs;	// unread data
+#endif
 
 	return 0;
 }
@@ -233,6 +319,9 @@ fileino_truncate(int ino, off_t newsize)
 	}
 	files->fi[ino].size = newsize;
 	files->fi[ino].ver++;	// truncation is always an exclusive change
+#if LAB >= 9
+	fileino_dirty(ino);
+#endif
 	return 0;
 }
 
@@ -243,6 +332,15 @@ fileino_flush(int ino)
 {
 	assert(fileino_isvalid(ino));
 
+#if LAB >= 9
+	// Pipes go to the children sharing them first.
+	if (S_ISFIFO(files->fi[ino].mode)) {
+		pipe_sched(0);
+		if (files->fi[ino].rino == 0)
+			return 0;	// our parent doesn't have this pipe
+	}
+
+#endif
 	if (files->fi[ino].size > files->fi[ino].rlen)
 		sys_ret();	// synchronize and reconcile with parent
 	return 0;
@@ -334,6 +432,16 @@ filedesc_read(filedesc *fd, void *buf, size_t eltsize, size_t count)
 	assert(filedesc_isreadable(fd));
 	fileinode *fi = &files->fi[fd->ino];
 
+#if LAB >= 9
+	// Pipes have no file position: reads consume from the pipe itself.
+	if (S_ISFIFO(fi->mode)) {
+		ssize_t actual = pipe_read(fd->ino, buf, eltsize, count);
+		if (actual < 0)
+			fd->err = errno;
+		return actual;
+	}
+
+#endif
 	ssize_t actual = fileino_read(fd->ino, fd->ofs, buf, eltsize, count);
 	if (actual < 0) {
 		fd->err = errno;	// save error indication for ferror()
@@ -358,6 +466,15 @@ filedesc_write(filedesc *fd, const void *buf, size_t eltsize, size_t count)
 	assert(filedesc_iswritable(fd));
 	fileinode *fi = &files->fi[fd->ino];
 
+#if LAB >= 9
+	if (S_ISFIFO(fi->mode)) {
+		ssize_t actual = pipe_write(fd->ino, buf, eltsize, count);
+		if (actual < 0)
+			fd->err = errno;
+		return actual;
+	}
+
+#endif
 	// If we're appending to the file, seek to the end first.
 	if (fd->flags & O_APPEND)
 		fd->ofs = fi->size;
@@ -417,6 +534,10 @@ filedesc_close(filedesc *fd)
 	assert(filedesc_isopen(fd));
 	assert(fileino_isvalid(fd->ino));
 
+#if LAB >= 9
+	if (S_ISFIFO(files->fi[fd->ino].mode))
+		pipe_ref(fd, -1);	// one less end of this pipe open
+#endif
 	fd->ino = FILEINO_NULL;		// mark the fd free
 }
 
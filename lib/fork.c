@@ -26,6 +26,33 @@
 bool reconcile(pid_t pid, filestate *cfiles);
 bool reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino);
 bool reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino);
+#if LAB >= 9
+bool reconcile_pipe(pid_t pid, filestate *cfiles, int pino, int cino);
+static void reconcile_touch(filestate *cfiles, int cino);
+#endif
+static int reconcile_p2c(filestate *cfiles, const uint8_t *p2c, int pino);
+static int reconcile_c2p(filestate *cfiles, const uint8_t *p2c, int cino);
+
+#define BITMAP_TEST(map, i)	(((map)[(i) / 32] >> ((i) % 32)) & 1)
+#define BITMAP_SET(map, i)	((map)[(i) / 32] |= 1 << ((i) % 32))
+
+// Walk the inode numbers whose bits are set in a bitmap, skipping inode 0.
+#define BITMAP_FOREACH(map, i) \
+	for ((i) = bitmap_next(map, 1); (i) < FILE_INODES; \
+		(i) = bitmap_next(map, (i) + 1))
+
+// Return the first inode number at or after i whose bit is set in map,
+// or FILE_INODES if there is none.
+static int
+bitmap_next(const uint32_t *map, int i)
+{
+	for (; i < FILE_INODES; i = (i | 31) + 1) {
+		uint32_t w = map[i / 32] >> (i % 32);
+		if (w != 0)
+			return i + __builtin_ctz(w);
+	}
+	return FILE_INODES;
+}
 
 pid_t fork(void)
 {
@@ -79,12 +106,18 @@ pid_t fork(void)
 		// Clear our child state array, since we have no children yet.
 		memset(&files->child, 0, sizeof(files->child));
 		files->child[0].state = PROC_RESERVED;
+#if LAB >= 9
+		memset(files->dirty, 0, sizeof(files->dirty));
+#endif
 		for (i = 1; i < FILE_INODES; i++)
 			if (fileino_alloced(i)) {
 				files->fi[i].rino = i;	// 1-to-1 mapping
 				files->fi[i].rver = files->fi[i].ver;
 				files->fi[i].rlen = files->fi[i].size;
 			}
+#if LAB >= 9
+		pipe_forked(files);
+#endif
 
 		return 0;	// indicate that we're the child.
 	}
@@ -98,6 +131,10 @@ pid_t fork(void)
 	// so that we can reconcile them later when we synchronize with it.
 	memset(&files->child[pid], 0, sizeof(files->child[pid]));
 	files->child[pid].state = PROC_FORKED;
+#if LAB >= 9
+	files->child[pid].rseq = files->dirtyseq;
+	pipe_fork(pid);
+#endif
 
 	return pid;
 }
@@ -146,6 +183,10 @@ waitpid(pid_t pid, int *status, int options)
 				*status = WSIGNALED | ps.tf.trapno;
 
 			done:
+#if LAB >= 9
+			// Forget the pipe ends the child held.
+			pipe_reap(cfiles);
+#endif
 			// Clear out the child's address space.
 			sys_put(SYS_ZERO, pid, NULL, ALLVA, ALLVA, ALLSIZE);
 			files->child[pid].state = PROC_FREE;
@@ -162,6 +203,14 @@ waitpid(pid_t pid, int *status, int options)
 			goto done;
 		}
 
+#if LAB >= 9
+		// If the child is waiting for new input, or has filled our pipes,
+		// first give our other children sharing pipes with it a turn:
+		// they may produce what it's waiting for or drain what it wrote.
+		if (files->child[pid].piped && (!didio || pipe_full()))
+			didio |= pipe_sched(pid);
+
+#endif
 		// If the child is waiting for new input
 		// and the reconciliation above didn't provide anything new,
 		// then wait for something new from OUR parent in turn.
@@ -186,33 +235,58 @@ reconcile(pid_t pid, filestate *cfiles)
 	bool didio = 0;
 	int i;
 
-	// Compute a parent-to-child and child-to-parent inode mapping table.
-	int p2c[FILE_INODES], c2p[FILE_INODES];
-	memset(p2c, 0, sizeof(p2c)); memset(c2p, 0, sizeof(c2p));
-	p2c[FILEINO_CONSIN] = c2p[FILEINO_CONSIN] = FILEINO_CONSIN;
-	p2c[FILEINO_CONSOUT] = c2p[FILEINO_CONSOUT] = FILEINO_CONSOUT;
-	p2c[FILEINO_ROOTDIR] = c2p[FILEINO_ROOTDIR] = FILEINO_ROOTDIR;
+	// Find the inodes changed on either side since we last reconciled.
+#if LAB >= 9
+	// Our inode mapping with the child persists from one reconcile
+	// to the next, so we need look only at those in the child's
+	// dirty bitmap, and those of ours changed after the child's rseq.
+	// The special inodes always count as dirty,
+	// since the kernel does console I/O on them behind our backs.
+	uint8_t *p2c = files->child[pid].p2c;
+	uint32_t cdirty[FILE_INODES/32], pdirty[FILE_INODES/32];
+	memcpy(cdirty, cfiles->dirty, sizeof(cdirty));
+	memset(pdirty, 0, sizeof(pdirty));
+	for (i = 1; i < FILEINO_GENERAL; i++)
+		BITMAP_SET(pdirty, i);
+	uint32_t rseq = files->child[pid].rseq;
+	if (files->dirtyseq != rseq)	// else we've changed nothing since
+		for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
+			if ((int32_t)(files->inoseq[i] - rseq) > 0)
+				BITMAP_SET(pdirty, i);
+#else
+	// Without dirty tracking, look at every inode on both sides.
+	uint8_t p2c[FILE_INODES];
+	uint32_t cdirty[FILE_INODES/32], pdirty[FILE_INODES/32];
+	memset(p2c, 0, sizeof(p2c));
+	memset(cdirty, 0xff, sizeof(cdirty));
+	memset(pdirty, 0xff, sizeof(pdirty));
+#endif
 
-	// First make sure all the child's allocated inodes
-	// have a mapping in the parent, creating mappings as needed.
-	// Also keep track of the parent inodes we find mappings for.
+	// First make sure each of the child's changed inodes
+	// has a mapping in the parent, creating mappings as needed.
 	int cino;
-	for (cino = 1; cino < FILE_INODES; cino++) {
+	BITMAP_FOREACH(cdirty, cino) {
 		fileinode *cfi = &cfiles->fi[cino];
 		if (cfi->de.d_name[0] == 0)
 			continue;	// not allocated in the child
 		if (cfi->mode == 0 && cfi->rino == 0)
 			continue;	// existed only ephemerally in child
+#if LAB >= 9
+		if (S_ISFIFO(cfi->mode) && cfi->rino == 0)
+			continue;	// child's own pipe: we hold none of its ends
+#endif
 		if (cfi->rino == 0) {
 			// No corresponding parent inode known: find/create one.
 			// The parent directory should already have a mapping.
-			if (cfi->dino <= 0 || cfi->dino >= FILE_INODES
-				|| c2p[cfi->dino] == 0) {
+			int pdino = 0;
+			if (cfi->dino > 0 && cfi->dino < FILE_INODES)
+				pdino = reconcile_c2p(cfiles, p2c, cfi->dino);
+			if (pdino == 0) {
 				warn("reconcile: cino %d has invalid parent",
 					cino);
 				continue;	// don't reconcile it
 			}
-			cfi->rino = fileino_create(files, c2p[cfi->dino],
+			cfi->rino = fileino_create(files, pdino,
 							cfi->de.d_name);
 			if (cfi->rino <= 0)
 				continue;	// no free inodes!
@@ -222,9 +296,13 @@ reconcile(pid_t pid, filestate *cfiles)
 		// If something's fishy, just don't reconcile it,
 		// since we don't want the child to kill the parent this way.
 		int pino = cfi->rino;
+		if (pino <= 0 || pino >= FILE_INODES) {
+			warn("reconcile: cino %d maps to bad inode %d",
+				cino, pino);
+			continue;
+		}
 		fileinode *pfi = &files->fi[pino];
-		if (pino <= 0 || pino >= FILE_INODES
-				|| p2c[pfi->dino] != cfi->dino
+		if (reconcile_p2c(cfiles, p2c, pfi->dino) != cfi->dino
 				|| strcmp(pfi->de.d_name, cfi->de.d_name) != 0
 				|| cfi->rver > pfi->ver
 				|| cfi->rver > cfi->ver) {
@@ -238,39 +316,89 @@ reconcile(pid_t pid, filestate *cfiles)
 
 		// Record the mapping.
 		p2c[pino] = cino;
-		c2p[cino] = pino;
 	}
 
-	// Now make sure all the parent's allocated inodes
-	// have a mapping in the child, creating mappings as needed.
+	// Now make sure each of the parent's changed inodes
+	// has a mapping in the child, creating mappings as needed.
 	int pino;
-	for (pino = 1; pino < FILE_INODES; pino++) {
+	BITMAP_FOREACH(pdirty, pino) {
 		fileinode *pfi = &files->fi[pino];
 		if (pfi->de.d_name[0] == 0 || pfi->mode == 0)
 			continue; // not in use or already deleted
-		if (p2c[pino] != 0)
+		if (reconcile_p2c(cfiles, p2c, pino) != 0)
 			continue; // already mapped
-		cino = fileino_create(cfiles, p2c[pfi->dino], pfi->de.d_name);
+#if LAB >= 9
+		if (S_ISFIFO(pfi->mode))
+			continue; // created after the fork: child holds no ends
+#endif
+		int cdino = reconcile_p2c(cfiles, p2c, pfi->dino);
+		if (cdino == 0)
+			continue;	// no directory to put it in
+		cino = fileino_create(cfiles, cdino, pfi->de.d_name);
 		if (cino <= 0)
 			continue;	// no free inodes!
 		cfiles->fi[cino].rino = pino;
 		p2c[pino] = cino;
-		c2p[cino] = pino;
 	}
 
-	// Finally, reconcile each corresponding pair of inodes.
-	for (pino = 1; pino < FILE_INODES; pino++) {
-		if (!p2c[pino])
-			continue;	// no corresponding inode in child
-		cino = p2c[pino];
-		assert(c2p[cino] == pino);
-
-		didio |= reconcile_inode(pid, cfiles, pino, cino);
+	// Finally, reconcile each corresponding pair of inodes
+	// changed on either side, visiting each pair only once.
+	BITMAP_FOREACH(pdirty, pino) {
+		cino = reconcile_p2c(cfiles, p2c, pino);
+		if (cino != 0)
+			didio |= reconcile_inode(pid, cfiles, pino, cino);
+	}
+	BITMAP_FOREACH(cdirty, cino) {
+		pino = reconcile_c2p(cfiles, p2c, cino);
+		if (pino != 0 && !BITMAP_TEST(pdirty, pino))
+			didio |= reconcile_inode(pid, cfiles, pino, cino);
 	}
 
+#if LAB >= 9
+	// We're now up to date with the child and vice versa.
+	memset(cfiles->dirty, 0, sizeof(cfiles->dirty));
+	files->child[pid].rseq = files->dirtyseq;
+#endif
 	return didio;
 }
 
+// Return the child's inode corresponding to our inode 'pino', or 0 if none.
+// The child's 'rino' is authoritative; p2c just saves us searching for it.
+static int
+reconcile_p2c(filestate *cfiles, const uint8_t *p2c, int pino)
+{
+	if (pino < FILEINO_GENERAL)
+		return pino;	// the special inodes always correspond
+	int cino = p2c[pino] != 0 ? p2c[pino] : pino;
+	fileinode *cfi = &cfiles->fi[cino];
+	if (cfi->de.d_name[0] == 0 || cfi->rino != pino)
+		return 0;
+	return cino;
+}
+
+// Return our inode corresponding to the child's inode 'cino', or 0 if none.
+static int
+reconcile_c2p(filestate *cfiles, const uint8_t *p2c, int cino)
+{
+	if (cino < FILEINO_GENERAL)
+		return cino;
+	int pino = cfiles->fi[cino].rino;
+	if (!fileino_isvalid(pino) || reconcile_p2c(cfiles, p2c, pino) != cino)
+		return 0;
+	return pino;
+}
+
+#if LAB >= 9
+// Note that reconcile changed inode 'cino' in the child's filestate.
+// Our copy already has the change, so the child's dirty bit stays clear,
+// but the child's own children still need to see it.
+static void
+reconcile_touch(filestate *cfiles, int cino)
+{
+	cfiles->inoseq[cino] = ++cfiles->dirtyseq;
+}
+#endif
+
 bool
 reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
 {
@@ -278,6 +406,10 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
 	assert(cino > 0 && cino < FILE_INODES);
 	fileinode *pfi = &files->fi[pino];
 	fileinode *cfi = &cfiles->fi[cino];
+#if LAB >= 9
+	if (S_ISFIFO(pfi->mode) || S_ISFIFO(cfi->mode))
+		return reconcile_pipe(pid, cfiles, pino, cino);
+#endif
 
 	// Find the reference version number and length for reconciliation
 	int rver = cfi->rver;
@@ -316,26 +448,41 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
 		pfi->mode |= S_IFCONF;
 		cfi->mode |= S_IFCONF;
 		pfi->ver = cfi->ver = cfi->rver = MAX(pfi->ver, cfi->ver);
+#if LAB >= 9
+		fileino_dirty(pino);
+		reconcile_touch(cfiles, cino);
+#endif
 		return 1;	// Changes of sorts were "propagated"
 	}
 
 	// No conflict: copy the latest version to the other.
 	if (pfi->ver > rver || pfi->size > rlen) {
 		// Parent's version is newer: copy to child.
+		// Copy only the pages either version of the file occupies.
+		size_t len = ROUNDUP(MAX(pfi->size, cfi->size), PAGESIZE);
 		cfi->ver = pfi->ver;
 		cfi->mode = pfi->mode;
 		cfi->size = pfi->size;
 
-		sys_put(SYS_COPY, pid, NULL, FILEDATA(pino), FILEDATA(cino),
-			PTSIZE);
+		if (len > 0)
+			sys_put(SYS_COPY, pid, NULL,
+				FILEDATA(pino), FILEDATA(cino), len);
+#if LAB >= 9
+		reconcile_touch(cfiles, cino);
+#endif
 	} else {
 		// Child's version is newer: copy to parent.
+		size_t len = ROUNDUP(MAX(pfi->size, cfi->size), PAGESIZE);
 		pfi->ver = cfi->ver;
 		pfi->mode = cfi->mode;
 		pfi->size = cfi->size;
 
-		sys_get(SYS_COPY, pid, NULL, FILEDATA(cino), FILEDATA(pino),
-			PTSIZE);
+		if (len > 0)
+			sys_get(SYS_COPY, pid, NULL,
+				FILEDATA(cino), FILEDATA(pino), len);
+#if LAB >= 9
+		fileino_dirty(pino);
+#endif
 	}
 
 	// Reset child's reconciliation state.
@@ -377,11 +524,11 @@ reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
 
 #if SOL >= 4
 	// How much did the file grow in the src & dst since last reconcile?
-	int rlen = cfi->rlen;
-	int plen = pfi->size;
-	int clen = cfi->size;
-	int pgrow = plen - rlen;
-	int cgrow = clen - rlen;
+	size_t rlen = cfi->rlen;
+	size_t plen = pfi->size;
+	size_t clen = cfi->size;
+	ssize_t pgrow = plen - rlen;
+	ssize_t cgrow = clen - rlen;
 	assert(pgrow >= 0 && pgrow <= FILE_MAXSIZE);
 	assert(cgrow >= 0 && cgrow <= FILE_MAXSIZE);
 
@@ -395,27 +542,35 @@ reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
 	assert(pfi->size <= FILE_MAXSIZE);
 	assert(cfi->size <= FILE_MAXSIZE);
 
-	// Map if necessary and find src & dst file data areas.
-	// The child's inode table is sitting at VM_SCRATCHLO,
-	// so map the file data temporarily at VM_SCRATCHLO+PTSIZE.
-	void *pp = FILEDATA(pino);
-	void *cp = (void*)VM_SCRATCHLO+PTSIZE;
-	sys_get(SYS_COPY, pid, NULL, FILEDATA(cino), cp, PTSIZE);
-
 	// Would the new file size be too big after reconcile?  Conflict!
-	int newlen = rlen + pgrow + cgrow;
+	size_t newlen = rlen + pgrow + cgrow;
 	assert(newlen == plen + cgrow);
 	assert(newlen == clen + pgrow);
 	if (newlen > FILE_MAXSIZE) {
 		pfi->mode |= S_IFCONF;
 		cfi->mode |= S_IFCONF;
+#if LAB >= 9
+		fileino_dirty(pino);
+		reconcile_touch(cfiles, cino);
+#endif
 		return 1;	// I/O of sorts did occur
 	}
 
+	// Find src & dst file data areas.
+	// Only the pages from the reference length to the new length
+	// are read or written in either copy, so we map just those pages
+	// of the child's file, at the same offsets at FILE_SCRATCH
+	// (the child's inode table is sitting below it).
+	void *pp = FILEDATA(pino);
+	void *cp = FILE_SCRATCH;
+	size_t pagelo = ROUNDDOWN(rlen, PAGESIZE);
+	size_t pagehi = ROUNDUP(newlen, PAGESIZE);
+	sys_get(SYS_COPY, pid, NULL, FILEDATA(cino) + pagelo, cp + pagelo,
+		pagehi - pagelo);
+
 	// Make sure the perms are adequate in both copies of file
-	int pagelen = ROUNDUP(newlen, PAGESIZE);
-	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, pp, pagelen);
-	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, cp, pagelen);
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, pp + pagelo, pagehi - pagelo);
+	sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, cp + pagelo, pagehi - pagelo);
 
 	// Copy the newly-added parts of the file in both directions.
 	// Note that if both parent and child appended simultaneously,
@@ -428,9 +583,16 @@ reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
 	pfi->size = newlen; assert(newlen == plen + cgrow);
 	cfi->size = newlen; assert(newlen == clen + pgrow);
 	cfi->rlen = newlen; assert(newlen == rlen + pgrow + cgrow);
+#if LAB >= 9
+	if (cgrow > 0)
+		fileino_dirty(pino);
+	if (pgrow > 0)
+		reconcile_touch(cfiles, cino);
+#endif
 
-	// Copy child's updated file data back into the child
-	sys_put(SYS_COPY, pid, NULL, cp, FILEDATA(cino), PTSIZE);
+	// Copy child's updated file pages back into the child
+	sys_put(SYS_COPY, pid, NULL, cp + pagelo, FILEDATA(cino) + pagelo,
+		pagehi - pagelo);
 
 	// File merged!
 	return 1;
@@ -445,4 +607,173 @@ reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
 #endif	// ! SOL >= 4
 }
 
+#if LAB >= 9
+// Reconcile the two copies of a pipe (see lib/pipe.c):
+// account for the ends the child holds, advance our read position
+// past what the child's readers consumed, take what the child wrote
+// as far as our buffer has room, and give the child what it hasn't seen.
+// Parent and child agree on the stream's contents up to the child's rlen,
+// so data moves by remapping whole pages, partial ones at the edges included.
+bool
+reconcile_pipe(pid_t pid, filestate *cfiles, int pino, int cino)
+{
+	fileinode *pfi = &files->fi[pino];
+	fileinode *cfi = &cfiles->fi[cino];
+	if (!S_ISFIFO(pfi->mode) || !S_ISFIFO(cfi->mode))
+		return 0;	// gone on one side: nothing left to exchange
+
+	size_t rlen = cfi->rlen;
+	if (pfi->size < rlen || cfi->size < rlen || cfi->rdofs > cfi->size
+			|| cfi->size - cfi->rdofs > FILE_PIPESIZE) {
+		warn("reconcile_pipe: bad pipe state in child %d (%d/%d)",
+			pid, pino, cino);
+		return 0;
+	}
+	bool creads = cfi->nrd > 0 || cfi->rnrd > 0;
+	bool didio = 0;
+
+	// Account for ends the child closed or duplicated since last time.
+	if (cfi->nrd != cfi->rnrd || cfi->nwr != cfi->rnwr) {
+		pfi->nrd += cfi->nrd - cfi->rnrd;
+		pfi->nwr += cfi->nwr - cfi->rnwr;
+		cfi->rnrd = cfi->nrd;
+		cfi->rnwr = cfi->nwr;
+		didio = 1;
+	}
+
+	// What the child's readers consumed frees up our buffer.
+	size_t tail = pfi->rdofs;
+	if (creads)
+		tail = MIN(MAX(tail, cfi->rdofs), pfi->size);
+	if (tail > pfi->rdofs) {
+		pipe_pages(0, SYS_ZERO, 0, NULL, FILEDATA(pino),
+			pfi->rdofs, ROUNDDOWN(tail, PAGESIZE));
+		pfi->rdofs = tail;
+		didio = 1;
+	}
+
+	// Take what the child wrote.  If nothing else was written
+	// since we last reconciled, the child's data continues our stream
+	// right where it sits in the ring, so we can just remap its pages -
+	// as many as fit.  Otherwise append it after the other writes,
+	// all or nothing, and hand the child its own bytes back in order.
+	size_t cgrow = cfi->size - rlen;
+	size_t pgrow = pfi->size - rlen;
+	size_t room = FILE_PIPESIZE - (pfi->size - pfi->rdofs);
+	if (cgrow > 0 && pgrow == 0 && room > 0) {
+		size_t n = MIN(cgrow, room);
+		pipe_pages(0, SYS_COPY, pid, FILEDATA(cino), FILEDATA(pino),
+			rlen, rlen + n);
+		rlen += n;
+		pfi->size = rlen;
+		didio = 1;
+	} else if (cgrow > 0 && pgrow > 0 && cgrow <= room) {
+		void *cp = FILE_SCRATCH;
+		pipe_pages(0, SYS_COPY, pid, FILEDATA(cino), cp,
+			rlen, cfi->size);
+		pipe_pages(0, SYS_PERM | SYS_RW, 0, NULL, FILEDATA(pino),
+			pfi->size, pfi->size + cgrow);
+		pipe_copy(FILEDATA(pino), pfi->size, cp, rlen, cgrow);
+		pfi->size += cgrow;
+		cfi->size = rlen;
+		cfi->rdofs = MIN(cfi->rdofs, rlen);
+		didio = 1;
+	}
+
+	// With no readers left anywhere, whatever we hold is garbage.
+	if (pfi->nrd == 0 && pfi->xrd == 0 && pfi->rdofs < pfi->size) {
+		pipe_pages(0, SYS_ZERO, 0, NULL, FILEDATA(pino),
+			pfi->rdofs, ROUNDDOWN(pfi->size, PAGESIZE));
+		pfi->rdofs = pfi->size;
+	}
+
+	// Bring the child up to our end of the stream,
+	// unless it still has data of its own for us to take.
+	// A reader gets everything it hasn't consumed;
+	// a writer needs only the partial page it will append to.
+	if (cfi->size == rlen && pfi->size > rlen) {
+		size_t lo = pfi->size;
+		if (cfi->nrd > 0) {
+			size_t ctail = MAX(cfi->rdofs, pfi->rdofs);
+			pipe_pages(1, SYS_ZERO, pid, NULL, FILEDATA(cino),
+				cfi->rdofs, ROUNDDOWN(ctail, PAGESIZE));
+			cfi->rdofs = ctail;
+			lo = MAX(rlen, ctail);
+		} else if (cfi->nwr == 0)
+			lo = ROUNDUP(pfi->size, PAGESIZE);
+		pipe_pages(1, SYS_COPY, pid, FILEDATA(pino), FILEDATA(cino),
+			lo, pfi->size);
+		rlen = pfi->size;
+		cfi->size = rlen;
+		didio = 1;
+	}
+
+	// A child that doesn't read needn't keep what we've taken from it.
+	if (cfi->nrd == 0 && cfi->rdofs < rlen) {
+		pipe_pages(1, SYS_ZERO, pid, NULL, FILEDATA(cino),
+			cfi->rdofs, ROUNDDOWN(rlen, PAGESIZE));
+		cfi->rdofs = rlen;
+		didio = 1;
+	}
+	cfi->rlen = rlen;
+
+	// Tell the child how many ends are held outside its tree,
+	// which is how its readers see end-of-file and its writers EPIPE.
+	int xrd = pfi->xrd + pfi->nrd - cfi->nrd;
+	int xwr = pfi->xwr + pfi->nwr - cfi->nwr;
+	if (xrd != cfi->xrd || xwr != cfi->xwr) {
+		cfi->xrd = xrd;
+		cfi->xwr = xwr;
+		didio = 1;
+	}
+
+	// Once the child holds no ends and owes us nothing anyone could read,
+	// free its copy of the inode, so it can't outlive ours:
+	// pipe_ref() frees our inode for reuse when the last end closes.
+	if (cfi->nrd == 0 && cfi->nwr == 0 && (cfi->size == rlen
+			|| (pfi->nrd == 0 && pfi->xrd == 0))) {
+		sys_put(SYS_ZERO, pid, NULL, NULL, FILEDATA(cino),
+			FILE_MAXSIZE);
+		memset(cfi, 0, sizeof(*cfi));
+		didio = 1;
+	}
+
+	if (didio) {
+		fileino_dirty(pino);
+		reconcile_touch(cfiles, cino);
+	}
+	return didio;
+}
+
+// Give each child that may hold ends of our pipes, except 'except', a turn:
+// wait for it to stop, reconcile with it, and restart it
+// if that gave it anything new to work on.
+// Children are visited in a fixed order, so the schedule is deterministic.
+// Returns true if we exchanged anything with any of them.
+bool
+pipe_sched(pid_t except)
+{
+	bool progress = 0;
+	pid_t pid;
+	for (pid = 1; pid < PROC_CHILDREN; pid++) {
+		if (pid == except || files->child[pid].state != PROC_FORKED
+				|| !files->child[pid].piped)
+			continue;
+
+		struct procstate ps;
+		sys_get(SYS_COPY | SYS_REGS, pid, &ps,
+			(void*)FILESVA, FILE_PIPESCRATCH, PTSIZE);
+		if (ps.tf.trapno != T_SYSCALL)
+			continue;	// leave it for waitpid() to clean up
+		filestate *cfiles = (filestate*)FILE_PIPESCRATCH;
+
+		bool didio = reconcile(pid, cfiles);
+		progress |= didio;
+		sys_put(SYS_COPY | (didio && !cfiles->exited ? SYS_START : 0),
+			pid, NULL, FILE_PIPESCRATCH, (void*)FILESVA, PTSIZE);
+	}
+	return progress;
+}
+#endif	// LAB >= 9
+
 #endif	// LAB >= 4
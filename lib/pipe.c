@@ -0,0 +1,304 @@
+#if LAB >= 9
+/*
+ * Unix-style pipes for the PIOS user-space file system.
+ *
+ * A pipe is a special S_IFIFO inode not listed in any directory,
+ * whose data area holds a ring buffer of at most FILE_PIPESIZE bytes.
+ * Like everything else in the file system, each process has its own copy:
+ * a writer appends to the ring in its copy, and a reader consumes from it.
+ * Pipe data moves between processes only when a parent reconciles
+ * with a child (see reconcile_pipe() in lib/fork.c),
+ * mostly by remapping whole pages with SYS_COPY rather than copying bytes.
+ * A process that fills or drains a pipe gives the children
+ * it shares pipes with a turn, in a fixed order (pipe_sched()),
+ * before waiting on its own parent, so both ends of a pipeline
+ * make progress in bounded memory and the result stays deterministic.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/file.h>
+#include <inc/stat.h>
+#include <inc/unistd.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/errno.h>
+#include <inc/mmu.h>
+
+
+#define PIPE_RING(ofs)	((ofs) & (FILE_MAXSIZE-1))	// Stream ofs to ring
+
+
+int
+pipe(int fds[2])
+{
+	int ino = fileino_alloc();
+	if (ino < 0)
+		return -1;
+
+	filedesc *rfd = filedesc_alloc();
+	if (rfd == NULL)
+		return -1;
+	rfd->ino = ino;			// claim it before allocating another
+	filedesc *wfd = filedesc_alloc();
+	if (wfd == NULL) {
+		rfd->ino = FILEINO_NULL;
+		return -1;
+	}
+
+	// Pipes live in no directory, so no one can open them by name,
+	// and reconcile() maps them between processes only by inode number.
+	fileinode *fi = &files->fi[ino];
+	memset(fi, 0, sizeof(*fi));
+	strcpy(fi->de.d_name, "pipe");
+	fi->mode = S_IFIFO | 0600;
+	fi->nrd = fi->nwr = 1;
+	fileino_dirty(ino);
+
+	rfd->flags = O_RDONLY;
+	rfd->ofs = 0;
+	rfd->err = 0;
+	wfd->ino = ino;
+	wfd->flags = O_WRONLY;
+	wfd->ofs = 0;
+	wfd->err = 0;
+
+	fds[0] = rfd - files->fd;
+	fds[1] = wfd - files->fd;
+	return 0;
+}
+
+// Count the ends of pipe 'ino' open for 'flag' in descriptor table 'fs'.
+static int
+pipe_ends(filestate *fs, int ino, int flag)
+{
+	int i, n = 0;
+	for (i = 0; i < OPEN_MAX; i++)
+		if (fs->fd[i].ino == ino && (fs->fd[i].flags & flag))
+			n++;
+	return n;
+}
+
+// Account in the parent for the pipe ends
+// that forking child 'pid' just duplicated.
+void
+pipe_fork(pid_t pid)
+{
+	int ino;
+	for (ino = FILEINO_GENERAL; ino < FILE_INODES; ino++) {
+		fileinode *fi = &files->fi[ino];
+		if (!fileino_alloced(ino) || !S_ISFIFO(fi->mode))
+			continue;
+		int rd = pipe_ends(files, ino, O_RDONLY);
+		int wr = pipe_ends(files, ino, O_WRONLY);
+		if (rd > 0 || wr > 0) {
+			// The child's copies of our ends are in our tree now.
+			fi->nrd += rd;
+			fi->nwr += wr;
+			files->child[pid].piped = 1;
+			fileino_dirty(ino);
+		}
+	}
+}
+
+// Account for the pipe ends in a new child's copy 'cfs' of its parent's
+// file state, before the parent's pipe_fork() counts them on its side.
+void
+pipe_forked(filestate *cfs)
+{
+	int ino;
+	for (ino = FILEINO_GENERAL; ino < FILE_INODES; ino++) {
+		fileinode *fi = &cfs->fi[ino];
+		if (fi->de.d_name[0] == 0 || !S_ISFIFO(fi->mode))
+			continue;
+
+		// All the ends our parent's tree held are outside ours,
+		// and only our own copies of its descriptors are inside.
+		fi->xrd += fi->nrd;
+		fi->xwr += fi->nwr;
+		fi->nrd = fi->rnrd = pipe_ends(cfs, ino, O_RDONLY);
+		fi->nwr = fi->rnwr = pipe_ends(cfs, ino, O_WRONLY);
+	}
+}
+
+// Adjust the count of pipe ends when a descriptor is duplicated or closed.
+void
+pipe_ref(filedesc *fd, int delta)
+{
+	fileinode *fi = &files->fi[fd->ino];
+	assert(S_ISFIFO(fi->mode));
+	if (fd->flags & O_RDONLY)
+		fi->nrd += delta;
+	if (fd->flags & O_WRONLY)
+		fi->nwr += delta;
+	assert(fi->nrd >= 0 && fi->nwr >= 0);
+	fileino_dirty(fd->ino);
+
+	// A pipe we created ourselves is gone once our tree holds no ends,
+	// so free its inode for reuse: reconcile_pipe() has already freed
+	// the copies of any children that held ends.
+	// If our parent knows the pipe, it still has to take what we wrote.
+	if (fi->nrd == 0 && fi->nwr == 0 && fi->rino == 0) {
+		sys_get(SYS_ZERO, 0, NULL, NULL, FILEDATA(fd->ino),
+			FILE_MAXSIZE);
+		memset(fi, 0, sizeof(*fi));
+	}
+}
+
+// Drop the pipe ends an exited or killed child 'cfiles' still accounted for.
+void
+pipe_reap(filestate *cfiles)
+{
+	int cino;
+	for (cino = FILEINO_GENERAL; cino < FILE_INODES; cino++) {
+		fileinode *cfi = &cfiles->fi[cino];
+		int pino = cfi->rino;
+		if (!S_ISFIFO(cfi->mode) || !fileino_isvalid(pino)
+				|| !S_ISFIFO(files->fi[pino].mode))
+			continue;
+		files->fi[pino].nrd -= cfi->rnrd;
+		files->fi[pino].nwr -= cfi->rnwr;
+		fileino_dirty(pino);
+	}
+}
+
+// Close our pipe ends and let the children reading them finish,
+// since they can get our data only through us.  Called from exit().
+void
+pipe_exit(void)
+{
+	int i;
+	for (i = 0; i < OPEN_MAX; i++) {
+		filedesc *fd = &files->fd[i];
+		if (filedesc_isopen(fd) && S_ISFIFO(files->fi[fd->ino].mode))
+			filedesc_close(fd);
+	}
+	for (i = 1; i < PROC_CHILDREN; i++)
+		if (files->child[i].state == PROC_FORKED
+				&& files->child[i].piped)
+			waitpid(i, NULL, 0);
+}
+
+// Return true if any of our pipes holds all the data it can.
+bool
+pipe_full(void)
+{
+	int ino;
+	for (ino = FILEINO_GENERAL; ino < FILE_INODES; ino++) {
+		fileinode *fi = &files->fi[ino];
+		if (fileino_alloced(ino) && S_ISFIFO(fi->mode)
+				&& fi->size - fi->rdofs >= FILE_PIPESIZE)
+			return 1;
+	}
+	return 0;
+}
+
+// Wait for the other end of a pipe to make progress:
+// first give our own children a turn at it,
+// and if none of them had anything for us, ask our parent.
+static void
+pipe_wait(void)
+{
+	if (!pipe_sched(0))
+		sys_ret();
+}
+
+ssize_t
+pipe_read(int ino, void *buf, size_t eltsize, size_t count)
+{
+	fileinode *fi = &files->fi[ino];
+	assert(S_ISFIFO(fi->mode));
+	if (count == 0)
+		return 0;
+
+	// Wait for at least one whole element, or end of file
+	// once no writers are left anywhere.
+	while (fi->size - fi->rdofs < eltsize) {
+		if (fi->nwr == 0 && fi->xwr == 0)
+			return 0;
+		pipe_wait();
+	}
+
+	size_t n = MIN(count, (fi->size - fi->rdofs) / eltsize);
+	size_t len = n * eltsize;
+	pipe_copy(buf, 0, FILEDATA(ino), fi->rdofs, len);
+
+	// Free the pages we've consumed entirely.
+	pipe_pages(0, SYS_ZERO, 0, NULL, FILEDATA(ino), fi->rdofs,
+		ROUNDDOWN(fi->rdofs + len, PAGESIZE));
+	fi->rdofs += len;
+	fileino_dirty(ino);
+	return n;
+}
+
+ssize_t
+pipe_write(int ino, const void *buf, size_t eltsize, size_t count)
+{
+	fileinode *fi = &files->fi[ino];
+	assert(S_ISFIFO(fi->mode));
+
+	size_t len = eltsize * count;
+	size_t done = 0;
+	while (done < len) {
+		if (fi->nrd == 0 && fi->xrd == 0) {
+			errno = EPIPE;	// no readers left anywhere
+			return done > 0 ? done / eltsize : -1;
+		}
+
+		size_t room = FILE_PIPESIZE - (fi->size - fi->rdofs);
+		if (room == 0) {
+			pipe_wait();
+			continue;
+		}
+
+		size_t n = MIN(room, len - done);
+		pipe_pages(0, SYS_PERM | SYS_RW, 0, NULL, FILEDATA(ino),
+			fi->size, fi->size + n);
+		pipe_copy(FILEDATA(ino), fi->size, buf + done, 0, n);
+		fi->size += n;
+		done += n;
+		fileino_dirty(ino);
+	}
+	return count;
+}
+
+// Apply the memory operation 'cmd' to the pages holding stream bytes
+// [lo,hi) of a pipe, between ring buffers at 'sbase' and 'dbase'
+// in our and child 'pid's address spaces, using sys_put() if 'put'
+// and otherwise sys_get().  The range is split where the ring wraps.
+void
+pipe_pages(bool put, int cmd, pid_t pid, void *sbase, void *dbase,
+		size_t lo, size_t hi)
+{
+	lo = ROUNDDOWN(lo, PAGESIZE);
+	hi = ROUNDUP(hi, PAGESIZE);
+	while (lo < hi) {
+		size_t pos = PIPE_RING(lo);
+		size_t len = MIN(hi - lo, FILE_MAXSIZE - pos);
+		if (put)
+			sys_put(cmd, pid, NULL, sbase + pos, dbase + pos, len);
+		else
+			sys_get(cmd, pid, NULL, sbase + pos, dbase + pos, len);
+		lo += len;
+	}
+}
+
+// Copy 'len' bytes from stream offset 'sofs' of the ring at 'sbase'
+// to stream offset 'dofs' of the ring at 'dbase'.
+// A plain buffer works as a ring at offset 0 for up to FILE_MAXSIZE bytes.
+void
+pipe_copy(void *dbase, size_t dofs, const void *sbase, size_t sofs,
+		size_t len)
+{
+	while (len > 0) {
+		size_t dpos = PIPE_RING(dofs), spos = PIPE_RING(sofs);
+		size_t n = MIN(len, FILE_MAXSIZE - MAX(dpos, spos));
+		memcpy(dbase + dpos, sbase + spos, n);
+		dofs += n;
+		sofs += n;
+		len -= n;
+	}
+}
+
+#endif	// LAB >= 9
@@ -26,6 +26,217 @@
 #define BARRIER_READ(b)	((b) & BARRIER_MASK)
 #define BARRIER_WRITE(b) (EXIT_BARRIER | (b))
 
+// Combining tree.
+// The first TREE_FANOUT threads are direct children of the master,
+// which merges and restarts them itself exactly as a flat barrier would.
+// Each further group of TREE_FANOUT threads instead lives underneath
+// a "combiner" process occupying the master's child slot numbered
+// after the group's first ("leader") thread.
+// At a barrier the combiners merge their own groups in parallel,
+// and the master then merges just one combined diff per group.
+// Within a combiner each thread keeps its own number as its child slot.
+#define TREE_FANOUT	16
+#define TREE_DIRECT(th)	((th) <= TREE_FANOUT)
+#define TREE_LEADER(th)	(((th) - 1) / TREE_FANOUT * TREE_FANOUT + 1)
+
+// Operations the master hands to a combiner process
+#define COMB_CREATE	1	// Fork thread 'th' from the master's image
+#define COMB_JOIN	2	// Merge thread 'th' and record its registers
+#define COMB_COLLECT	3	// Merge every thread marked in 'part'
+#define COMB_RELEASE	4	// Push merged memory to marked threads, restart
+#define COMB_FREE	5	// Clear out thread 'th'
+
+// Command page, handed from the master to a combiner before each operation.
+typedef struct combcmd {
+	int		op;		// COMB_* operation to perform
+	int		leader;		// First thread in the combiner's group
+	int		th;		// Thread for CREATE, JOIN, and FREE
+	bool		part[TREE_FANOUT]; // Threads for COLLECT and RELEASE
+	procstate	ps;		// Starting state for CREATE
+} combcmd;
+
+// Result page, one per group: final register state of each merged thread.
+typedef struct combres {
+	trapframe	tf[TREE_FANOUT];
+} combres;
+
+// The combining tree's control area lives in the thread-private region:
+// the command page, one result page per possible leader,
+// and at the very top a small stack for the combiner to run on.
+#define COMBCMD		((combcmd*)VM_PRIVLO)
+#define COMBRES(l)	((combres*)(VM_PRIVLO + (l) * PAGESIZE))
+#define COMBSIZE	(PROC_CHILDREN * PAGESIZE)
+#define COMBSTACKSIZE	(4 * PAGESIZE)
+#define COMBSTACKLO	((void*) VM_PRIVHI - COMBSTACKSIZE)
+
+static void comb_main(void) gcc_noreturn;
+
+// Hand operation 'op' to the combiner process for group 'leader'
+// and start it running; comb_finish() collects the results later.
+// Operations that merge or release threads first give the combiner
+// (and its merge reference snapshot) a copy of our current shared memory.
+static void
+comb_start(int leader, int op, int th, const bool *part)
+{
+	combcmd *cc = COMBCMD;
+	cc->op = op;
+	cc->leader = leader;
+	cc->th = th;
+	if (part != NULL)
+		memcpy(cc->part, &part[leader], sizeof(cc->part));
+	else
+		memset(cc->part, 0, sizeof(cc->part));
+
+	if (op == COMB_CREATE)	// Child needs our whole image, command too
+		sys_put(SYS_COPY, leader, NULL, ALLVA, ALLVA, ALLSIZE);
+	else {
+		if (op != COMB_FREE)
+			sys_put(SYS_COPY | SYS_SNAP, leader, NULL,
+				SHAREVA, SHAREVA, SHARESIZE);
+		sys_put(SYS_COPY, leader, NULL, COMBCMD, COMBCMD, PAGESIZE);
+	}
+
+	// Run the combiner afresh on its own stack at the top of VM_PRIV.
+	struct procstate ps;
+	memset(&ps, 0, sizeof(ps));
+	ps.tf.rip = (intptr_t) comb_main;
+	ps.tf.rsp = VM_PRIVHI - 8;	// as if comb_main had been called
+	sys_put(SYS_PERM | SYS_RW | SYS_REGS | SYS_START, leader, &ps,
+		NULL, COMBSTACKLO, COMBSTACKSIZE);
+}
+
+// Wait for the combiner of group 'leader' to finish a JOIN or COLLECT,
+// merge its combined changes into our memory, and fetch its results.
+static void
+comb_finish(int leader)
+{
+	struct procstate ps;
+	sys_get(SYS_MERGE | SYS_REGS, leader, &ps, SHAREVA, SHAREVA, SHARESIZE);
+	if (ps.tf.trapno != T_SYSCALL)
+		panic("pthread combiner %d: unexpected trap %d, rip 0x%x",
+			leader, ps.tf.trapno, ps.tf.rip);
+	sys_get(SYS_COPY, leader, NULL, COMBRES(leader), COMBRES(leader),
+		PAGESIZE);
+}
+
+// Merge thread 'th' into the combiner's memory and record its registers.
+static void
+comb_merge(combres *cr, int leader, int th)
+{
+	struct procstate ps;
+	sys_get(SYS_MERGE | SYS_REGS, th, &ps, SHAREVA, SHAREVA, SHARESIZE);
+	cr->tf[th - leader] = ps.tf;
+}
+
+// Main loop of a combiner process: perform the single operation
+// described in our command page, then return to the master.
+static void gcc_noreturn
+comb_main(void)
+{
+	combcmd *cc = COMBCMD;
+	combres *cr = COMBRES(cc->leader);
+	int i, th;
+
+	switch (cc->op) {
+	case COMB_CREATE:
+		sys_put(SYS_START | SYS_SNAP | SYS_REGS | SYS_COPY, cc->th,
+			&cc->ps, ALLVA, ALLVA, ALLSIZE);
+		break;
+	case COMB_JOIN:
+		comb_merge(cr, cc->leader, cc->th);
+		break;
+	case COMB_COLLECT:
+		for (i = 0; i < TREE_FANOUT; i++)
+			if (cc->part[i])
+				comb_merge(cr, cc->leader, cc->leader + i);
+		break;
+	case COMB_RELEASE:
+		for (i = 0; i < TREE_FANOUT; i++)
+			if (cc->part[i])
+				sys_put(SYS_COPY | SYS_SNAP | SYS_START,
+					cc->leader + i, NULL,
+					SHAREVA, SHAREVA, SHARESIZE);
+		break;
+	case COMB_FREE:
+		sys_put(SYS_ZERO, cc->th, NULL, ALLVA, ALLVA, ALLSIZE);
+		break;
+	default:
+		panic("comb_main: bad operation %d", cc->op);
+	}
+	sys_ret();
+	panic("comb_main: restarted without a new command");
+}
+
+// Start a new thread 'th' in register state 'ps',
+// forking it via its group's combiner if it isn't one of our direct children.
+static void
+thread_start(pthread_t th, procstate *ps)
+{
+	if (TREE_DIRECT(th)) {
+		sys_put(SYS_START | SYS_SNAP | SYS_REGS | SYS_COPY, th,
+			ps, ALLVA, ALLVA, ALLSIZE);
+		return;
+	}
+
+	int leader = TREE_LEADER(th);
+	if (!files->child[leader].combiner) {
+		// Make sure our combining tree control area is mapped.
+		static_assert(sizeof(combcmd) <= PAGESIZE);
+		static_assert(sizeof(combres) <= PAGESIZE);
+		sys_get(SYS_PERM | SYS_RW, 0, NULL, NULL, COMBCMD, COMBSIZE);
+		files->child[leader].combiner = 1;
+	}
+	COMBCMD->ps = *ps;
+	comb_start(leader, COMB_CREATE, th, NULL);
+}
+
+// Wait for thread 'th' to stop, merge its changes into our memory,
+// and return its register state at the time it stopped.
+static void
+thread_sync(pthread_t th, trapframe *tf)
+{
+	if (TREE_DIRECT(th)) {
+		struct procstate ps;
+		sys_get(SYS_MERGE | SYS_REGS, th, &ps,
+			SHAREVA, SHAREVA, SHARESIZE);
+		*tf = ps.tf;
+		return;
+	}
+
+	int leader = TREE_LEADER(th);
+	comb_start(leader, COMB_JOIN, th, NULL);
+	comb_finish(leader);
+	*tf = COMBRES(leader)->tf[th - leader];
+}
+
+// Clear out a finished thread and free its slot,
+// retiring its group's combiner once the whole group is gone.
+static void
+thread_free(pthread_t th)
+{
+	files->child[th].state = PROC_FREE;
+	if (TREE_DIRECT(th)) {
+		sys_put(SYS_ZERO, th, NULL, ALLVA, ALLVA, ALLSIZE);
+		return;
+	}
+
+	int leader = TREE_LEADER(th);
+	comb_start(leader, COMB_FREE, th, NULL);
+
+	int i;
+	for (i = leader; i < leader + TREE_FANOUT && i < PROC_CHILDREN; i++)
+		if (files->child[i].state == PROC_FORKED) {
+			// Keep the combiner's slot from being reused meanwhile.
+			if (files->child[leader].state == PROC_FREE)
+				files->child[leader].state = PROC_RESERVED;
+			return;
+		}
+	sys_put(SYS_ZERO, leader, NULL, ALLVA, ALLVA, ALLSIZE);
+	files->child[leader].combiner = 0;
+	if (files->child[leader].state == PROC_RESERVED)
+		files->child[leader].state = PROC_FREE;
+}
+
 
 // Fork a child process, returning 0 in the child and 1 in the parent.
 int
@@ -88,12 +299,10 @@ pthread_create(pthread_t *out_thread, const pthread_attr_t *attr,
 
 	// Fork the child, copying our entire user address space into it.
 	ps.tf.rax = 0;	// isparent == 0 in the child
-	sys_put(SYS_START | SYS_SNAP | SYS_REGS | SYS_COPY, th,
-		&ps, ALLVA, ALLVA, ALLSIZE);
+	thread_start(th, &ps);
 
 	// Record the inode generation numbers of all inodes at fork time,
 	// so that we can reconcile them later when we synchronize with it.
-	memset(&files->child[th], 0, sizeof(files->child[th]));
 	files->child[th].state = PROC_FORKED;
 
 	*out_thread = th;
@@ -108,34 +317,68 @@ wait_at_barrier(pthread_t first_child, pthread_barrier_t barrier)
 	// Get the number of threads to wait at this barrier.
 	// One has already arrived, so subtract 1.
 	int count = files->barriers[barrier];
-	int status, i;
+	int status, i, leader;
 	struct procstate ps;
+	trapframe dtf[TREE_FANOUT], *tf;
 	pthread_t th;
-	pthread_t threads[PROC_CHILDREN];
-	i = 0;
-	threads[i++] = first_child;
-	for  (th = 1; th < PROC_CHILDREN && i < count; th++) {
 
+	// Choose the participating threads: the one that already arrived,
+	// plus the lowest-numbered other forked threads.
+	bool part[PROC_CHILDREN + TREE_FANOUT];
+	memset(part, 0, sizeof(part));
+	part[first_child] = 1;
+	i = 1;
+	for (th = 1; th < PROC_CHILDREN && i < count; th++) {
 		if (th == first_child || files->child[th].state != PROC_FORKED)
 			continue;
-
-		sys_get(SYS_MERGE | SYS_REGS, th, &ps, SHAREVA, SHAREVA, SHARESIZE);
+		part[th] = 1;
+		i++;
+	}
+	part[first_child] = 0;	// already merged; just restart it
+
+	// Start every combiner merging its own participants in parallel,
+	// then merge our direct children while they do so.
+	for (leader = TREE_FANOUT + 1; leader < PROC_CHILDREN;
+			leader += TREE_FANOUT)
+		if (files->child[leader].combiner
+				&& memchr(&part[leader], 1, TREE_FANOUT))
+			comb_start(leader, COMB_COLLECT, 0, part);
+	for (th = 1; th <= TREE_FANOUT && th < PROC_CHILDREN; th++)
+		if (part[th]) {
+			sys_get(SYS_MERGE | SYS_REGS, th, &ps,
+				SHAREVA, SHAREVA, SHARESIZE);
+			dtf[th - 1] = ps.tf;
+		}
+	for (leader = TREE_FANOUT + 1; leader < PROC_CHILDREN;
+			leader += TREE_FANOUT)
+		if (files->child[leader].combiner
+				&& memchr(&part[leader], 1, TREE_FANOUT))
+			comb_finish(leader);
+
+	// Check that everyone arrived at this same barrier.
+	for (th = 1; th < PROC_CHILDREN; th++) {
+		if (!part[th])
+			continue;
+		if (TREE_DIRECT(th))
+			tf = &dtf[th - 1];
+		else {
+			leader = TREE_LEADER(th);
+			tf = &COMBRES(leader)->tf[th - leader];
+		}
 
 		// Make sure the child exited with the expected trap number
-		if (ps.tf.trapno != T_SYSCALL) {
-			cprintf("  rip  0x%016x\n", ps.tf.rip);
-			cprintf("  rsp  0x%016x\n", ps.tf.rsp);
+		if (tf->trapno != T_SYSCALL) {
+			cprintf("  rip  0x%016x\n", tf->rip);
+			cprintf("  rsp  0x%016x\n", tf->rsp);
 			cprintf("join: unexpected trap %d, expecting %d\n",
-				ps.tf.trapno, T_SYSCALL);
+				tf->trapno, T_SYSCALL);
 			errno = EINVAL;
 			return -1;
 		}
-		status = ps.tf.rdx;
+		status = tf->rdx;
 
 		// This should be the same barrier;
 		assert(barrier == BARRIER_READ(status));
-
-		threads[i++] = th;
 	}
 
 	// Wrong count or not enough forked threads: error.
@@ -145,10 +388,17 @@ wait_at_barrier(pthread_t first_child, pthread_barrier_t barrier)
 	}
 
 	// Synchronize memory with all children.
-	// Restart all children.
-	for (i = 0; i < count; i++)
-		sys_put( SYS_COPY | SYS_SNAP | SYS_START, threads[i],
-			 NULL, SHAREVA, SHAREVA, SHARESIZE);
+	// Restart all children, each group via its combiner.
+	part[first_child] = 1;
+	for (leader = TREE_FANOUT + 1; leader < PROC_CHILDREN;
+			leader += TREE_FANOUT)
+		if (files->child[leader].combiner
+				&& memchr(&part[leader], 1, TREE_FANOUT))
+			comb_start(leader, COMB_RELEASE, 0, part);
+	for (th = 1; th <= TREE_FANOUT && th < PROC_CHILDREN; th++)
+		if (part[th])
+			sys_put(SYS_COPY | SYS_SNAP | SYS_START, th,
+				NULL, SHAREVA, SHAREVA, SHARESIZE);
 	return 0;
 }
 
@@ -164,23 +414,23 @@ pthread_join(pthread_t th, void **out_exitval)
 	// then restart them all.
 	// If this is not a barrier, free the child.
 	int status, ret;
-	struct procstate ps;
+	trapframe tf;
 	while(true) {
-		sys_get(SYS_MERGE | SYS_REGS, th, &ps, SHAREVA, SHAREVA, SHARESIZE);
+		thread_sync(th, &tf);
 
 		// Make sure the child exited with the expected trap number
-		if (ps.tf.trapno != T_SYSCALL) {
-			cprintf("  rip  0x%016x\n", ps.tf.rip);
-			cprintf("  rsp  0x%016x\n", ps.tf.rsp);
+		if (tf.trapno != T_SYSCALL) {
+			cprintf("  rip  0x%016x\n", tf.rip);
+			cprintf("  rsp  0x%016x\n", tf.rsp);
 			cprintf("join: unexpected trap %d, expecting %d\n",
-				ps.tf.trapno, T_SYSCALL);
+				tf.trapno, T_SYSCALL);
 			status = -1;
 			errno = EINVAL;
 			ret = -1;
 			goto done;
 		}
 
-		status = ps.tf.rdx;
+		status = tf.rdx;
 
 		// At a barrier?
 		if (status & EXIT_BARRIER) {
@@ -205,8 +455,7 @@ pthread_join(pthread_t th, void **out_exitval)
 	if (out_exitval != NULL)
 		*out_exitval = (void *)status;
 	files->thstat = NULL;
-	sys_put(SYS_ZERO, th, NULL, ALLVA, ALLVA, ALLSIZE);
-	files->child[th].state = PROC_FREE;
+	thread_free(th);
 	return ret;
 }
 
@@ -21,6 +21,9 @@ exit(int status)
 	// To exit a PIOS user process, by convention,
 	// we just set our exit status in our filestate area
 	// and return to our parent process.
+#if LAB >= 9
+	pipe_exit();	// but not before our pipes' readers are done
+#endif
 	files->status = status;
 	files->exited = 1;
 	sys_ret();
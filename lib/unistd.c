@@ -15,6 +15,7 @@
 #include <inc/assert.h>
 #include <inc/stdarg.h>
 #if LAB >= 9
+#include <inc/stat.h>
 #include <inc/select.h>
 #endif
 
@@ -89,6 +90,10 @@ dup2(int oldfn, int newfn)
 		close(newfn);
 
 	*newfd = *oldfd;
+#if LAB >= 9
+	if (S_ISFIFO(files->fi[newfd->ino].mode))
+		pipe_ref(newfd, +1);	// one more end of this pipe open
+#endif
 
 	return newfn;
 }
@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# Boot a cluster of Determinator nodes as QEMU instances on this machine,
+# connected through a QEMU multicast socket network on the loopback device.
+# Node n gets MAC address 52:54:00:12:34:<n>, as net_init() expects.
+#
+# Node 1's console is attached to the terminal, unless -c is given,
+# in which case the cluster runs that shell command on node 1
+# and shuts down once the shell prompts again (or after -t seconds).
+# The other nodes' console output is prefixed with their node number.
+#
+# Usage: cluster.sh [-n nodes] [-v] [-c command] [-t timeout]
+#
+#	-n nodes	Number of nodes to boot (default 2)
+#	-v		Use virtio-net with 9000-byte MTU instead of the e100
+#	-c command	Run command in node 1's shell, then exit
+#	-t timeout	Give up on -c command after this many seconds
+#
+# The GNUmakefile's 'cluster' target passes the following in the environment:
+# QEMU, IMAGE (kernel.img), NCPUS, MEM, and NETPORT.
+
+nodes=2
+nic=i82559er
+cmd=
+timeout=600
+
+while getopts "n:vc:t:" opt; do
+	case $opt in
+	n)	nodes=$OPTARG ;;
+	v)	nic=virtio-net-pci ;;
+	c)	cmd=$OPTARG ;;
+	t)	timeout=$OPTARG ;;
+	*)	echo "usage: $0 [-n nodes] [-v] [-c command] [-t timeout]" 1>&2
+		exit 1 ;;
+	esac
+done
+
+: ${QEMU:=qemu-system-x86_64}
+: ${IMAGE:=obj/kern/kernel.img}
+: ${NCPUS:=2}
+: ${MEM:=1100M}
+: ${NETPORT:=30000}
+
+if [ "$nodes" -lt 2 -o "$nodes" -gt 32 ]; then
+	echo "$0: need between 2 and 32 nodes (NET_MAXNODES)" 1>&2
+	exit 1
+fi
+
+# Options for node $1.  Every node sees every packet on the multicast
+# "hub", and the kernel drops those addressed to other nodes.
+# -snapshot keeps the instances from contending for the disk image.
+qemuopts() {
+	mac=`printf "52:54:00:12:34:%02x" $1`
+	devopts=
+	if [ $nic = virtio-net-pci ]; then
+		devopts=",host_mtu=9000"
+	fi
+	echo "-smp $NCPUS -m $MEM -k en-us -display none -snapshot" \
+		"-drive file=$IMAGE,format=raw,index=0,media=disk" \
+		"-netdev socket,id=net0,mcast=230.0.0.1:$NETPORT,localaddr=127.0.0.1" \
+		"-device $nic,netdev=net0,mac=$mac$devopts"
+}
+
+pids=
+cleanup() {
+	[ -n "$pids" ] && kill $pids 2>/dev/null
+	[ -n "$tmp" ] && rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Boot nodes 2..N in the background.
+n=2
+while [ $n -le $nodes ]; do
+	$QEMU `qemuopts $n` -serial stdio </dev/null 2>&1 \
+		| sed -u -e "s/^/$n: /" &
+	pids="$pids $!"
+	n=`expr $n + 1`
+done
+sleep 1
+
+if [ -z "$cmd" ]; then
+	# Interactive: node 1 gets the terminal.
+	echo "*** Use Ctrl-a x to exit node 1 and shut down the cluster"
+	$QEMU `qemuopts 1` -serial mon:stdio
+	exit $?
+fi
+
+# Non-interactive: feed node 1's shell the command through a FIFO,
+# watching its console log for the shell's "$ " prompt.
+tmp=`mktemp -d /tmp/cluster.XXXXXX`
+mkfifo $tmp/in
+$QEMU `qemuopts 1` -serial stdio <$tmp/in >$tmp/log 2>&1 &
+pids="$pids $!"
+exec 3>$tmp/in
+tail -f $tmp/log &
+pids="$pids $!"
+
+prompts() {
+	grep -c '^\$ ' $tmp/log 2>/dev/null
+}
+
+elapsed=0
+while [ "`prompts`" -lt 1 ]; do
+	sleep 1
+	elapsed=`expr $elapsed + 1`
+	if [ $elapsed -ge $timeout ]; then
+		echo "*** node 1 did not boot to a shell prompt" 1>&2
+		exit 1
+	fi
+done
+echo "$cmd" >&3
+while [ "`prompts`" -lt 2 ]; do
+	sleep 1
+	elapsed=`expr $elapsed + 1`
+	if [ $elapsed -ge $timeout ]; then
+		echo "*** timed out waiting for '$cmd'" 1>&2
+		exit 1
+	fi
+done
+exit 0
@@ -0,0 +1,83 @@
+#if LAB >= 9
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <inc/bench.h>
+
+
+#define MAXTHREADS	255	// PIOS threads use child slots 1-255
+#define ITERS		100	// Barrier episodes per measurement
+
+static pthread_barrier_t barrier;
+static int niters;
+static int counts[MAXTHREADS+1];	// Touched by each thread per episode
+
+void *
+barfun(void *arg)
+{
+	int th = (intptr_t)arg;
+	int i;
+
+	// Dirty a little shared memory each episode,
+	// so that every barrier has a diff to merge.
+	for (i = 0; i < niters; i++) {
+		counts[th]++;
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+// Time nth threads passing through 'iters' barriers, start to finish.
+uint64_t
+bartest(int nth, int iters)
+{
+	pthread_t threads[MAXTHREADS];
+	int th;
+
+	niters = iters;
+	int rc = pthread_barrier_init(&barrier, NULL, nth);
+	assert(rc == 0);
+
+	uint64_t ts = bench_time();
+	for (th = 0; th < nth; th++) {
+		rc = pthread_create(&threads[th], NULL, barfun,
+					(void*)(intptr_t)th);
+		assert(rc == 0);
+	}
+	for (th = 0; th < nth; th++) {
+		rc = pthread_join(threads[th], NULL);
+		assert(rc == 0);
+	}
+	uint64_t td = bench_time() - ts;
+
+	pthread_barrier_destroy(&barrier);
+	return td;
+}
+
+int main(int argc, char **argv)
+{
+	int nth;
+
+	for (nth = 2; ; nth *= 2) {
+		if (nth > MAXTHREADS)
+			nth = MAXTHREADS;
+
+		// Subtract out thread creation and joining,
+		// leaving just the cost of the barriers themselves.
+		bartest(nth, 1);	// once to warm up
+		uint64_t tbase = bartest(nth, 0);
+		uint64_t tfull = bartest(nth, ITERS);
+		uint64_t td = tfull > tbase ? (tfull - tbase) / ITERS : 0;
+
+		printf("barrier x%d: %lld ns\n", nth, (long long)td);
+		if (nth == MAXTHREADS)
+			break;
+	}
+
+	return 0;
+}
+
+#endif	// LAB >= 9
@@ -0,0 +1,81 @@
+#if LAB >= 9
+/*
+ * Measure the cost of a fork() and waitpid() round trip
+ * as the number of files in the file system grows,
+ * both with an idle child and with a child that appends to one file.
+ * Under PIOS this mostly measures file system reconciliation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/wait.h>
+
+#include <inc/bench.h>
+
+
+#define MAXFILES	128	// Leaves inodes free for the initial files
+#define ITERS		1000
+
+static char name[32];
+
+static const char *
+fname(int i)
+{
+	sprintf(name, "forkfiles.%d", i);
+	return name;
+}
+
+// Fork a child that optionally appends to file 0, then wait for it.
+void
+forkwait(int touch)
+{
+	pid_t child = fork();
+	if (child == 0) {
+		if (touch) {
+			FILE *f = fopen(fname(0), "a");
+			assert(f != NULL);
+			fputs("x", f);
+			fclose(f);
+		}
+		exit(0);
+	}
+	assert(child > 0);
+	waitpid(child, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+	int nfiles = 0, n, touch, i;
+
+	for (n = 1; n <= MAXFILES; n *= 2) {
+		// Create files until we have n of them.
+		for (; nfiles < n; nfiles++) {
+			FILE *f = fopen(fname(nfiles), "w");
+			if (f == NULL)
+				goto done;	// out of inodes
+			fputs("forkfiles\n", f);
+			fclose(f);
+		}
+
+		for (touch = 0; touch < 2; touch++) {
+			forkwait(touch);	// once to warm up
+			uint64_t ts = bench_time();
+			for (i = 0; i < ITERS; i++)
+				forkwait(touch);
+			uint64_t td = (bench_time() - ts) / ITERS;
+			printf("fork/wait %s, %d files: %lld ns\n",
+				touch ? "append" : "idle", n, (long long)td);
+		}
+	}
+
+	done:
+	for (i = 0; i < nfiles; i++)
+		unlink(fname(i));
+	return 0;
+}
+
+#endif	// LAB >= 9
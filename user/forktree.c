@@ -1,47 +1,97 @@
-#if LAB >= 99	// XXX reinstate in lab3 or lab4?
+#if LAB >= 9
 /*
- * Fork a binary tree of processes and display their structure.
- *
- * Copyright (C) 1997 Massachusetts Institute of Technology
- * See section "MIT License" in the file LICENSES for licensing terms.
- *
- * Derived from the MIT Exokernel and JOS.
+ * Measure how long it takes to get many children running,
+ * forking them either one at a time from the parent
+ * or as a tree in which each level forks the next in parallel,
+ * and how long pthread_create() takes to get as many threads running.
  */
 
-#include <inc/lib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
 
-#define DEPTH 3
+#include <inc/bench.h>
 
-void forktree(const char *cur);
 
-void
-forkchild(const char *cur, char branch)
-{
-	char nxt[DEPTH+1];
+#define MAXCHILDREN	256
+#define MAXTHREADS	255	// PIOS threads use child slots 1-255
+#define ITERS		100
 
-	if (strlen(cur) >= DEPTH)
-		return;
+// Ways of starting the children
+#define FLAT		0	// bench_fork() each child from the parent
+#define TREE		1	// bench_forktree()
+#define THREADS		2	// pthread_create() each child as a thread
+#define NMODES		3
 
-	snprintf(nxt, DEPTH+1, "%s%c", cur, branch);
-	if (fork() == 0) {
-		forktree(nxt);
-		exit();
-	}
+static const char *modename[NMODES] = { "flat fork", "tree fork", "pthread" };
+
+uint64_t tstart[MAXCHILDREN];	// Time at which each child started running
+
+void *
+startfun(void *arg)
+{
+	int child = (intptr_t)arg;
+	tstart[child] = bench_time();
+	return NULL;
 }
 
-void
-forktree(const char *cur)
+// Start and join nchildren in the given mode,
+// returning the time until the last of them started running.
+uint64_t
+forktest(int nchildren, int mode)
 {
-	cprintf("%04x: I am '%s'\n", sys_getenvid(), cur);
+	void *args[MAXCHILDREN];
+	pthread_t threads[MAXTHREADS];
+	int i;
 
-	forkchild(cur, '0');
-	forkchild(cur, '1');
+	for (i = 0; i < nchildren; i++)
+		args[i] = (void*)(intptr_t)i;
+
+	uint64_t ts = bench_time();
+	if (mode == TREE) {
+		bench_forktree(nchildren, startfun, args);
+		bench_jointree(nchildren);
+	} else if (mode == THREADS) {
+		for (i = 0; i < nchildren; i++) {
+			int rc = pthread_create(&threads[i], NULL, startfun,
+						args[i]);
+			assert(rc == 0);
+		}
+		for (i = 0; i < nchildren; i++)
+			pthread_join(threads[i], NULL);
+	} else {
+		for (i = 0; i < nchildren; i++)
+			bench_fork(i, startfun, args[i]);
+		for (i = 0; i < nchildren; i++)
+			bench_join(i);
+	}
+
+	uint64_t tlast = ts;
+	for (i = 0; i < nchildren; i++)
+		if (tstart[i] > tlast)
+			tlast = tstart[i];
+	return tlast - ts;
 }
 
-void
-umain(void)
+int main(int argc, char **argv)
 {
-	forktree("");
+	int n, mode, i;
+
+	for (n = 1; n <= MAXCHILDREN; n *= 2)
+		for (mode = 0; mode < NMODES; mode++) {
+			int nc = mode == THREADS && n > MAXTHREADS
+					? MAXTHREADS : n;
+			forktest(nc, mode);	// once to warm up
+			uint64_t td = 0;
+			for (i = 0; i < ITERS; i++)
+				td += forktest(nc, mode);
+			td /= ITERS;
+			printf("%s x%d: all running after %lld ns\n",
+				modename[mode], nc, (long long)td);
+		}
+
+	return 0;
 }
 
-#endif
+#endif	// LAB >= 9
@@ -69,9 +69,9 @@ lsfile(const char *path, const char *realpath)
 	bool isdir = S_ISDIR(st.st_mode);
 
 	if(flag['l'])
-		printf("%c %11d ", 
+		printf("%c %11lld ", 
 			(st.st_mode & S_IFCONF) ? 'C' : isdir ? 'd' : '-',
-			st.st_size);
+			(long long)st.st_size);
 	printf("%s", path);
 	if(flag['F'] && isdir)
 		printf("/");
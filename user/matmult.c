@@ -16,13 +16,16 @@ typedef int elt;
 elt a[MAXDIM*MAXDIM], b[MAXDIM*MAXDIM], r[MAXDIM*MAXDIM];
 
 struct tharg {
-	int bi, bj, nbi, nbj, dim;
+	int bi, bj, nbi, nbj, dim, child;
 };
 
+uint64_t tstart[256];	// Time at which each child started running
+
 void *
 blkmult(void *varg)
 {
 	struct tharg *arg = varg;
+	tstart[arg->child] = bench_time();
 	int dim = arg->dim;	// Total matrix size in each dimension
 	int nbi = arg->nbi;	// Number of blocks in i dimension
 	int nbj = arg->nbj;	// Number of blocks in j dimension
@@ -42,7 +45,9 @@ blkmult(void *varg)
 	return NULL;
 }
 
-void
+// Multiply using nbi*nbj threads,
+// returning the time it took until all of them were running.
+uint64_t
 matmult(int nbi, int nbj, int dim)
 {
 	assert(dim >= 1 && dim <= MAXDIM);
@@ -54,25 +59,32 @@ matmult(int nbi, int nbj, int dim)
 
 	int bi,bj;
 	struct tharg arg[256];
+	void *argp[256];
 
-	// Fork off a thread to compute each cell in the result matrix
+	// Set up a thread to compute each cell in the result matrix
 	for (bi = 0; bi < nbi; bi++)
 		for (bj = 0; bj < nbj; bj++) {
-			int child = bi*nbi + bj;
+			int child = bi*nbj + bj;
 			arg[child].bi = bi;
 			arg[child].bj = bj;
 			arg[child].nbi = nbi;
 			arg[child].nbj = nbj;
 			arg[child].dim = dim;
-			bench_fork(child, blkmult, &arg[child]);
+			arg[child].child = child;
+			argp[child] = &arg[child];
 		}
 
-	// Now go back and merge in the results of all our children
-	for (bi = 0; bi < nbi; bi++)
-		for (bj = 0; bj < nbj; bj++) {
-			int child = bi*nbi + bj;
-			bench_join(child);
-		}
+	// Fork them all off as a tree, then merge in all their results
+	uint64_t ts = bench_time();
+	bench_forktree(nth, blkmult, argp);
+	bench_jointree(nth);
+
+	uint64_t tlast = ts;
+	int child;
+	for (child = 0; child < nth; child++)
+		if (tstart[child] > tlast)
+			tlast = tstart[child];
+	return tlast - ts;
 }
 
 int main(int argc, char **argv)
@@ -92,15 +104,19 @@ int main(int argc, char **argv)
 
 			matmult(nbi, nbj, dim);	// once to warm up...
 
+			uint64_t tspawn = 0;
 			uint64_t ts = bench_time();
 			for (iter = 0; iter < niter; iter++)
-				matmult(nbi, nbj, dim);
+				tspawn += matmult(nbi, nbj, dim);
 			uint64_t td = (bench_time() - ts) / niter;
+			tspawn /= niter;
 
-			printf("blksize %dx%d thr %d itr %d: %lld.%09lld\n",
+			printf("blksize %dx%d thr %d itr %d: %lld.%09lld"
+				" (all running after %lld ns)\n",
 				dim/nbi, dim/nbj, nth, niter,
 				(long long)td / 1000000000,
-				(long long)td % 1000000000);
+				(long long)td % 1000000000,
+				(long long)tspawn);
 
 			if (nbi == nbj)
 				nbi *= 2;
@@ -0,0 +1,100 @@
+#if LAB >= 9
+/*
+ * Measure cross-node process migration on a cluster
+ * such as the one 'make cluster' boots on a single machine:
+ * round-trip latency for a process with a small address space,
+ * and how fast a migrated process pulls a large address space over.
+ *
+ * Usage: migrbench [node]	(peer node to migrate to; default 2)
+ *
+ * All timing is done back on the home node, since nodes' clocks differ.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+#include <inc/syscall.h>
+
+#include <inc/bench.h>
+
+
+#define PINGPONGS	100		// Round trips to time
+#define MAXMB		16		// Largest address space to pull
+
+static uint8_t buf[MAXMB << 20];	// Pages for the bulk pull test
+
+// Migrate to a given node, or home if node is 0.
+static void
+migrate(int node)
+{
+	sys_get(0, node << 8, NULL, NULL, NULL, 0);
+}
+
+// Fill nbytes of buf with pseudo-random data, so that the pages are
+// neither shared copies of the zero page nor easy to compress.
+static void
+fill(size_t nbytes)
+{
+	uint32_t x = 12345;
+	uint32_t *p = (uint32_t*)buf, *ep = (uint32_t*)(buf + nbytes);
+	for (; p < ep; p++)
+		*p = x = x * 1103515245 + 12345;
+}
+
+// Read one word per page, forcing each page to be pulled.
+static uint32_t
+touch(size_t nbytes)
+{
+	uint32_t sum = 0;
+	size_t i;
+	for (i = 0; i < nbytes; i += PAGESIZE)
+		sum += *(volatile uint32_t*)&buf[i];
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+	int peer = argc > 1 ? atoi(argv[1]) : 2;
+	int i, mb;
+
+	migrate(peer);		// once to warm up
+	migrate(0);
+
+	// Ping-pong: migrate to the peer and straight back home.
+	uint64_t ts = bench_time();
+	for (i = 0; i < PINGPONGS; i++) {
+		migrate(peer);
+		migrate(0);
+	}
+	uint64_t rtt = (bench_time() - ts) / PINGPONGS;
+	printf("migrate round trip to node %d: %lld us\n",
+		peer, (long long)rtt / 1000);
+
+	// Bulk pull: migrate, touch every page on the peer, and come home.
+	// The round trip cost we measured above is subtracted out.
+	for (mb = 1; mb <= MAXMB; mb *= 4) {
+		size_t nbytes = (size_t)mb << 20;
+		fill(nbytes);
+		uint32_t sum = touch(nbytes);
+
+		ts = bench_time();
+		migrate(peer);
+		uint32_t rsum = touch(nbytes);
+		migrate(0);
+		uint64_t td = bench_time() - ts;
+		if (rsum != sum)
+			printf("migrbench: checksum mismatch: %x != %x\n",
+				rsum, sum);
+
+		uint64_t tpull = td > rtt ? td - rtt : 1;
+		printf("pull %d MB: %lld us, %lld KB/s\n", mb,
+			(long long)tpull / 1000,
+			(long long)(((uint64_t)mb << 10) * 1000000000 / tpull));
+	}
+
+	printf("migrbench done\n");
+	return 0;
+}
+
+#endif	// LAB >= 9
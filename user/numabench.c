@@ -0,0 +1,82 @@
+#if LAB >= 9
+/*
+ * Measure memory bandwidth to pages allocated on the local NUMA node,
+ * the node of the CPU that faults them in, against pages on each node
+ * in turn, using sys_memnode() to pick the node the kernel allocates on.
+ * For each placement we time filling fresh zero pages, which includes
+ * the copy-on-write faults that allocate them, and then reading them back.
+ *
+ * On a machine with one node, every placement is local.
+ * We could be rescheduled onto another CPU between tests,
+ * so run it with one CPU per node if the numbers look odd.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/mmu.h>
+#include <inc/syscall.h>
+
+#include <inc/bench.h>
+
+
+#define BUFSIZE		(64 << 20)	// Bytes of memory to test with
+#define READS		4		// Times to read the buffer back
+
+static uint8_t buf[BUFSIZE] gcc_aligned(PAGESIZE);
+
+// Return MB/s for moving nbytes in ns nanoseconds.
+static long long
+mbps(uint64_t nbytes, uint64_t ns)
+{
+	return ns ? (long long)(nbytes * 1000000000 / ns >> 20) : 0;
+}
+
+static void
+test(const char *name, int node)
+{
+	sys_memnode(node);
+
+	// Start over with fresh zero pages, to be allocated on first write.
+	sys_get(SYS_ZERO | SYS_PERM | SYS_RW, 0, NULL, NULL, buf, BUFSIZE);
+
+	uint64_t ts = bench_time();
+	memset(buf, 1, BUFSIZE);
+	uint64_t tfill = bench_time() - ts;
+
+	uint64_t sum = 0;
+	int i;
+	ts = bench_time();
+	for (i = 0; i < READS; i++) {
+		const uint64_t *p = (const uint64_t*)buf;
+		const uint64_t *ep = (const uint64_t*)(buf + BUFSIZE);
+		for (; p < ep; p++)
+			sum += *p;
+	}
+	uint64_t tread = bench_time() - ts;
+	if (sum != (uint64_t)READS * BUFSIZE / 8 * 0x0101010101010101ULL)
+		printf("numabench: checksum mismatch\n");
+
+	printf("%-8s: fill %lld MB/s, read %lld MB/s\n", name,
+		mbps(BUFSIZE, tfill), mbps((uint64_t)READS * BUFSIZE, tread));
+}
+
+int main(int argc, char **argv)
+{
+	int nnodes = sys_memnode(-1);
+	int n;
+
+	printf("numabench: %d NUMA nodes\n", nnodes);
+	test("local", -1);
+	for (n = 0; n < nnodes; n++) {
+		char name[16];
+		snprintf(name, sizeof(name), "node %d", n);
+		test(name, n);
+	}
+	sys_memnode(-1);
+
+	printf("numabench done\n");
+	return 0;
+}
+
+#endif	// LAB >= 9
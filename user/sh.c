@@ -123,17 +123,17 @@ again:
 #endif
 			break;
 			
-#if LAB >= 99
+#if LAB >= 9
 		case '|':	// Pipe
 #if LAB >= 1
 			if ((r = pipe(p)) < 0) {
-				cprintf("pipe: %e", r);
+				cprintf("pipe: %s\n", strerror(errno));
 				exit(EXIT_FAILURE);
 			}
 			if (debug)
 				cprintf("PIPE: %d %d\n", p[0], p[1]);
 			if ((r = fork()) < 0) {
-				cprintf("fork: %e", r);
+				cprintf("fork: %s\n", strerror(errno));
 				exit(EXIT_FAILURE);
 			}
 			if (r == 0) {
@@ -181,7 +181,7 @@ again:
 			panic("| not implemented");
 			break;
 
-#endif	// LAB >= 99
+#endif	// LAB >= 9
 		case 0:		// String is complete
 			// Run the current command!
 			goto runit;
@@ -226,6 +226,43 @@ runit:
 	exit(EXIT_FAILURE);
 }
 
+#if LAB >= 9
+// Run a simple command with no redirections, pipes, or other syntax:
+// such a command needs none of the shell's state in its process,
+// so spawn it directly instead of forking a copy of the shell to exec it.
+// Do not return until the command is finished.
+void
+spawncmd(char *s)
+{
+	char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
+	int argc = 0;
+	pid_t pid;
+
+	gettoken(s, 0);
+	while (gettoken(0, &t) == 'w') {
+		if (argc == MAXARGS-1) {
+			cprintf("sh: too many arguments\n");
+			return;
+		}
+		argv[argc++] = t;
+	}
+	if (argc == 0)
+		return;
+	if (argv[0][0] != '/') {	// PATH=/, as in runcmd()
+		argv0buf[0] = '/';
+		strcpy(argv0buf + 1, argv[0]);
+		argv[0] = argv0buf;
+	}
+	argv[argc] = 0;
+
+	if ((pid = spawnv(argv[0], argv)) < 0) {
+		cprintf("exec %s: %s\n", argv[0], strerror(errno));
+		return;
+	}
+	waitpid(pid, NULL, 0);
+}
+#endif	// LAB >= 9
+
 
 // Get the next token from string s.
 // Set *p1 to the beginning of the token and *p2 just past the token.
@@ -364,6 +401,12 @@ main(int argc, char **argv)
 			printf("%s\n", files->fi[files->cwd].de.d_name);
 			continue;
 		}
+#if LAB >= 9
+		if (strpbrk(buf, SYMBOLS) == NULL) {
+			spawncmd(buf);
+			continue;
+		}
+#endif
 		if (debug)
 			cprintf("BEFORE FORK\n");
 		if ((r = fork()) < 0)
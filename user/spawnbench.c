@@ -0,0 +1,77 @@
+#if LAB >= 9
+/*
+ * Measure the latency of running a shell command
+ * the old way, with a fork() whose child calls execv(),
+ * against the new way, with spawnv() building the program in a fresh child,
+ * as the parent's address space grows.
+ * Each command is a waitpid()ed "/echo -n", which does no work at all.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/unistd.h>
+#include <inc/mmu.h>
+
+#include <inc/bench.h>
+
+
+#define ITERS		100		// Commands to time per test
+#define MAXMB		16		// Largest parent heap to try
+
+static uint8_t buf[MAXMB << 20];	// Parent memory that fork() must copy
+
+static char *const cmd[] = { "/echo", "-n", NULL };
+
+static void
+forkexec(void)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		execv(cmd[0], cmd);
+		cprintf("spawnbench: exec %s failed\n", cmd[0]);
+		exit(EXIT_FAILURE);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+static void
+spawn(void)
+{
+	pid_t pid = spawnv(cmd[0], cmd);
+	if (pid < 0)
+		panic("spawnbench: spawnv %s failed", cmd[0]);
+	waitpid(pid, NULL, 0);
+}
+
+// Return the average time of one command run by 'fn', in nanoseconds.
+static uint64_t
+timecmd(void (*fn)(void))
+{
+	int i;
+	fn();			// once to warm up
+	uint64_t ts = bench_time();
+	for (i = 0; i < ITERS; i++)
+		fn();
+	return (bench_time() - ts) / ITERS;
+}
+
+int main(int argc, char **argv)
+{
+	int mb;
+
+	for (mb = 0; mb <= MAXMB; mb = mb ? mb * 4 : 1) {
+		memset(buf, 1, (size_t)mb << 20);	// give us real pages
+
+		uint64_t tfork = timecmd(forkexec);
+		uint64_t tspawn = timecmd(spawn);
+		printf("%2d MB parent: fork+exec %lld us, spawn %lld us\n", mb,
+			(long long)tfork / 1000, (long long)tspawn / 1000);
+	}
+
+	printf("spawnbench done\n");
+	return 0;
+}
+
+#endif	// LAB >= 9
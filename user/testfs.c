@@ -143,7 +143,8 @@ seekcheck()
 	static char buf2[2048];	// a buffer to use for reading/writing data
 	static char buf3[2048];	// a buffer to use for reading/writing data
 	static const char zeros[1024];	// a buffer of all zeros
-	int i, rc;
+	int i;
+	off_t rc;
 	ssize_t act;
 
 	int fd = open("sh", O_RDWR); assert(fd > 0);
@@ -265,8 +266,8 @@ readdircheck()
 		struct stat st;
 		int rc = stat(de->d_name, &st); assert(rc == 0);
 
-		cprintf("readdircheck: found file '%s' mode 0x%x size %d\n",
-			de->d_name, st.st_mode, st.st_size);
+		cprintf("readdircheck: found file '%s' mode 0x%x size %lld\n",
+			de->d_name, st.st_mode, (long long)st.st_size);
 		count++;
 
 		// Make sure general properties are as we expect
@@ -28,7 +28,8 @@ uint8_t stack[2][STACKSIZE];
 
 
 // Fork a child process, returning 0 in the child and 1 in the parent.
-int
+// (Static, so as not to clash with the C library's Unix fork().)
+static int gcc_noinline
 fork(int cmd, uint8_t child)
 {
 	// Set up the register state for the child